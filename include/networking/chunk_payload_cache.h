@@ -0,0 +1,330 @@
+#ifndef CHUNK_PAYLOAD_CACHE_H_INCLUDED
+#define CHUNK_PAYLOAD_CACHE_H_INCLUDED
+
+#include "render/render_object.h"
+#include "stream/stream.h"
+#include "stream/compressed_stream.h"
+#include "util/position.h"
+#include <memory>
+#include <mutex>
+#include <future>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <functional>
+
+using namespace std;
+
+/** the blocks of one version of a chunk, serialized and compressed without any
+ * per-connection state so that the same bytes can be sent to every client.
+ *
+ * blocks are written as the server's BlockTypeId; the descriptors of the types
+ * in blockTypes have to be sent to a connection before the payload.
+ *
+ * the bytes are the chunk base position followed by the compressed block palette
+ * (uint16 count then the uint16 type ids) and the palette index of every block,
+ * as uint8 if there are at most 256 types and uint16 otherwise.
+ */
+struct ChunkPayload final
+{
+    typedef RenderObjectChunk::BlockChunkType BlockChunkType;
+    PositionI basePosition;
+    uint64_t version; // the version of the BlockChunk snapshot the payload was made from
+    vector<BlockTypeId> blockTypes;
+    vector<uint8_t> bytes;
+    static shared_ptr<const ChunkPayload> make(PositionI basePosition, shared_ptr<const BlockChunkType::Snapshot> pblocks)
+    {
+        const BlockChunkType::Snapshot &blocks = *pblocks;
+        shared_ptr<ChunkPayload> retval = make_shared<ChunkPayload>();
+        retval->basePosition = basePosition;
+        retval->version = blocks.version;
+        vector<size_t> indices;
+        indices.reserve(BlockChunkType::BlocksArrayType::size());
+        unordered_map<BlockTypeId, size_t> paletteIndices;
+        for(size_t i = 0; i < BlockChunkType::BlocksArrayType::size(); i++)
+        {
+            BlockTypeId typeId = blocks.blocks.get(i).typeId;
+            auto iter = paletteIndices.find(typeId);
+            if(iter == paletteIndices.end())
+            {
+                iter = std::get<0>(paletteIndices.insert(make_pair(typeId, retval->blockTypes.size())));
+                retval->blockTypes.push_back(typeId);
+            }
+            indices.push_back(std::get<1>(*iter));
+        }
+        stream::MemoryWriter writer;
+        stream::write<PositionI>(writer, basePosition);
+        {
+            stream::CompressWriter compressWriter(writer);
+            stream::write<uint16_t>(compressWriter, (uint16_t)retval->blockTypes.size());
+            for(BlockTypeId typeId : retval->blockTypes)
+                stream::write<uint16_t>(compressWriter, typeId);
+            bool wideIndices = retval->blockTypes.size() > 0x100;
+            for(size_t index : indices)
+            {
+                if(wideIndices)
+                    compressWriter.writeU16((uint16_t)index);
+                else
+                    compressWriter.writeU8((uint8_t)index);
+            }
+            compressWriter.finish();
+        }
+        retval->bytes = std::move(writer).getBuffer();
+        return retval;
+    }
+    /// reads a payload as a new chunk; getBlock maps the server's block type ids to blocks
+    static shared_ptr<RenderObjectChunk> read(stream::Reader &reader, function<RenderObjectBlock(BlockTypeId typeId)> getBlock)
+    {
+        PositionI basePosition = stream::read_checked<PositionI>(reader, [](PositionI p)
+        {
+            return p == BlockChunkType::getChunkBasePosition(p);
+        });
+        stream::ExpandReader expandReader(reader);
+        size_t paletteSize = stream::read_limited<uint16_t>(expandReader, 1, (uint16_t)min<size_t>(BlockChunkType::BlocksArrayType::size(), 0xFFFF));
+        vector<RenderObjectBlock> palette;
+        palette.reserve(paletteSize);
+        for(size_t i = 0; i < paletteSize; i++)
+            palette.push_back(getBlock(stream::read<uint16_t>(expandReader)));
+        bool wideIndices = paletteSize > 0x100;
+        shared_ptr<RenderObjectChunk> retval = RenderObjectChunk::make(basePosition);
+        retval->blockChunk.edit([&](BlockChunkType::Snapshot &blocks)
+        {
+            for(size_t i = 0; i < BlockChunkType::BlocksArrayType::size(); i++)
+            {
+                size_t index = (wideIndices ? expandReader.readLimitedU16(0, paletteSize - 1) : expandReader.readLimitedU8(0, paletteSize - 1));
+                blocks.blocks.set(i, palette[index]);
+            }
+            return true;
+        });
+        return retval;
+    }
+};
+
+struct ChunkPayloadCacheStatistics
+{
+    uint64_t hits = 0; // payloads found in the cache
+    uint64_t encodes = 0; // payloads serialized and compressed because they weren't cached
+    uint64_t invalidations = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+/** server-side cache of chunk payloads shared by all the connections, keyed by
+ * chunk position and snapshot version.
+ *
+ * each chunk version is encoded once: connections that ask for a version that
+ * is being encoded wait for it instead of encoding it again. at most
+ * getCapacity() chunks are kept, the least recently used are evicted.
+ */
+class ChunkPayloadCache final
+{
+    ChunkPayloadCache(const ChunkPayloadCache &) = delete;
+    const ChunkPayloadCache &operator =(const ChunkPayloadCache &) = delete;
+private:
+    struct Entry final
+    {
+        uint64_t version;
+        shared_future<shared_ptr<const ChunkPayload>> payload;
+        size_t size = 0; // 0 until the payload is ready
+        list<PositionI>::iterator lruPosition;
+    };
+    mutex lock;
+    unordered_map<PositionI, Entry> entries;
+    list<PositionI> lruList; // most recently used first
+    size_t capacity;
+    ChunkPayloadCacheStatistics statistics;
+    void evictExtraEntries() // must hold lock
+    {
+        while(entries.size() > capacity && !lruList.empty())
+        {
+            auto iter = entries.find(lruList.back());
+            statistics.bytes -= std::get<1>(*iter).size;
+            entries.erase(iter);
+            lruList.pop_back();
+            statistics.evictions++;
+        }
+    }
+public:
+    static size_t defaultCapacity()
+    {
+        return 4096;
+    }
+    explicit ChunkPayloadCache(size_t capacity = defaultCapacity())
+        : capacity(capacity)
+    {
+    }
+    /// gets the payload for the current version of chunk, encoding it if it isn't cached
+    shared_ptr<const ChunkPayload> get(const RenderObjectChunk &chunk)
+    {
+        PositionI basePosition = chunk.blockChunk.basePosition;
+        // reading the blocks doesn't count as using the chunk, so a compacted chunk stays compacted
+        uint64_t version = chunk.blockChunk.getVersion();
+        promise<shared_ptr<const ChunkPayload>> encodedPayload;
+        {
+            unique_lock<mutex> lockIt(lock);
+            auto iter = entries.find(basePosition);
+            if(iter != entries.end() && std::get<1>(*iter).version == version)
+            {
+                Entry &entry = std::get<1>(*iter);
+                lruList.splice(lruList.begin(), lruList, entry.lruPosition);
+                statistics.hits++;
+                shared_future<shared_ptr<const ChunkPayload>> payload = entry.payload;
+                lockIt.unlock();
+                return payload.get();
+            }
+            if(iter == entries.end())
+            {
+                lruList.push_front(basePosition);
+                iter = std::get<0>(entries.insert(make_pair(basePosition, Entry())));
+                std::get<1>(*iter).lruPosition = lruList.begin();
+            }
+            else
+            {
+                lruList.splice(lruList.begin(), lruList, std::get<1>(*iter).lruPosition);
+                statistics.bytes -= std::get<1>(*iter).size;
+            }
+            Entry &entry = std::get<1>(*iter);
+            entry.version = version;
+            entry.payload = encodedPayload.get_future().share();
+            entry.size = 0;
+            statistics.encodes++;
+            evictExtraEntries();
+        }
+        // if the chunk changed since version was read this encodes a newer version, which is still correct to send
+        shared_ptr<const ChunkPayload> retval = ChunkPayload::make(basePosition, chunk.blockChunk.peekSnapshot());
+        encodedPayload.set_value(retval);
+        lock_guard<mutex> lockIt(lock);
+        auto iter = entries.find(basePosition);
+        if(iter != entries.end() && std::get<1>(*iter).version == version)
+        {
+            std::get<1>(*iter).size = retval->bytes.size();
+            statistics.bytes += retval->bytes.size();
+        }
+        return retval;
+    }
+    /// drops the cached payload of the chunk at chunkBasePosition; call when its blocks change
+    void invalidate(PositionI chunkBasePosition)
+    {
+        lock_guard<mutex> lockIt(lock);
+        auto iter = entries.find(chunkBasePosition);
+        if(iter == entries.end())
+            return;
+        statistics.bytes -= std::get<1>(*iter).size;
+        lruList.erase(std::get<1>(*iter).lruPosition);
+        entries.erase(iter);
+        statistics.invalidations++;
+    }
+    size_t getCapacity()
+    {
+        lock_guard<mutex> lockIt(lock);
+        return capacity;
+    }
+    void setCapacity(size_t newCapacity)
+    {
+        lock_guard<mutex> lockIt(lock);
+        capacity = newCapacity;
+        evictExtraEntries();
+    }
+    ChunkPayloadCacheStatistics getStatistics()
+    {
+        lock_guard<mutex> lockIt(lock);
+        ChunkPayloadCacheStatistics retval = statistics;
+        retval.entries = entries.size();
+        return retval;
+    }
+};
+
+/** server-side history of the last few snapshots of recently edited chunks, shared by all the
+ * connections, so a changed chunk can be sent as a delta against the version a client has.
+ *
+ * at most historyLength() snapshots are kept for each chunk and at most getCapacity()
+ * chunks are kept, the least recently edited are dropped. a client whose version isn't
+ * in the history anymore gets the whole chunk instead.
+ */
+class ChunkSnapshotHistory final
+{
+    ChunkSnapshotHistory(const ChunkSnapshotHistory &) = delete;
+    const ChunkSnapshotHistory &operator =(const ChunkSnapshotHistory &) = delete;
+public:
+    typedef RenderObjectChunk::BlockChunkType::Snapshot Snapshot;
+private:
+    struct Entry final
+    {
+        deque<shared_ptr<const Snapshot>> snapshots; // oldest first
+        list<PositionI>::iterator lruPosition;
+    };
+    mutex lock;
+    unordered_map<PositionI, Entry> entries;
+    list<PositionI> lruList; // most recently edited first
+    size_t capacity;
+    void removeExtraEntries() // must hold lock
+    {
+        while(entries.size() > capacity && !lruList.empty())
+        {
+            entries.erase(lruList.back());
+            lruList.pop_back();
+        }
+    }
+public:
+    static size_t historyLength()
+    {
+        return 4;
+    }
+    static size_t defaultCapacity()
+    {
+        return 256;
+    }
+    explicit ChunkSnapshotHistory(size_t capacity = defaultCapacity())
+        : capacity(capacity)
+    {
+    }
+    /// remembers blocks as a version of the chunk at chunkBasePosition; call with the snapshot from before each edit
+    void add(PositionI chunkBasePosition, shared_ptr<const Snapshot> blocks)
+    {
+        lock_guard<mutex> lockIt(lock);
+        auto iter = entries.find(chunkBasePosition);
+        if(iter == entries.end())
+        {
+            lruList.push_front(chunkBasePosition);
+            iter = std::get<0>(entries.insert(make_pair(chunkBasePosition, Entry())));
+            std::get<1>(*iter).lruPosition = lruList.begin();
+        }
+        else
+            lruList.splice(lruList.begin(), lruList, std::get<1>(*iter).lruPosition);
+        deque<shared_ptr<const Snapshot>> &snapshots = std::get<1>(*iter).snapshots;
+        if(snapshots.empty() || snapshots.back()->version != blocks->version)
+            snapshots.push_back(blocks);
+        while(snapshots.size() > historyLength())
+            snapshots.pop_front();
+        removeExtraEntries();
+    }
+    /// gets the snapshot of the chunk at chunkBasePosition with version, or nullptr if it isn't kept
+    shared_ptr<const Snapshot> get(PositionI chunkBasePosition, uint64_t version)
+    {
+        lock_guard<mutex> lockIt(lock);
+        auto iter = entries.find(chunkBasePosition);
+        if(iter == entries.end())
+            return nullptr;
+        for(shared_ptr<const Snapshot> blocks : std::get<1>(*iter).snapshots)
+        {
+            if(blocks->version == version)
+                return blocks;
+        }
+        return nullptr;
+    }
+    size_t getCapacity()
+    {
+        lock_guard<mutex> lockIt(lock);
+        return capacity;
+    }
+    void setCapacity(size_t newCapacity)
+    {
+        lock_guard<mutex> lockIt(lock);
+        capacity = newCapacity;
+        removeExtraEntries();
+    }
+};
+
+#endif // CHUNK_PAYLOAD_CACHE_H_INCLUDED
@@ -2,7 +2,31 @@
 #define CLIENT_H_INCLUDED
 
 #include "stream/stream.h"
+#include <functional>
 
 void runClient(shared_ptr<stream::StreamRW> streamRW);
 
+/// the paths the load test bots fly along
+enum class LoadTestPath
+{
+    Random, // between random points around the spawn point
+    Circle, // around the spawn point, each bot starting at a different angle
+};
+
+struct LoadTestOptions
+{
+    size_t botCount = 16;
+    double duration = 60; // in seconds, counted by each bot from when it gets the world
+    LoadTestPath path = LoadTestPath::Random;
+    float speed = 7.5; // in blocks per second
+};
+
+/** runs options.botCount clients without graphics that fly along options.path and get chunks like the
+ * real client, then writes the p50 and p99 chunk latencies, the bytes received, the server tick times
+ * and the connection failures to cout.
+ * connect makes the connection of each bot; a stream::IOException from it is counted as a connection failure.
+ * returns the number of connection failures, including bots that were disconnected early.
+ */
+size_t runLoadTest(LoadTestOptions options, function<shared_ptr<stream::StreamRW>()> connect);
+
 #endif // CLIENT_H_INCLUDED
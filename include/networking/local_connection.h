@@ -0,0 +1,183 @@
+#ifndef LOCAL_CONNECTION_H_INCLUDED
+#define LOCAL_CONNECTION_H_INCLUDED
+
+#include "stream/stream.h"
+#include "stream/network_event.h"
+#include "render/render_object.h"
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+/// a chunk passed by pointer over a LocalConnection
+struct LocalChunk final
+{
+    PositionI basePosition;
+    shared_ptr<const RenderObjectChunk::BlockChunkType::Snapshot> blocks;
+    /// makes a chunk that shares blocks instead of copying them
+    shared_ptr<RenderObjectChunk> makeChunk() const
+    {
+        return RenderObjectChunk::make(RenderObjectChunk::BlockChunkType(basePosition, blocks));
+    }
+};
+
+/** an event passed over a LocalConnection.
+ *
+ * SendNewChunks and SendBlockUpdates events have no payload, their chunks are in chunks instead;
+ * block updates are always whole chunks since they aren't copied. the other events have
+ * their usual payload. the first event the server sends has the world instead of the
+ * RenderObjectWorld written to other connections.
+ */
+struct LocalEvent final
+{
+    NetworkEvent event;
+    vector<LocalChunk> chunks;
+    shared_ptr<RenderObjectWorld> world;
+    LocalEvent(NetworkEvent event = NetworkEvent(), vector<LocalChunk> chunks = vector<LocalChunk>())
+        : event(std::move(event)), chunks(std::move(chunks))
+    {
+    }
+};
+
+/// one direction of a LocalConnection
+class LocalEventQueue final
+{
+    LocalEventQueue(const LocalEventQueue &) = delete;
+    const LocalEventQueue &operator =(const LocalEventQueue &) = delete;
+private:
+    mutex lock;
+    condition_variable cond;
+    deque<LocalEvent> events;
+    bool closed = false;
+public:
+    LocalEventQueue()
+    {
+    }
+    void push(LocalEvent event)
+    {
+        lock_guard<mutex> lockIt(lock);
+        if(closed)
+            throw stream::IOException("can't write to closed local connection");
+        events.push_back(std::move(event));
+        cond.notify_all();
+    }
+    /// waits for the next event; throws stream::EOFException if the queue is closed and empty
+    LocalEvent pop()
+    {
+        unique_lock<mutex> lockIt(lock);
+        while(events.empty())
+        {
+            if(closed)
+                throw stream::EOFException();
+            cond.wait(lockIt);
+        }
+        LocalEvent retval = std::move(events.front());
+        events.pop_front();
+        return retval;
+    }
+    void close()
+    {
+        lock_guard<mutex> lockIt(lock);
+        closed = true;
+        cond.notify_all();
+    }
+};
+
+/** the reader of a LocalConnection port. it doesn't read bytes : users check for it
+ * with dynamic_pointer_cast and call receive instead. destroying it closes its queue.
+ */
+class LocalEventReader final : public stream::Reader
+{
+private:
+    shared_ptr<LocalEventQueue> queue;
+public:
+    explicit LocalEventReader(shared_ptr<LocalEventQueue> queue)
+        : queue(queue)
+    {
+    }
+    virtual ~LocalEventReader()
+    {
+        queue->close();
+    }
+    virtual uint8_t readByte() override
+    {
+        throw stream::IOException("io error : local connections don't pass bytes");
+    }
+    LocalEvent receive()
+    {
+        return queue->pop();
+    }
+    /// receives the world the server sends first
+    shared_ptr<RenderObjectWorld> receiveWorld()
+    {
+        shared_ptr<RenderObjectWorld> retval = receive().world;
+        if(retval == nullptr)
+            throw stream::InvalidDataValueException("local connection didn't start with the world");
+        return retval;
+    }
+};
+
+/** the writer of a LocalConnection port. it doesn't write bytes : users check for it
+ * with dynamic_cast and call send instead. destroying it closes its queue.
+ */
+class LocalEventWriter final : public stream::Writer
+{
+private:
+    shared_ptr<LocalEventQueue> queue;
+public:
+    explicit LocalEventWriter(shared_ptr<LocalEventQueue> queue)
+        : queue(queue)
+    {
+    }
+    virtual ~LocalEventWriter()
+    {
+        queue->close();
+    }
+    virtual void writeByte(uint8_t) override
+    {
+        throw stream::IOException("io error : local connections don't pass bytes");
+    }
+    void send(LocalEvent event)
+    {
+        queue->push(std::move(event));
+    }
+    /// sends the world a client reads first, sharing the chunks' blocks with world
+    void sendWorld(RenderObjectWorld &world)
+    {
+        LocalEvent event;
+        event.world = world.makeLocalCopy();
+        send(std::move(event));
+    }
+};
+
+/** an in-process connection between a Server and a Client that passes events as objects and
+ * chunks as their immutable block snapshots, so nothing is serialized or compressed.
+ * port1 is for the server and port2 is for the client, like StreamBidirectionalPipe.
+ */
+class LocalConnection final
+{
+    LocalConnection(const LocalConnection &) = delete;
+    const LocalConnection &operator =(const LocalConnection &) = delete;
+private:
+    shared_ptr<stream::StreamRW> port1Internal, port2Internal;
+public:
+    LocalConnection()
+    {
+        shared_ptr<LocalEventQueue> queue1 = make_shared<LocalEventQueue>(), queue2 = make_shared<LocalEventQueue>();
+        port1Internal = shared_ptr<stream::StreamRW>(new stream::StreamRWWrapper(make_shared<LocalEventReader>(queue1), make_shared<LocalEventWriter>(queue2)));
+        port2Internal = shared_ptr<stream::StreamRW>(new stream::StreamRWWrapper(make_shared<LocalEventReader>(queue2), make_shared<LocalEventWriter>(queue1)));
+    }
+    shared_ptr<stream::StreamRW> pport1()
+    {
+        return port1Internal;
+    }
+    shared_ptr<stream::StreamRW> pport2()
+    {
+        return port2Internal;
+    }
+};
+
+#endif // LOCAL_CONNECTION_H_INCLUDED
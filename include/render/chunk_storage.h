@@ -0,0 +1,94 @@
+#ifndef CHUNK_STORAGE_H_INCLUDED
+#define CHUNK_STORAGE_H_INCLUDED
+
+#include "render/render_object.h"
+#include "util/position.h"
+#include "util/block_chunk.h"
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <chrono>
+
+using namespace std;
+
+class RegionFile;
+
+/** on-disk chunk store made of region files that each hold a cube of
+ * regionSize chunks on a side.
+ *
+ * each region file starts with a fixed-size index holding the offset, size
+ * and allocated size of every chunk in the region, so a chunk is found with
+ * one lookup. a rewritten chunk goes to free space and the index is updated
+ * after the data is synced, so a crash never leaves a half-written chunk.
+ * region files are memory-mapped for loading.
+ *
+ * chunks are stored as BlockChunk<uint16_t> of storage block ids written
+ * with BlockChunk::write, so the blocks are compressed with CompressWriter.
+ * storage block ids come from the block type table (blocks.dat) that maps
+ * the names passed to registerBlockType to ids that stay the same between runs.
+ *
+ * chunks marked dirty are written by a background writer thread.
+ */
+class ChunkStorage final
+{
+    ChunkStorage(const ChunkStorage &) = delete;
+    const ChunkStorage &operator =(const ChunkStorage &) = delete;
+public:
+    static constexpr int regionSizeShiftAmount = 3;
+    static constexpr int32_t regionSize = (int32_t)1 << regionSizeShiftAmount;
+    static constexpr size_t chunksPerRegion = (size_t)regionSize * regionSize * regionSize;
+    typedef uint16_t StorageBlockId;
+    typedef BlockChunk<StorageBlockId, RenderObjectChunk::BlockChunkType::chunkSizeX, RenderObjectChunk::BlockChunkType::chunkSizeY, RenderObjectChunk::BlockChunkType::chunkSizeZ> StorageChunkType;
+private:
+    const wstring directory;
+    mutex blockTypesLock;
+    vector<wstring> blockTypeNames; // indexed by storage block id, 0 is the null block
+    vector<RenderObjectBlock> storageIdToBlock;
+    unordered_map<wstring, StorageBlockId> nameToStorageId;
+    unordered_map<BlockTypeId, StorageBlockId> blockToStorageId;
+    mutex regionsLock;
+    unordered_map<PositionI, shared_ptr<RegionFile>> regions;
+    static constexpr size_t maxOpenRegionCount = 64;
+    mutex dirtyChunksLock;
+    condition_variable_any dirtyChunksCond;
+    unordered_map<PositionI, shared_ptr<RenderObjectChunk>> dirtyChunks;
+    unordered_map<PositionI, shared_ptr<RenderObjectChunk>> writingChunks; // chunks that the writer is writing
+    bool stopping = false;
+    mutex writeLock; // serializes writeDirtyChunks
+    thread writerThread;
+    static chrono::steady_clock::duration writeInterval()
+    {
+        return chrono::seconds(5);
+    }
+    static PositionI getRegionPosition(PositionI chunkPosition);
+    static size_t getRegionIndex(PositionI chunkPosition);
+    shared_ptr<RegionFile> getRegionFile(PositionI regionPosition, bool create);
+    void readBlockTypes();
+    void writeBlockTypes();
+    shared_ptr<StorageChunkType> toStorageChunk(const RenderObjectChunk::BlockChunkType &blockChunk);
+    shared_ptr<RenderObjectChunk> fromStorageChunk(const StorageChunkType &storageChunk);
+    shared_ptr<RegionFile> writeChunk(shared_ptr<RenderObjectChunk> chunk);
+    void writeDirtyChunks();
+    void writer();
+public:
+    /// opens the world stored in directory, creating it if it doesn't exist
+    explicit ChunkStorage(wstring directory);
+    /// writes all dirty chunks and stops the writer thread
+    ~ChunkStorage();
+    /// gives block a name that is used to find it again when chunks are loaded;
+    /// writing a chunk with a block that is not registered fails
+    void registerBlockType(wstring name, RenderObjectBlock block);
+    /// loads the chunk at chunkPosition; returns nullptr if it isn't stored
+    shared_ptr<RenderObjectChunk> load(PositionI chunkPosition);
+    /// queues chunk to be written by the writer thread.
+    /// the chunk is kept alive until it is written so it can be evicted right away.
+    void markDirty(shared_ptr<RenderObjectChunk> chunk);
+    /// writes all dirty chunks now
+    void flush();
+};
+
+#endif // CHUNK_STORAGE_H_INCLUDED
@@ -7,13 +7,20 @@
 #include "util/variable_set.h"
 #include "util/block_chunk.h"
 #include "util/enum_traits.h"
-#include "util/linked_map.h"
+#include "util/chunk_grid.h"
 #include "util/cached_variable.h"
 #include "physics/physics.h"
 #include <functional>
 #include <algorithm>
 #include <mutex>
+#include <atomic>
+#include <array>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
 #include <iostream>
+#include <chrono>
 
 using namespace std;
 
@@ -48,6 +55,11 @@ constexpr VectorI getDelta(BlockFace face)
     return VectorI(getDX(face), getDY(face), getDZ(face));
 }
 
+constexpr BlockFace getOppositeFace(BlockFace face)
+{
+    return (BlockFace)((uint8_t)face ^ 1); // the faces are in NX, PX, ... pairs
+}
+
 typedef uint32_t BlockDrawClass;
 
 struct RenderObjectBlockDescriptor
@@ -59,7 +71,7 @@ struct RenderObjectBlockDescriptor
     RenderLayer renderLayer = RenderLayer::Opaque;
     shared_ptr<PhysicsObjectConstructor> physicsObjectConstructor;
     VectorF physicsObjectOffset;
-    static bool needRenderFace(BlockFace face, shared_ptr<RenderObjectBlockDescriptor> block, shared_ptr<RenderObjectBlockDescriptor> sideBlock)
+    static bool needRenderFace(BlockFace face, const RenderObjectBlockDescriptor *block, const RenderObjectBlockDescriptor *sideBlock)
     {
         if(!block)
             return false;
@@ -71,10 +83,10 @@ struct RenderObjectBlockDescriptor
             return false;
         return true;
     }
-    static void renderFace(BlockFace face, Mesh &dest, PositionI position, shared_ptr<RenderObjectBlockDescriptor> block, shared_ptr<RenderObjectBlockDescriptor> sideBlock)
+    static void renderFace(BlockFace face, Mesh &dest, PositionI position, const RenderObjectBlockDescriptor *block, const RenderObjectBlockDescriptor *sideBlock)
     {
         if(needRenderFace(face, block, sideBlock))
-            dest.append(transform(Matrix::translate((VectorF)position), block->faceMesh[face]));
+            dest.append(transform(Matrix::translate((VectorF)position), *block->faceMesh[face]));
     }
     static shared_ptr<RenderObjectBlockDescriptor> read(stream::Reader &reader, VariableSet &variableSet)
     {
@@ -104,12 +116,215 @@ struct RenderObjectBlockDescriptor
         stream::write<PhysicsObjectConstructor>(writer, variableSet, physicsObjectConstructor);
         stream::write<VectorF>(writer, physicsObjectOffset);
     }
-    shared_ptr<PhysicsObject> createPhysicsObject(PositionI blockPosition, shared_ptr<PhysicsWorld> pWorld)
+    shared_ptr<PhysicsObject> createPhysicsObject(PositionI blockPosition, shared_ptr<PhysicsWorld> pWorld) const
     {
         return physicsObjectConstructor->make((PositionF)blockPosition + physicsObjectOffset, VectorF(0), pWorld);
     }
 };
 
+typedef uint16_t BlockTypeId;
+
+/// process-wide table that gives every block descriptor a compact id so that
+/// blocks can be copied and looked up without touching reference counts.
+/// descriptors are never unregistered, so looked up pointers stay valid.
+/// descriptors are interned : a descriptor equal to a registered one, like one
+/// read again by another connection, gets the registered descriptor's id.
+class RenderObjectBlockRegistry final
+{
+    RenderObjectBlockRegistry(const RenderObjectBlockRegistry &) = delete;
+    const RenderObjectBlockRegistry &operator =(const RenderObjectBlockRegistry &) = delete;
+public:
+    static constexpr BlockTypeId nullId = 0;
+    static constexpr size_t capacity = 0x10000;
+private:
+    static constexpr size_t pageSizeShiftAmount = 8;
+    static constexpr size_t pageSize = (size_t)1 << pageSizeShiftAmount;
+    static constexpr size_t pageCount = capacity / pageSize;
+    struct Entry
+    {
+        shared_ptr<RenderObjectBlockDescriptor> descriptor;
+        atomic<const RenderObjectBlockDescriptor *> pdescriptor;
+        Entry()
+            : descriptor(), pdescriptor(nullptr)
+        {
+        }
+    };
+    typedef array<Entry, pageSize> Page;
+    array<atomic<Page *>, pageCount> pages;
+    unordered_map<const RenderObjectBlockDescriptor *, BlockTypeId> ids; // the registered descriptors
+    unordered_multimap<string, BlockTypeId> contentIds; // the registered descriptors by getContentKey
+    struct Alias final
+    {
+        weak_ptr<RenderObjectBlockDescriptor> descriptor;
+        BlockTypeId id;
+    };
+    unordered_map<const RenderObjectBlockDescriptor *, Alias> aliases; // descriptors that are equal to registered ones
+    size_t aliasPruneSize = 64;
+    size_t nextId = 1;
+    mutex theLock;
+    static void appendBytes(string &key, const void *bytes, size_t size)
+    {
+        key.append((const char *)bytes, size);
+    }
+    /// the bytes of everything in descriptor but the images' pixels, which descriptorsEqual compares
+    static string getContentKey(const RenderObjectBlockDescriptor &descriptor)
+    {
+        string retval;
+        appendBytes(retval, &descriptor.blockDrawClass, sizeof(descriptor.blockDrawClass));
+        appendBytes(retval, &descriptor.renderLayer, sizeof(descriptor.renderLayer));
+        appendBytes(retval, &descriptor.physicsObjectOffset, sizeof(descriptor.physicsObjectOffset));
+        for(BlockFace face : enum_traits<BlockFace>())
+            retval += (char)descriptor.faceBlocked[face];
+        auto appendMesh = [&retval](const shared_ptr<Mesh> &mesh)
+        {
+            uint64_t size = (mesh == nullptr ? ~(uint64_t)0 : mesh->triangles.size());
+            appendBytes(retval, &size, sizeof(size));
+            if(mesh == nullptr)
+                return;
+            appendBytes(retval, mesh->triangles.data(), mesh->triangles.size() * sizeof(Triangle));
+            uint32_t imageSize[2] = {mesh->image ? mesh->image.width() : 0, mesh->image ? mesh->image.height() : 0};
+            appendBytes(retval, &imageSize[0], sizeof(imageSize));
+        };
+        appendMesh(descriptor.center);
+        for(BlockFace face : enum_traits<BlockFace>())
+            appendMesh(descriptor.faceMesh[face]);
+        if(descriptor.physicsObjectConstructor != nullptr)
+        {
+            stream::MemoryWriter writer;
+            VariableSet variableSet;
+            descriptor.physicsObjectConstructor->write(writer, variableSet);
+            appendBytes(retval, writer.getBuffer().data(), writer.getBuffer().size());
+        }
+        return retval;
+    }
+    static bool imagesEqual(const Image &a, const Image &b)
+    {
+        if(a == b)
+            return true;
+        if(!a || !b || a.width() != b.width() || a.height() != b.height())
+            return false;
+        for(unsigned y = 0; y < a.height(); y++)
+        {
+            for(unsigned x = 0; x < a.width(); x++)
+            {
+                ColorI pa = a.getPixel(x, y), pb = b.getPixel(x, y);
+                if(pa.r != pb.r || pa.g != pb.g || pa.b != pb.b || pa.a != pb.a)
+                    return false;
+            }
+        }
+        return true;
+    }
+    /// returns if a and b are the same besides their images, which are compared here; their content keys have to be equal
+    static bool descriptorImagesEqual(const RenderObjectBlockDescriptor &a, const RenderObjectBlockDescriptor &b)
+    {
+        if((a.center == nullptr) != (b.center == nullptr) || (a.center != nullptr && !imagesEqual(a.center->image, b.center->image)))
+            return false;
+        for(BlockFace face : enum_traits<BlockFace>())
+        {
+            const shared_ptr<Mesh> &meshA = a.faceMesh[face], &meshB = b.faceMesh[face];
+            if((meshA == nullptr) != (meshB == nullptr) || (meshA != nullptr && !imagesEqual(meshA->image, meshB->image)))
+                return false;
+        }
+        return true;
+    }
+    void pruneAliases() // must hold theLock
+    {
+        if(aliases.size() < aliasPruneSize)
+            return;
+        for(auto i = aliases.begin(); i != aliases.end();)
+        {
+            if(std::get<1>(*i).descriptor.expired())
+                i = aliases.erase(i);
+            else
+                i++;
+        }
+        aliasPruneSize = max<size_t>(64, 2 * aliases.size());
+    }
+    RenderObjectBlockRegistry()
+    {
+        for(atomic<Page *> &page : pages)
+            page = nullptr;
+    }
+    ~RenderObjectBlockRegistry()
+    {
+        for(atomic<Page *> &page : pages)
+            delete page.load();
+    }
+    const Entry *getEntry(BlockTypeId id) const
+    {
+        const Page *page = pages[id >> pageSizeShiftAmount].load(memory_order_acquire);
+        if(page == nullptr)
+            return nullptr;
+        return &(*page)[id & (pageSize - 1)];
+    }
+public:
+    static RenderObjectBlockRegistry &get()
+    {
+        static RenderObjectBlockRegistry retval;
+        return retval;
+    }
+    BlockTypeId getId(shared_ptr<RenderObjectBlockDescriptor> descriptor)
+    {
+        if(descriptor == nullptr)
+            return nullId;
+        lock_guard<mutex> lockIt(theLock);
+        auto iter = ids.find(descriptor.get());
+        if(iter != ids.end())
+            return std::get<1>(*iter);
+        auto aliasIter = aliases.find(descriptor.get());
+        if(aliasIter != aliases.end())
+        {
+            // the address could belong to a new descriptor if the old one was destroyed
+            if(std::get<1>(*aliasIter).descriptor.lock() == descriptor)
+                return std::get<1>(*aliasIter).id;
+            aliases.erase(aliasIter);
+        }
+        string contentKey = getContentKey(*descriptor);
+        auto contentRange = contentIds.equal_range(contentKey);
+        for(auto i = std::get<0>(contentRange); i != std::get<1>(contentRange); i++)
+        {
+            BlockTypeId id = std::get<1>(*i);
+            if(!descriptorImagesEqual(*getEntry(id)->descriptor, *descriptor))
+                continue;
+            pruneAliases();
+            Alias &alias = aliases[descriptor.get()];
+            alias.descriptor = descriptor;
+            alias.id = id;
+            return id;
+        }
+        if(nextId >= capacity)
+            throw runtime_error("too many block types registered");
+        BlockTypeId id = (BlockTypeId)nextId++;
+        Page *page = pages[id >> pageSizeShiftAmount].load(memory_order_relaxed);
+        if(page == nullptr)
+        {
+            page = new Page;
+            pages[id >> pageSizeShiftAmount].store(page, memory_order_release);
+        }
+        Entry &entry = (*page)[id & (pageSize - 1)];
+        entry.descriptor = descriptor;
+        entry.pdescriptor.store(descriptor.get(), memory_order_release);
+        ids[descriptor.get()] = id;
+        contentIds.insert(make_pair(std::move(contentKey), id));
+        return id;
+    }
+    const RenderObjectBlockDescriptor *getDescriptor(BlockTypeId id) const
+    {
+        if(id == nullId)
+            return nullptr;
+        const Entry *entry = getEntry(id);
+        if(entry == nullptr)
+            return nullptr;
+        return entry->pdescriptor.load(memory_order_acquire);
+    }
+    shared_ptr<RenderObjectBlockDescriptor> getDescriptorPtr(BlockTypeId id)
+    {
+        if(getDescriptor(id) == nullptr)
+            return nullptr;
+        return getEntry(id)->descriptor;
+    }
+};
+
 struct RenderObjectEntityPart
 {
     shared_ptr<Mesh> mesh;
@@ -211,56 +426,55 @@ struct is_value_changed<RenderObjectEntity>
 
 struct RenderObjectBlock
 {
-    shared_ptr<RenderObjectBlockDescriptor> descriptor;
-    shared_ptr<PhysicsObject> physicsObject;
-    void draw(Mesh &dest, RenderLayer renderLayer, PositionI position, const RenderObjectBlock & nx, const RenderObjectBlock & px, const RenderObjectBlock & ny, const RenderObjectBlock & py, const RenderObjectBlock & nz, const RenderObjectBlock & pz)
+    BlockTypeId typeId;
+    const RenderObjectBlockDescriptor *descriptor() const
+    {
+        return RenderObjectBlockRegistry::get().getDescriptor(typeId);
+    }
+    void draw(Mesh &dest, RenderLayer renderLayer, PositionI position, const RenderObjectBlock & nx, const RenderObjectBlock & px, const RenderObjectBlock & ny, const RenderObjectBlock & py, const RenderObjectBlock & nz, const RenderObjectBlock & pz) const
     {
-        if(descriptor == nullptr || descriptor->renderLayer != renderLayer)
+        const RenderObjectBlockDescriptor *pdescriptor = descriptor();
+        if(pdescriptor == nullptr || pdescriptor->renderLayer != renderLayer)
             return;
-        dest.append(transform(Matrix::translate((VectorF)position), descriptor->center));
-        RenderObjectBlockDescriptor::renderFace(BlockFace::NX, dest, position, descriptor, nx.descriptor);
-        RenderObjectBlockDescriptor::renderFace(BlockFace::PX, dest, position, descriptor, px.descriptor);
-        RenderObjectBlockDescriptor::renderFace(BlockFace::NY, dest, position, descriptor, ny.descriptor);
-        RenderObjectBlockDescriptor::renderFace(BlockFace::PY, dest, position, descriptor, py.descriptor);
-        RenderObjectBlockDescriptor::renderFace(BlockFace::NZ, dest, position, descriptor, nz.descriptor);
-        RenderObjectBlockDescriptor::renderFace(BlockFace::PZ, dest, position, descriptor, pz.descriptor);
+        dest.append(transform(Matrix::translate((VectorF)position), *pdescriptor->center));
+        RenderObjectBlockDescriptor::renderFace(BlockFace::NX, dest, position, pdescriptor, nx.descriptor());
+        RenderObjectBlockDescriptor::renderFace(BlockFace::PX, dest, position, pdescriptor, px.descriptor());
+        RenderObjectBlockDescriptor::renderFace(BlockFace::NY, dest, position, pdescriptor, ny.descriptor());
+        RenderObjectBlockDescriptor::renderFace(BlockFace::PY, dest, position, pdescriptor, py.descriptor());
+        RenderObjectBlockDescriptor::renderFace(BlockFace::NZ, dest, position, pdescriptor, nz.descriptor());
+        RenderObjectBlockDescriptor::renderFace(BlockFace::PZ, dest, position, pdescriptor, pz.descriptor());
     }
     static RenderObjectBlock read(stream::Reader &reader, VariableSet &variableSet)
     {
-        RenderObjectBlock retval;
-        retval.descriptor = stream::read<RenderObjectBlockDescriptor>(reader, variableSet);
-        return retval;
+        return RenderObjectBlock((shared_ptr<RenderObjectBlockDescriptor>)stream::read<RenderObjectBlockDescriptor>(reader, variableSet));
     }
     void write(stream::Writer &writer, VariableSet &variableSet) const
     {
-        stream::write<RenderObjectBlockDescriptor>(writer, variableSet, descriptor);
+        stream::write<RenderObjectBlockDescriptor>(writer, variableSet, RenderObjectBlockRegistry::get().getDescriptorPtr(typeId));
+    }
+    constexpr RenderObjectBlock(BlockTypeId typeId = RenderObjectBlockRegistry::nullId)
+        : typeId(typeId)
+    {
     }
-    RenderObjectBlock(shared_ptr<RenderObjectBlockDescriptor> descriptor = nullptr)
-        : descriptor(descriptor)
+    RenderObjectBlock(shared_ptr<RenderObjectBlockDescriptor> descriptor)
+        : typeId(RenderObjectBlockRegistry::get().getId(descriptor))
     {
     }
     explicit operator bool() const
     {
-        return (bool)descriptor;
+        return typeId != RenderObjectBlockRegistry::nullId;
     }
-    bool operator ~() const
+    bool operator ==(const RenderObjectBlock &rt) const
     {
-        return !descriptor;
+        return typeId == rt.typeId;
     }
-    void createPhysicsObject(shared_ptr<PhysicsWorld> pWorld, PositionI position)
+    bool operator !=(const RenderObjectBlock &rt) const
     {
-        if(physicsObject)
-            physicsObject->destroy();
-        if(descriptor)
-            physicsObject = descriptor->createPhysicsObject(position, pWorld);
-        else
-            physicsObject = nullptr;
+        return typeId != rt.typeId;
     }
-    void destroyPhysicsObject()
+    bool operator ~() const
     {
-        if(physicsObject)
-            physicsObject->destroy();
-        physicsObject = nullptr;
+        return typeId == RenderObjectBlockRegistry::nullId;
     }
 };
 
@@ -293,60 +507,88 @@ struct RenderObjectChunk
     static_assert(BlockChunkType::chunkSizeY % subChunkSize == 0, "BlockChunkType::chunkSizeY is not divisible by subChunkSize");
     static_assert(BlockChunkType::chunkSizeZ % subChunkSize == 0, "BlockChunkType::chunkSizeZ is not divisible by subChunkSize");
     enum_array<array<array<array<Mesh, BlockChunkType::chunkSizeZ / subChunkSize>, BlockChunkType::chunkSizeY / subChunkSize>, BlockChunkType::chunkSizeX / subChunkSize>, RenderLayer> subChunkMeshes;
-    enum_array<array<array<array<atomic_bool, BlockChunkType::chunkSizeZ / subChunkSize>, BlockChunkType::chunkSizeY / subChunkSize>, BlockChunkType::chunkSizeX / subChunkSize>, RenderLayer> subChunkMeshesValid;
+    static constexpr int32_t subChunkCountX = BlockChunkType::chunkSizeX / subChunkSize;
+    static constexpr int32_t subChunkCountY = BlockChunkType::chunkSizeY / subChunkSize;
+    static constexpr int32_t subChunkCountZ = BlockChunkType::chunkSizeZ / subChunkSize;
+    typedef uint64_t SubChunkMask; // one bit per sub-chunk
+    static_assert((size_t)subChunkCountX * subChunkCountY * subChunkCountZ <= 64, "too many sub-chunks for SubChunkMask");
+    atomic<SubChunkMask> dirtySubChunks; // sub-chunks whose meshes need to be generated, in every render layer
     mutex generateMeshesLock;
     enum_array<CachedVariable<Mesh>, RenderLayer> drawMesh;
     atomic_bool meshesValid;
+    unordered_map<PositionI, shared_ptr<PhysicsObject>> physicsObjects; // physics objects for the blocks in this chunk
+    mutex physicsObjectsLock;
+    atomic_uint_fast64_t lastUseEpoch; // the RenderObjectWorld eviction epoch when this chunk was last used
+    atomic_int_fast64_t lastUseTime; // steady_clock time in nanoseconds when this chunk was last used, for RenderObjectWorld::compactColdChunks
+    atomic_size_t compactedBytesSaved; // bytes saved by the last compaction
+    static int_fast64_t getCurrentTime()
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
     RenderObjectChunk(PositionI position)
-        : blockChunk(position), meshesValid(false)
+        : blockChunk(position), dirtySubChunks(getAllSubChunks()), meshesValid(false), lastUseEpoch(0), lastUseTime(getCurrentTime()), compactedBytesSaved(0)
     {
         for(atomic_bool &v : cachedMeshValid)
             v = false;
-        for(auto &block : subChunkMeshesValid)
-        {
-            for(auto &slab : block)
-            {
-                for(auto &column : slab)
-                {
-                    for(atomic_bool &v : column)
-                        v = false;
-                }
-            }
-        }
     }
     RenderObjectChunk(const BlockChunkType & chunk)
-        : blockChunk(chunk), meshesValid(false)
+        : blockChunk(chunk), dirtySubChunks(getAllSubChunks()), meshesValid(false), lastUseEpoch(0), lastUseTime(getCurrentTime()), compactedBytesSaved(0)
     {
         for(atomic_bool &v : cachedMeshValid)
             v = false;
-        for(auto &block : subChunkMeshesValid)
+    }
+    /// makes this chunk an empty chunk at position, keeping the mesh buffers' capacity;
+    /// only for RenderObjectChunkPool
+    void reset(PositionI position)
+    {
+        blockChunk.reset(position);
+        resetDerivedState();
+    }
+    /// makes this chunk share the blocks of chunk, keeping the mesh buffers' capacity;
+    /// only for RenderObjectChunkPool
+    void reset(const BlockChunkType & chunk)
+    {
+        blockChunk.reset(chunk);
+        resetDerivedState();
+    }
+    static shared_ptr<RenderObjectChunk> make(PositionI position);
+    static shared_ptr<RenderObjectChunk> make(const BlockChunkType & chunk);
+private:
+    void resetDerivedState()
+    {
         {
-            for(auto &slab : block)
+            lock_guard<mutex> lockIt(generateMeshesLock);
+            for(RenderLayer renderLayer : enum_traits<RenderLayer>())
             {
-                for(auto &column : slab)
+                for(auto &slab : subChunkMeshes[renderLayer])
+                {
+                    for(auto &column : slab)
+                    {
+                        for(Mesh &mesh : column)
+                            mesh.clear();
+                    }
+                }
+                for(int i = 0; i < 2; i++) // clear both buffers
                 {
-                    for(atomic_bool &v : column)
-                        v = false;
+                    drawMesh[renderLayer].writeRef().clear();
+                    drawMesh[renderLayer].finishWrite();
                 }
+                cachedMesh[renderLayer] = nullptr;
             }
         }
+        invalidateMeshes();
+        {
+            lock_guard<mutex> lockIt(physicsObjectsLock);
+            physicsObjects.clear();
+        }
+        lastUseEpoch = 0;
+        lastUseTime = getCurrentTime();
+        compactedBytesSaved = 0;
     }
+public:
     void invalidateMeshes()
     {
-        meshesValid = false;
-        for(atomic_bool &v : cachedMeshValid)
-            v = false;
-        for(auto &block : subChunkMeshesValid)
-        {
-            for(auto &slab : block)
-            {
-                for(auto &column : slab)
-                {
-                    for(atomic_bool &v : column)
-                        v = false;
-                }
-            }
-        }
+        invalidateMeshes(getAllSubChunks());
     }
     void invalidate()
     {
@@ -356,31 +598,85 @@ struct RenderObjectChunk
     void invalidateMeshes(PositionI position)
     {
         assert(position.d == blockChunk.basePosition.d);
-        meshesValid = false;
-        for(atomic_bool &v : cachedMeshValid)
-            v = false;
         VectorI relativePosition = position - blockChunk.basePosition;
-        assert(relativePosition.x >= 0 && relativePosition.x < BlockChunkType::chunkSizeX);
-        assert(relativePosition.y >= 0 && relativePosition.y < BlockChunkType::chunkSizeY);
-        assert(relativePosition.z >= 0 && relativePosition.z < BlockChunkType::chunkSizeZ);
-        VectorI subChunkPos = VectorI(relativePosition.x >> subChunkSizeShiftAmount,
-                                      relativePosition.y >> subChunkSizeShiftAmount,
-                                      relativePosition.z >> subChunkSizeShiftAmount);
-        for(auto &chunk : subChunkMeshesValid)
-            chunk[subChunkPos.x][subChunkPos.y][subChunkPos.z] = false;
+        assert(isInChunk(relativePosition));
+        invalidateMeshes(getSubChunkBit(relativePosition));
     }
     void invalidate(PositionI position)
     {
         invalidateMeshes(position);
         blockChunk.onChange();
     }
+    static SubChunkMask getSubChunkBit(VectorI relativePosition)
+    {
+        return (SubChunkMask)1 << (((relativePosition.x >> subChunkSizeShiftAmount) * subChunkCountY + (relativePosition.y >> subChunkSizeShiftAmount)) * subChunkCountZ + (relativePosition.z >> subChunkSizeShiftAmount));
+    }
+    static constexpr SubChunkMask getAllSubChunks()
+    {
+        return (size_t)subChunkCountX * subChunkCountY * subChunkCountZ == 64 ? ~(SubChunkMask)0 : ((SubChunkMask)1 << ((size_t)subChunkCountX * subChunkCountY * subChunkCountZ)) - 1;
+    }
+    static bool isInChunk(VectorI relativePosition)
+    {
+        return relativePosition.x >= 0 && relativePosition.x < BlockChunkType::chunkSizeX
+            && relativePosition.y >= 0 && relativePosition.y < BlockChunkType::chunkSizeY
+            && relativePosition.z >= 0 && relativePosition.z < BlockChunkType::chunkSizeZ;
+    }
+    /// gets the sub-chunks that touch face of the chunk
+    static SubChunkMask getFaceSubChunks(BlockFace face)
+    {
+        SubChunkMask retval = 0;
+        for(int32_t x = 0; x < BlockChunkType::chunkSizeX; x += subChunkSize)
+        {
+            for(int32_t y = 0; y < BlockChunkType::chunkSizeY; y += subChunkSize)
+            {
+                for(int32_t z = 0; z < BlockChunkType::chunkSizeZ; z += subChunkSize)
+                {
+                    VectorI relativePosition = VectorI(x, y, z);
+                    if(!isInChunk(relativePosition + getDelta(face) * subChunkSize))
+                        retval |= getSubChunkBit(relativePosition);
+                }
+            }
+        }
+        return retval;
+    }
+    /** gets the sub-chunks of this chunk whose meshes depend on the block at relativePosition :
+     * its own sub-chunk and the sub-chunks of its neighbors in this chunk.
+     * calls borderFn with the relative position of every neighbor that is in another chunk.
+     */
+    template <typename Fn>
+    static SubChunkMask getBlockSubChunks(VectorI relativePosition, Fn borderFn)
+    {
+        SubChunkMask retval = getSubChunkBit(relativePosition);
+        for(BlockFace face : enum_traits<BlockFace>())
+        {
+            VectorI neighborPosition = relativePosition + getDelta(face);
+            if(isInChunk(neighborPosition))
+                retval |= getSubChunkBit(neighborPosition);
+            else
+                borderFn(neighborPosition);
+        }
+        return retval;
+    }
+    /// marks the sub-chunks in mask dirty so generateDrawMeshes regenerates their meshes
+    void invalidateMeshes(SubChunkMask mask)
+    {
+        if(mask == 0)
+            return;
+        dirtySubChunks.fetch_or(mask);
+        for(atomic_bool &v : cachedMeshValid)
+            v = false;
+        meshesValid = false; // after setting dirtySubChunks so generateDrawMeshes can't miss the new bits
+    }
+    /// gets the sub-chunks whose meshes will be regenerated by the next generateDrawMeshes
+    SubChunkMask getDirtySubChunks() const
+    {
+        return dirtySubChunks.load();
+    }
 private:
-    const Mesh &generateSubChunkDrawMeshes(RenderLayer renderLayer, VectorI subChunkPosition, shared_ptr<RenderObjectChunk> nx, shared_ptr<RenderObjectChunk> px, shared_ptr<RenderObjectChunk> ny, shared_ptr<RenderObjectChunk> py, shared_ptr<RenderObjectChunk> nz, shared_ptr<RenderObjectChunk> pz)
+    typedef shared_ptr<const BlockChunkType::Snapshot> BlocksSnapshot;
+    const Mesh &generateSubChunkDrawMeshes(RenderLayer renderLayer, VectorI subChunkPosition, const BlocksSnapshot &blocks, const BlocksSnapshot &nx, const BlocksSnapshot &px, const BlocksSnapshot &ny, const BlocksSnapshot &py, const BlocksSnapshot &nz, const BlocksSnapshot &pz)
     {
-        atomic_bool &subChunkValid = subChunkMeshesValid[renderLayer][subChunkPosition.x >> subChunkSizeShiftAmount][subChunkPosition.y >> subChunkSizeShiftAmount][subChunkPosition.z >> subChunkSizeShiftAmount];
         Mesh &mesh = subChunkMeshes[renderLayer][subChunkPosition.x >> subChunkSizeShiftAmount][subChunkPosition.y >> subChunkSizeShiftAmount][subChunkPosition.z >> subChunkSizeShiftAmount];
-        if(subChunkValid)
-            return mesh;
         mesh.clear();
         for(int32_t dx = subChunkPosition.x; dx < subChunkPosition.x + subChunkSize; dx++)
         {
@@ -390,17 +686,16 @@ private:
                 {
                     VectorI dpos = VectorI(dx, dy, dz);
                     PositionI pos = blockChunk.basePosition + dpos;
-                    RenderObjectBlock bnx = (dx <= 0 ? (nx != nullptr ? nx->blockChunk.blocks[BlockChunkType::chunkSizeX - 1][dy][dz] : RenderObjectBlock()) : blockChunk.blocks[dx - 1][dy][dz]);
-                    RenderObjectBlock bny = (dy <= 0 ? (ny != nullptr ? ny->blockChunk.blocks[dx][BlockChunkType::chunkSizeY - 1][dz] : RenderObjectBlock()) : blockChunk.blocks[dx][dy - 1][dz]);
-                    RenderObjectBlock bnz = (dz <= 0 ? (nz != nullptr ? nz->blockChunk.blocks[dx][dy][BlockChunkType::chunkSizeZ - 1] : RenderObjectBlock()) : blockChunk.blocks[dx][dy][dz - 1]);
-                    RenderObjectBlock bpx = (dx >= BlockChunkType::chunkSizeX - 1 ? (px != nullptr ? px->blockChunk.blocks[0][dy][dz] : RenderObjectBlock()) : blockChunk.blocks[dx + 1][dy][dz]);
-                    RenderObjectBlock bpy = (dy >= BlockChunkType::chunkSizeY - 1 ? (py != nullptr ? py->blockChunk.blocks[dx][0][dz] : RenderObjectBlock()) : blockChunk.blocks[dx][dy + 1][dz]);
-                    RenderObjectBlock bpz = (dz >= BlockChunkType::chunkSizeZ - 1 ? (pz != nullptr ? pz->blockChunk.blocks[dx][dy][0] : RenderObjectBlock()) : blockChunk.blocks[dx][dy][dz + 1]);
-                    blockChunk.blocks[dx][dy][dz].draw(mesh, renderLayer, pos, bnx, bpx, bny, bpy, bnz, bpz);
+                    RenderObjectBlock bnx = (dx <= 0 ? (nx != nullptr ? nx->get(BlockChunkType::chunkSizeX - 1, dy, dz) : RenderObjectBlock()) : blocks->get(dx - 1, dy, dz));
+                    RenderObjectBlock bny = (dy <= 0 ? (ny != nullptr ? ny->get(dx, BlockChunkType::chunkSizeY - 1, dz) : RenderObjectBlock()) : blocks->get(dx, dy - 1, dz));
+                    RenderObjectBlock bnz = (dz <= 0 ? (nz != nullptr ? nz->get(dx, dy, BlockChunkType::chunkSizeZ - 1) : RenderObjectBlock()) : blocks->get(dx, dy, dz - 1));
+                    RenderObjectBlock bpx = (dx >= BlockChunkType::chunkSizeX - 1 ? (px != nullptr ? px->get(0, dy, dz) : RenderObjectBlock()) : blocks->get(dx + 1, dy, dz));
+                    RenderObjectBlock bpy = (dy >= BlockChunkType::chunkSizeY - 1 ? (py != nullptr ? py->get(dx, 0, dz) : RenderObjectBlock()) : blocks->get(dx, dy + 1, dz));
+                    RenderObjectBlock bpz = (dz >= BlockChunkType::chunkSizeZ - 1 ? (pz != nullptr ? pz->get(dx, dy, 0) : RenderObjectBlock()) : blocks->get(dx, dy, dz + 1));
+                    blocks->get(dx, dy, dz).draw(mesh, renderLayer, pos, bnx, bpx, bny, bpy, bnz, bpz);
                 }
             }
         }
-        subChunkValid = true;
         return mesh;
     }
 public:
@@ -409,6 +704,16 @@ public:
         lock_guard<mutex> lockIt(generateMeshesLock);
         if(meshesValid)
             return false;
+        meshesValid = true; // before taking the dirty sub-chunks so that an invalidation that comes in while generating isn't lost
+        SubChunkMask dirty = dirtySubChunks.exchange(0);
+        // pin one version of this chunk and its neighbors so the meshes are consistent while other threads edit them
+        BlocksSnapshot blocks = blockChunk.getSnapshot();
+        BlocksSnapshot nxBlocks = (nx != nullptr ? nx->blockChunk.getSnapshot() : nullptr);
+        BlocksSnapshot pxBlocks = (px != nullptr ? px->blockChunk.getSnapshot() : nullptr);
+        BlocksSnapshot nyBlocks = (ny != nullptr ? ny->blockChunk.getSnapshot() : nullptr);
+        BlocksSnapshot pyBlocks = (py != nullptr ? py->blockChunk.getSnapshot() : nullptr);
+        BlocksSnapshot nzBlocks = (nz != nullptr ? nz->blockChunk.getSnapshot() : nullptr);
+        BlocksSnapshot pzBlocks = (pz != nullptr ? pz->blockChunk.getSnapshot() : nullptr);
         for(RenderLayer renderLayer : enum_traits<RenderLayer>())
         {
             Mesh & mesh = drawMesh[renderLayer].writeRef();
@@ -419,27 +724,48 @@ public:
                 {
                     for(int32_t dz = 0; dz < BlockChunkType::chunkSizeZ; dz += subChunkSize)
                     {
-                        mesh.append(generateSubChunkDrawMeshes(renderLayer, VectorI(dx, dy, dz), nx, px, ny, py, nz, pz));
+                        VectorI subChunkPosition = VectorI(dx, dy, dz);
+                        if(dirty & getSubChunkBit(subChunkPosition))
+                            mesh.append(generateSubChunkDrawMeshes(renderLayer, subChunkPosition, blocks, nxBlocks, pxBlocks, nyBlocks, pyBlocks, nzBlocks, pzBlocks));
+                        else
+                            mesh.append(subChunkMeshes[renderLayer][dx >> subChunkSizeShiftAmount][dy >> subChunkSizeShiftAmount][dz >> subChunkSizeShiftAmount]);
                     }
                 }
             }
             drawMesh[renderLayer].finishWrite();
             cachedMeshValid[renderLayer] = false;
         }
-        meshesValid = true;
         return true;
     }
     const Mesh & getDrawMesh(RenderLayer renderLayer)
     {
         return drawMesh[renderLayer].read();
     }
+    size_t getMemoryUsage() // approximate number of bytes used by this chunk, its meshes and its cached meshes
+    {
+        size_t retval = sizeof(RenderObjectChunk) + blockChunk.getMemoryUsage();
+        lock_guard<mutex> lockIt(generateMeshesLock);
+        for(RenderLayer renderLayer : enum_traits<RenderLayer>())
+        {
+            for(auto &slab : subChunkMeshes[renderLayer])
+            {
+                for(auto &column : slab)
+                {
+                    for(Mesh &mesh : column)
+                        retval += mesh.triangles.capacity() * sizeof(Triangle);
+                }
+            }
+            size_t drawMeshSize = drawMesh[renderLayer].read().triangles.capacity() * sizeof(Triangle);
+            retval += 2 * drawMeshSize; // drawMesh is double buffered
+            if(cachedMesh[renderLayer])
+                retval += drawMeshSize;
+        }
+        return retval;
+    }
     static shared_ptr<RenderObjectChunk> read(stream::Reader &reader, VariableSet &variableSet)
     {
         shared_ptr<BlockChunkType> readBlockChunk = BlockChunkType::read(reader, variableSet);
-        shared_ptr<RenderObjectChunk> retval = make_shared<RenderObjectChunk>(readBlockChunk->basePosition);
-        retval->blockChunk.blocks = readBlockChunk->blocks;
-        retval->blockChunk.onChange();
-        return retval;
+        return make(*readBlockChunk);
     }
     void write(stream::Writer &writer, VariableSet &variableSet)
     {
@@ -461,10 +787,26 @@ public:
             maxPosition.y = BlockChunkType::chunkSizeY - 1;
         if(maxPosition.z > BlockChunkType::chunkSizeZ - 1)
             maxPosition.z = BlockChunkType::chunkSizeZ - 1;
+        BlocksSnapshot blocks = blockChunk.getSnapshot();
+        lock_guard<mutex> lockIt(physicsObjectsLock);
         for(int32_t x = minPosition.x; x <= maxPosition.x; x++)
+        {
             for(int32_t y = minPosition.y; y <= maxPosition.y; y++)
+            {
                 for(int32_t z = minPosition.z; z <= maxPosition.z; z++)
-                    blockChunk.blocks[x][y][z].createPhysicsObject(pWorld, blockChunk.basePosition + VectorI(x, y, z));
+                {
+                    PositionI position = blockChunk.basePosition + VectorI(x, y, z);
+                    shared_ptr<PhysicsObject> &physicsObject = physicsObjects[position];
+                    if(physicsObject)
+                        physicsObject->destroy();
+                    const RenderObjectBlockDescriptor *descriptor = blocks->get(x, y, z).descriptor();
+                    if(descriptor)
+                        physicsObject = descriptor->createPhysicsObject(position, pWorld);
+                    else
+                        physicsObjects.erase(position);
+                }
+            }
+        }
     }
     void destroyPhysicsObjects(VectorI minPosition, VectorI maxPosition)
     {
@@ -482,10 +824,22 @@ public:
             maxPosition.y = BlockChunkType::chunkSizeY - 1;
         if(maxPosition.z > BlockChunkType::chunkSizeZ - 1)
             maxPosition.z = BlockChunkType::chunkSizeZ - 1;
+        lock_guard<mutex> lockIt(physicsObjectsLock);
         for(int32_t x = minPosition.x; x <= maxPosition.x; x++)
+        {
             for(int32_t y = minPosition.y; y <= maxPosition.y; y++)
+            {
                 for(int32_t z = minPosition.z; z <= maxPosition.z; z++)
-                    blockChunk.blocks[x][y][z].destroyPhysicsObject();
+                {
+                    auto iter = physicsObjects.find(blockChunk.basePosition + VectorI(x, y, z));
+                    if(iter == physicsObjects.end())
+                        continue;
+                    if(std::get<1>(*iter))
+                        std::get<1>(*iter)->destroy();
+                    physicsObjects.erase(iter);
+                }
+            }
+        }
     }
 };
 
@@ -503,59 +857,441 @@ struct is_value_changed<RenderObjectChunk>
 };
 }
 
+struct ChunkPoolStatistics
+{
+    uint64_t allocatedChunks = 0; // chunks made with new because the pool was empty
+    uint64_t reusedChunks = 0; // chunks taken from the pool
+    uint64_t recycledChunks = 0; // released chunks put back in the pool
+    uint64_t freedChunks = 0; // released chunks deleted because the pool was full
+    size_t pooledChunks = 0;
+    size_t capacity = 0;
+};
+
+/** pool of released RenderObjectChunk objects so that loading and unloading
+ * chunks reuses the chunk objects and the capacity of their mesh buffers
+ * instead of going through the allocator.
+ *
+ * a released chunk keeps its meshes' capacity and drops its blocks, cached
+ * meshes and physics objects. at most getCapacity() chunks are kept, the rest
+ * are deleted.
+ */
+class RenderObjectChunkPool final
+{
+    RenderObjectChunkPool(const RenderObjectChunkPool &) = delete;
+    const RenderObjectChunkPool &operator =(const RenderObjectChunkPool &) = delete;
+    mutex lock;
+    vector<RenderObjectChunk *> freeChunks;
+    size_t capacity = defaultCapacity();
+    ChunkPoolStatistics statistics;
+    RenderObjectChunkPool()
+    {
+    }
+    static size_t defaultCapacity()
+    {
+        return 256;
+    }
+    void release(RenderObjectChunk *chunk)
+    {
+        chunk->reset(PositionI()); // drops the blocks now instead of when it's reused
+        unique_lock<mutex> lockIt(lock);
+        if(freeChunks.size() >= capacity)
+        {
+            statistics.freedChunks++;
+            lockIt.unlock();
+            delete chunk;
+            return;
+        }
+        statistics.recycledChunks++;
+        freeChunks.push_back(chunk);
+    }
+    template <typename Arg>
+    shared_ptr<RenderObjectChunk> makeChunk(const Arg &arg)
+    {
+        RenderObjectChunk *chunk = nullptr;
+        {
+            lock_guard<mutex> lockIt(lock);
+            if(!freeChunks.empty())
+            {
+                chunk = freeChunks.back();
+                freeChunks.pop_back();
+                statistics.reusedChunks++;
+            }
+            else
+                statistics.allocatedChunks++;
+        }
+        if(chunk == nullptr)
+            chunk = new RenderObjectChunk(arg);
+        else
+            chunk->reset(arg);
+        return shared_ptr<RenderObjectChunk>(chunk, [this](RenderObjectChunk *releasedChunk)
+        {
+            release(releasedChunk);
+        });
+    }
+public:
+    /// the pool is never destroyed so chunks can be released during exit
+    static RenderObjectChunkPool &get()
+    {
+        static RenderObjectChunkPool *retval = new RenderObjectChunkPool;
+        return *retval;
+    }
+    shared_ptr<RenderObjectChunk> make(PositionI position)
+    {
+        return makeChunk(position);
+    }
+    shared_ptr<RenderObjectChunk> make(const RenderObjectChunk::BlockChunkType &chunk)
+    {
+        return makeChunk(chunk);
+    }
+    size_t getCapacity()
+    {
+        lock_guard<mutex> lockIt(lock);
+        return capacity;
+    }
+    /// sets the maximum number of released chunks kept for reuse, deleting the extra ones
+    void setCapacity(size_t newCapacity)
+    {
+        vector<RenderObjectChunk *> extraChunks;
+        {
+            lock_guard<mutex> lockIt(lock);
+            capacity = newCapacity;
+            while(freeChunks.size() > capacity)
+            {
+                extraChunks.push_back(freeChunks.back());
+                freeChunks.pop_back();
+                statistics.freedChunks++;
+            }
+        }
+        for(RenderObjectChunk *chunk : extraChunks)
+            delete chunk;
+    }
+    ChunkPoolStatistics getStatistics()
+    {
+        lock_guard<mutex> lockIt(lock);
+        ChunkPoolStatistics retval = statistics;
+        retval.pooledChunks = freeChunks.size();
+        retval.capacity = capacity;
+        return retval;
+    }
+};
+
+inline shared_ptr<RenderObjectChunk> RenderObjectChunk::make(PositionI position)
+{
+    return RenderObjectChunkPool::get().make(position);
+}
+
+inline shared_ptr<RenderObjectChunk> RenderObjectChunk::make(const BlockChunkType & chunk)
+{
+    return RenderObjectChunkPool::get().make(chunk);
+}
+
+struct ChunkEvictionStatistics
+{
+    size_t residentChunks = 0;
+    size_t residentBytes = 0;
+    uint64_t evictedChunks = 0;
+    uint64_t reloadedChunks = 0; // recently evicted chunks that were set again
+};
+
+struct ChunkCompressionStatistics
+{
+    uint64_t hits = 0; // getChunk calls that found the chunk expanded
+    uint64_t misses = 0; // getChunk calls that had to expand a compacted chunk
+    uint64_t compactions = 0;
+    size_t compactedChunks = 0; // as of the last compactColdChunks
+    size_t bytesSaved = 0; // as of the last compactColdChunks
+    double totalRehydrationSeconds = 0;
+    double maxRehydrationSeconds = 0;
+    double hitRate() const
+    {
+        if(hits + misses == 0)
+            return 1;
+        return (double)hits / (hits + misses);
+    }
+    double averageRehydrationSeconds() const
+    {
+        if(misses == 0)
+            return 0;
+        return totalRehydrationSeconds / misses;
+    }
+};
+
 class RenderObjectWorld
 {
     mutable ChangeTracker changeTracker;
-    typedef linked_map<PositionI, shared_ptr<RenderObjectChunk>> ChunksMap;
-    ChunksMap chunks;
-    mutex chunksLock;
+    typedef ChunkGrid<RenderObjectChunk, RenderObjectChunk::BlockChunkType::chunkSizeX, RenderObjectChunk::BlockChunkType::chunkSizeY, RenderObjectChunk::BlockChunkType::chunkSizeZ> ChunksGrid;
+    ChunksGrid chunks;
     list<shared_ptr<RenderObjectEntity>> entities;
     mutex entitiesLock;
+    atomic_size_t chunkMemoryBudget;
+    atomic_uint_fast64_t currentUseEpoch;
+    list<PositionI> recentlyEvictedChunkList; // most recently evicted first
+    unordered_map<PositionI, list<PositionI>::iterator> recentlyEvictedChunks;
+    ChunkEvictionStatistics evictionStatistics;
+    mutex evictionLock;
+    /// how many evicted chunk positions are remembered to count reloads
+    static size_t recentlyEvictedChunkLimit()
+    {
+        return 16384;
+    }
+    /// remembers an evicted chunk position, forgetting the oldest past the limit. evictionLock must be held.
+    void addRecentlyEvictedChunk(PositionI chunkPosition)
+    {
+        auto iter = recentlyEvictedChunks.find(chunkPosition);
+        if(iter != recentlyEvictedChunks.end())
+        {
+            recentlyEvictedChunkList.splice(recentlyEvictedChunkList.begin(), recentlyEvictedChunkList, std::get<1>(*iter));
+            return;
+        }
+        recentlyEvictedChunkList.push_front(chunkPosition);
+        recentlyEvictedChunks[chunkPosition] = recentlyEvictedChunkList.begin();
+        while(recentlyEvictedChunkList.size() > recentlyEvictedChunkLimit())
+        {
+            recentlyEvictedChunks.erase(recentlyEvictedChunkList.back());
+            recentlyEvictedChunkList.pop_back();
+        }
+    }
+    /// forgets an evicted chunk position; returns if it was remembered. evictionLock must be held.
+    bool removeRecentlyEvictedChunk(PositionI chunkPosition)
+    {
+        auto iter = recentlyEvictedChunks.find(chunkPosition);
+        if(iter == recentlyEvictedChunks.end())
+            return false;
+        recentlyEvictedChunkList.erase(std::get<1>(*iter));
+        recentlyEvictedChunks.erase(iter);
+        return true;
+    }
+    atomic_int_fast64_t currentUseTime; // coarse clock updated by compactColdChunks
+    atomic_int_fast64_t coldChunkAge; // in nanoseconds
+    atomic_uint_fast64_t compressionHits, compressionMisses;
+    ChunkCompressionStatistics compressionStatistics;
+    mutex compressionLock;
+    void touchChunk(RenderObjectChunk &chunk) const
+    {
+        uint_fast64_t epoch = currentUseEpoch.load(memory_order_relaxed);
+        if(chunk.lastUseEpoch.load(memory_order_relaxed) != epoch)
+            chunk.lastUseEpoch.store(epoch, memory_order_relaxed);
+        int_fast64_t time = currentUseTime.load(memory_order_relaxed);
+        if(chunk.lastUseTime.load(memory_order_relaxed) < time)
+            chunk.lastUseTime.store(time, memory_order_relaxed);
+    }
+    void expandChunk(RenderObjectChunk &chunk)
+    {
+        auto startTime = chrono::steady_clock::now();
+        chunk.blockChunk.getSnapshot();
+        double seconds = chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now() - startTime).count();
+        compressionMisses++;
+        lock_guard<mutex> lockIt(compressionLock);
+        compressionStatistics.totalRehydrationSeconds += seconds;
+        if(seconds > compressionStatistics.maxRehydrationSeconds)
+            compressionStatistics.maxRehydrationSeconds = seconds;
+    }
 public:
+    RenderObjectWorld()
+        : chunkMemoryBudget(0), currentUseEpoch(0), currentUseTime(0), coldChunkAge(0), compressionHits(0), compressionMisses(0)
+    {
+    }
+    /// gets the chunk at pos, expanding it if it was compacted
     shared_ptr<RenderObjectChunk> getChunk(PositionI pos)
     {
-        lock_guard<mutex> lockIt(chunksLock);
-        auto iter = chunks.find(pos);
-        if(iter == chunks.end())
+        shared_ptr<RenderObjectChunk> retval = chunks.get(pos);
+        if(retval != nullptr)
+        {
+            touchChunk(*retval);
+            if(retval->blockChunk.isCompacted())
+                expandChunk(*retval);
+            else
+                compressionHits.fetch_add(1, memory_order_relaxed);
+        }
+        return retval;
+    }
+    /// sets how long a chunk has to go unused before compactColdChunks compacts it; 0 disables compaction
+    void setColdChunkAge(chrono::steady_clock::duration age)
+    {
+        coldChunkAge = chrono::duration_cast<chrono::nanoseconds>(age).count();
+    }
+    ChunkCompressionStatistics getCompressionStatistics()
+    {
+        lock_guard<mutex> lockIt(compressionLock);
+        ChunkCompressionStatistics retval = compressionStatistics;
+        retval.hits = compressionHits;
+        retval.misses = compressionMisses;
+        return retval;
+    }
+    /** compresses the blocks of chunks that haven't been used for the cold chunk age.
+     * compacted chunks stay in the world and are expanded again when they are used.
+     * returns the number of chunks compacted.
+     */
+    size_t compactColdChunks()
+    {
+        int_fast64_t now = RenderObjectChunk::getCurrentTime();
+        currentUseTime = now;
+        int_fast64_t age = coldChunkAge;
+        if(age <= 0)
+            return 0;
+        size_t compactionCount = 0, compactedChunks = 0, bytesSaved = 0;
+        chunks.forEach([&](shared_ptr<RenderObjectChunk> chunk)
+        {
+            if(!chunk->blockChunk.isCompacted() && now - chunk->lastUseTime >= age)
+            {
+                pair<size_t, size_t> sizes = chunk->blockChunk.compact();
+                chunk->compactedBytesSaved = (std::get<0>(sizes) > std::get<1>(sizes) ? std::get<0>(sizes) - std::get<1>(sizes) : 0);
+                compactionCount++;
+            }
+            if(chunk->blockChunk.isCompacted())
+            {
+                compactedChunks++;
+                bytesSaved += chunk->compactedBytesSaved;
+            }
+        });
+        lock_guard<mutex> lockIt(compressionLock);
+        compressionStatistics.compactions += compactionCount;
+        compressionStatistics.compactedChunks = compactedChunks;
+        compressionStatistics.bytesSaved = bytesSaved;
+        return compactionCount;
+    }
+    /// sets the number of bytes that chunks may use before evictChunks starts evicting them; 0 means no limit
+    void setChunkMemoryBudget(size_t budget)
+    {
+        chunkMemoryBudget = budget;
+    }
+    size_t getChunkMemoryBudget() const
+    {
+        return chunkMemoryBudget;
+    }
+    ChunkEvictionStatistics getEvictionStatistics()
+    {
+        lock_guard<mutex> lockIt(evictionLock);
+        return evictionStatistics;
+    }
+    /** evicts the least recently used chunks and the chunks farthest from all of keepCenters until the chunks fit in the memory budget.
+     * chunks within keepDistance blocks of any of keepCenters are never evicted.
+     * evictedCallback is called with each evicted chunk.
+     * returns the number of evicted chunks.
+     */
+    size_t evictChunks(const vector<PositionI> &keepCenters, int32_t keepDistance, function<void(shared_ptr<RenderObjectChunk> chunk)> evictedCallback = nullptr)
+    {
+        vector<pair<shared_ptr<RenderObjectChunk>, size_t>> chunksList;
+        chunksList.reserve(chunks.size());
+        size_t totalBytes = 0;
+        chunks.forEach([&](shared_ptr<RenderObjectChunk> chunk)
+        {
+            size_t bytes = chunk->getMemoryUsage();
+            totalBytes += bytes;
+            chunksList.push_back(make_pair(chunk, bytes));
+        });
+        uint_fast64_t epoch = currentUseEpoch++;
+        size_t budget = chunkMemoryBudget;
+        vector<shared_ptr<RenderObjectChunk>> evictedChunks;
+        if(budget != 0 && totalBytes > budget)
+        {
+            const VectorF halfChunkSize = 0.5 * VectorF(RenderObjectChunk::BlockChunkType::chunkSizeX, RenderObjectChunk::BlockChunkType::chunkSizeY, RenderObjectChunk::BlockChunkType::chunkSizeZ);
+            vector<pair<shared_ptr<RenderObjectChunk>, float>> candidates;
+            candidates.reserve(chunksList.size());
+            for(const pair<shared_ptr<RenderObjectChunk>, size_t> &v : chunksList)
+            {
+                PositionI chunkPosition = std::get<0>(v)->blockChunk.basePosition;
+                bool keep = false;
+                float distance = -1;
+                for(PositionI keepCenter : keepCenters)
+                {
+                    VectorI delta = (VectorI)chunkPosition - (VectorI)keepCenter;
+                    if(chunkPosition.d == keepCenter.d && abs(delta.x) <= keepDistance && abs(delta.y) <= keepDistance && abs(delta.z) <= keepDistance)
+                    {
+                        keep = true;
+                        break;
+                    }
+                    float centerDistance = abs((VectorF)delta + halfChunkSize) / RenderObjectChunk::BlockChunkType::chunkSizeX;
+                    if(chunkPosition.d != keepCenter.d)
+                        centerDistance *= 16;
+                    if(distance < 0 || centerDistance < distance)
+                        distance = centerDistance;
+                }
+                if(keep)
+                    continue;
+                if(distance < 0)
+                    distance = 0;
+                float age = (float)(epoch - std::get<0>(v)->lastUseEpoch);
+                candidates.push_back(make_pair(std::get<0>(v), distance * distance + age * age));
+            }
+            std::sort(candidates.begin(), candidates.end(), [](const pair<shared_ptr<RenderObjectChunk>, float> &a, const pair<shared_ptr<RenderObjectChunk>, float> &b)->bool
+            {
+                return std::get<1>(a) > std::get<1>(b);
+            });
+            for(const pair<shared_ptr<RenderObjectChunk>, float> &v : candidates)
+            {
+                if(totalBytes <= budget)
+                    break;
+                shared_ptr<RenderObjectChunk> chunk = std::get<0>(v);
+                PositionI chunkPosition = chunk->blockChunk.basePosition;
+                size_t bytes = chunk->getMemoryUsage();
+                if(!chunks.remove(chunkPosition, chunk))
+                    continue;
+                totalBytes -= (bytes < totalBytes ? bytes : totalBytes);
+                evictedChunks.push_back(chunk);
+            }
+        }
+        {
+            lock_guard<mutex> lockIt(evictionLock);
+            for(shared_ptr<RenderObjectChunk> chunk : evictedChunks)
+                addRecentlyEvictedChunk(chunk->blockChunk.basePosition);
+            evictionStatistics.evictedChunks += evictedChunks.size();
+            evictionStatistics.residentChunks = chunks.size();
+            evictionStatistics.residentBytes = totalBytes;
+        }
+        if(!evictedChunks.empty())
+            changeTracker.onChange();
+        for(shared_ptr<RenderObjectChunk> chunk : evictedChunks)
+        {
+            invalidateNeighborChunkMeshes(chunk->blockChunk.basePosition);
+            if(evictedCallback)
+                evictedCallback(chunk);
+        }
+        return evictedChunks.size();
+    }
+    /// removes the chunk at chunkPosition if it's loaded, like it was evicted. returns the removed chunk or nullptr.
+    shared_ptr<RenderObjectChunk> removeChunk(PositionI chunkPosition)
+    {
+        shared_ptr<RenderObjectChunk> chunk = chunks.get(chunkPosition);
+        if(chunk == nullptr || !chunks.remove(chunkPosition, chunk))
             return nullptr;
-        return std::get<1>(*iter);
+        {
+            lock_guard<mutex> lockIt(evictionLock);
+            addRecentlyEvictedChunk(chunkPosition);
+            evictionStatistics.evictedChunks++;
+            evictionStatistics.residentChunks = chunks.size();
+        }
+        changeTracker.onChange();
+        invalidateNeighborChunkMeshes(chunkPosition);
+        return chunk;
     }
 private:
     bool generateMesh(PositionI chunkPosition, shared_ptr<RenderObjectChunk> chunk = nullptr)
     {
-        PositionI nxPos = chunkPosition - VectorI(RenderObjectChunk::BlockChunkType::chunkSizeX, 0, 0);
-        PositionI pxPos = chunkPosition + VectorI(RenderObjectChunk::BlockChunkType::chunkSizeX, 0, 0);
-        PositionI nyPos = chunkPosition - VectorI(0, RenderObjectChunk::BlockChunkType::chunkSizeY, 0);
-        PositionI pyPos = chunkPosition + VectorI(0, RenderObjectChunk::BlockChunkType::chunkSizeY, 0);
-        PositionI nzPos = chunkPosition - VectorI(0, 0, RenderObjectChunk::BlockChunkType::chunkSizeZ);
-        PositionI pzPos = chunkPosition + VectorI(0, 0, RenderObjectChunk::BlockChunkType::chunkSizeZ);
         if(chunk == nullptr)
             chunk = getChunk(chunkPosition);
         if(chunk == nullptr)
             return false;
-        return chunk->generateDrawMeshes(getChunk(nxPos), getChunk(pxPos), getChunk(nyPos), getChunk(pyPos), getChunk(nzPos), getChunk(pzPos));
+        array<shared_ptr<RenderObjectChunk>, 6> neighbors = chunks.getNeighbors(chunkPosition);
+        return chunk->generateDrawMeshes(neighbors[0], neighbors[1], neighbors[2], neighbors[3], neighbors[4], neighbors[5]);
     }
 public:
     bool generateMeshes(PositionI pos)
     {
-        vector<ChunksMap::iterator> chunksList;
-        {
-            lock_guard<mutex> lockIt(chunksLock);
-            chunksList.reserve(chunks.size());
-            for(auto iter = chunks.begin(); iter != chunks.end(); iter++)
-            {
-                if(std::get<1>(*iter)->meshesValid)
-                    continue;
-                chunksList.push_back(iter);
-            }
-        }
-        std::sort(chunksList.begin(), chunksList.end(), [&pos](ChunksMap::iterator a, ChunksMap::iterator b)->bool
+        vector<shared_ptr<RenderObjectChunk>> chunksList;
+        chunksList.reserve(chunks.size());
+        chunks.forEach([&chunksList](shared_ptr<RenderObjectChunk> chunk)
         {
-            return absSquared((VectorI)pos - (VectorI)std::get<0>(*a)) < absSquared((VectorI)pos - (VectorI)std::get<0>(*b));
+            if(!chunk->meshesValid)
+                chunksList.push_back(chunk);
         });
         if(chunksList.empty())
             return false;
-        return generateMesh(std::get<0>(*chunksList.front()), std::get<1>(*chunksList.front()));
+        auto nearestChunk = std::min_element(chunksList.begin(), chunksList.end(), [&pos](const shared_ptr<RenderObjectChunk> &a, const shared_ptr<RenderObjectChunk> &b)->bool
+        {
+            return absSquared((VectorI)pos - (VectorI)a->blockChunk.basePosition) < absSquared((VectorI)pos - (VectorI)b->blockChunk.basePosition);
+        });
+        return generateMesh((*nearestChunk)->blockChunk.basePosition, *nearestChunk);
     }
     void draw(Renderer & renderer, Matrix tform, RenderLayer renderLayer, PositionI pos, int32_t viewDistance, function<Mesh(Mesh mesh, PositionI chunkBasePosition)> filterFn, bool needFilterUpdate, function<void(PositionI chunkBasePosition)> needChunkCallback = nullptr)
     {
@@ -605,27 +1341,89 @@ public:
 private:
     void invalidateChunkMeshes(PositionI position)
     {
-        shared_ptr<RenderObjectChunk> chunk = getChunk(RenderObjectChunk::BlockChunkType::getChunkBasePosition(position));
+        shared_ptr<RenderObjectChunk> chunk = chunks.get(RenderObjectChunk::BlockChunkType::getChunkBasePosition(position));
         if(chunk != nullptr)
             chunk->invalidateMeshes(position);
     }
-    void invalidateChunkMeshesAll(PositionI position)
+    static VectorI getChunkSize()
     {
-        shared_ptr<RenderObjectChunk> chunk = getChunk(RenderObjectChunk::BlockChunkType::getChunkBasePosition(position));
-        if(chunk != nullptr)
-            chunk->invalidateMeshes();
+        return VectorI(RenderObjectChunk::BlockChunkType::chunkSizeX, RenderObjectChunk::BlockChunkType::chunkSizeY, RenderObjectChunk::BlockChunkType::chunkSizeZ);
     }
+    /// checks if the blocks on face of the chunk differ between oldBlocks and newBlocks
+    static bool isChunkFaceChanged(const RenderObjectChunk::BlockChunkType::Snapshot &oldBlocks, const RenderObjectChunk::BlockChunkType::Snapshot &newBlocks, BlockFace face)
+    {
+        if(&oldBlocks == &newBlocks)
+            return false;
+        VectorI minPosition = VectorI(0), maxPosition = getChunkSize() - VectorI(1);
+        switch(face)
+        {
+        case BlockFace::NX:
+            maxPosition.x = minPosition.x;
+            break;
+        case BlockFace::PX:
+            minPosition.x = maxPosition.x;
+            break;
+        case BlockFace::NY:
+            maxPosition.y = minPosition.y;
+            break;
+        case BlockFace::PY:
+            minPosition.y = maxPosition.y;
+            break;
+        case BlockFace::NZ:
+            maxPosition.z = minPosition.z;
+            break;
+        case BlockFace::PZ:
+            minPosition.z = maxPosition.z;
+            break;
+        }
+        for(int32_t x = minPosition.x; x <= maxPosition.x; x++)
+        {
+            for(int32_t y = minPosition.y; y <= maxPosition.y; y++)
+            {
+                for(int32_t z = minPosition.z; z <= maxPosition.z; z++)
+                {
+                    if(!(oldBlocks.get(x, y, z) == newBlocks.get(x, y, z)))
+                        return true;
+                }
+            }
+        }
+        return false;
+    }
+    /** invalidates the sub-chunks of the chunks next to the chunk at chunkPosition that touch it.
+     * if the chunk replaced oldChunk, only the neighbors whose shared face changed are invalidated.
+     */
+    void invalidateNeighborChunkMeshes(PositionI chunkPosition, shared_ptr<RenderObjectChunk> oldChunk = nullptr, shared_ptr<RenderObjectChunk> newChunk = nullptr)
+    {
+        shared_ptr<const RenderObjectChunk::BlockChunkType::Snapshot> oldBlocks, newBlocks;
+        if(oldChunk != nullptr && newChunk != nullptr && !oldChunk->blockChunk.isCompacted())
+        {
+            oldBlocks = oldChunk->blockChunk.getSnapshot();
+            newBlocks = newChunk->blockChunk.getSnapshot();
+        }
+        array<shared_ptr<RenderObjectChunk>, 6> neighbors = chunks.getNeighbors(chunkPosition);
+        for(BlockFace face : enum_traits<BlockFace>())
+        {
+            shared_ptr<RenderObjectChunk> neighbor = neighbors[(size_t)face];
+            if(neighbor == nullptr)
+                continue;
+            if(oldBlocks != nullptr && !isChunkFaceChanged(*oldBlocks, *newBlocks, face))
+                continue;
+            neighbor->invalidateMeshes(RenderObjectChunk::getFaceSubChunks(getOppositeFace(face)));
+        }
+    }
+    /// invalidates the sub-chunks whose meshes depend on the block at position;
+    /// the chunks next to its chunk are only looked up if the block is on the shared face
     void invalidateBlock(PositionI position)
     {
         PositionI chunkBasePosition = RenderObjectChunk::BlockChunkType::getChunkBasePosition(position);
-        shared_ptr<RenderObjectChunk> chunk = getChunk(chunkBasePosition);
+        shared_ptr<RenderObjectChunk> chunk = chunks.get(chunkBasePosition);
         if(chunk == nullptr)
             return;
-        chunk->invalidate(position);
-        for(BlockFace face : enum_traits<BlockFace>())
+        chunk->invalidateMeshes(RenderObjectChunk::getBlockSubChunks(position - chunkBasePosition, [&](VectorI neighborPosition)
         {
-            invalidateChunkMeshes(position + getDelta(face));
-        }
+            invalidateChunkMeshes(chunkBasePosition + neighborPosition);
+        }));
+        chunk->blockChunk.onChange();
     }
 public:
     RenderObjectBlock getBlock(PositionI position)
@@ -635,24 +1433,203 @@ public:
             return RenderObjectBlock();
         RenderObjectChunk & chunk = *pchunk;
         PositionI relativePosition = RenderObjectChunk::BlockChunkType::getChunkRelativePosition(position);
-        return chunk.blockChunk.blocks[relativePosition.x][relativePosition.y][relativePosition.z];
+        return chunk.blockChunk.get(relativePosition.x, relativePosition.y, relativePosition.z);
     }
     void setBlock(PositionI position, RenderObjectBlock block)
     {
-        shared_ptr<RenderObjectChunk> *ppchunk;
+        PositionI chunkBasePosition = RenderObjectChunk::BlockChunkType::getChunkBasePosition(position);
+        shared_ptr<RenderObjectChunk> pchunk = chunks.getOrMake(chunkBasePosition, [chunkBasePosition]()
+        {
+            return RenderObjectChunk::make(chunkBasePosition);
+        });
+        RenderObjectChunk &chunk = *pchunk;
+        touchChunk(chunk);
+        PositionI relativePosition = RenderObjectChunk::BlockChunkType::getChunkRelativePosition(position);
+        chunk.blockChunk.set(relativePosition.x, relativePosition.y, relativePosition.z, block);
+        invalidateBlock(position);
+        changeTracker.onChange();
+    }
+    /// called once per edited chunk by the batched block edit functions with the positions of the blocks that changed
+    typedef function<void(shared_ptr<RenderObjectChunk> chunk, const vector<PositionI> &changedPositions)> BlockEditCallback;
+private:
+    struct BlockEditBatch final
+    {
+        unordered_map<PositionI, RenderObjectChunk::SubChunkMask> invalidSubChunks; // keyed by chunk base position
+        vector<pair<shared_ptr<RenderObjectChunk>, vector<PositionI>>> editedChunks;
+        size_t changedBlockCount = 0;
+        void invalidate(PositionI position)
+        {
+            invalidSubChunks[RenderObjectChunk::BlockChunkType::getChunkBasePosition(position)] |= RenderObjectChunk::getSubChunkBit((VectorI)RenderObjectChunk::BlockChunkType::getChunkRelativePosition(position));
+        }
+    };
+    template <typename Fn>
+    void editChunk(BlockEditBatch &batch, PositionI chunkBasePosition, const vector<VectorI> &relativePositions, Fn fn, bool makeChunk = true)
+    {
+        shared_ptr<RenderObjectChunk> chunk;
+        if(makeChunk)
+        {
+            chunk = chunks.getOrMake(chunkBasePosition, [chunkBasePosition]()
+            {
+                return RenderObjectChunk::make(chunkBasePosition);
+            });
+        }
+        else
+        {
+            chunk = getChunk(chunkBasePosition);
+            if(chunk == nullptr)
+                return;
+        }
+        touchChunk(*chunk);
+        vector<PositionI> changedPositions;
+        RenderObjectChunk::SubChunkMask invalidSubChunks = 0;
+        chunk->blockChunk.update(relativePositions, [&](VectorI relativePosition, RenderObjectBlock oldBlock)->RenderObjectBlock
+        {
+            return fn(chunkBasePosition + relativePosition, oldBlock);
+        }, [&](VectorI relativePosition)
+        {
+            changedPositions.push_back(chunkBasePosition + relativePosition);
+            invalidSubChunks |= RenderObjectChunk::getBlockSubChunks(relativePosition, [&](VectorI neighborPosition)
+            {
+                batch.invalidate(chunkBasePosition + neighborPosition);
+            });
+        });
+        if(changedPositions.empty())
+            return;
+        batch.invalidSubChunks[chunkBasePosition] |= invalidSubChunks;
+        chunk->blockChunk.onChange();
+        batch.changedBlockCount += changedPositions.size();
+        batch.editedChunks.push_back(make_pair(chunk, std::move(changedPositions)));
+    }
+    size_t finishBlockEdits(BlockEditBatch &batch, BlockEditCallback callback)
+    {
+        for(const auto &v : batch.invalidSubChunks)
         {
-            lock_guard<mutex> lockIt(chunksLock);
-            ppchunk = &chunks[RenderObjectChunk::BlockChunkType::getChunkBasePosition(position)];
-            if(*ppchunk == nullptr)
+            shared_ptr<RenderObjectChunk> chunk = chunks.get(std::get<0>(v));
+            if(chunk != nullptr)
+                chunk->invalidateMeshes(std::get<1>(v));
+        }
+        if(batch.editedChunks.empty())
+            return 0;
+        changeTracker.onChange();
+        if(callback)
+        {
+            for(const pair<shared_ptr<RenderObjectChunk>, vector<PositionI>> &v : batch.editedChunks)
+                callback(std::get<0>(v), std::get<1>(v));
+        }
+        return batch.changedBlockCount;
+    }
+public:
+    /** replaces every block in the box from minPosition to maxPosition (inclusive) with fn(position, oldBlock).
+     * the edits are applied a chunk at a time and every affected sub-chunk is invalidated once.
+     * chunks that aren't loaded are made empty.
+     * returns the number of blocks that changed.
+     */
+    template <typename Fn>
+    size_t editBlocks(PositionI minPosition, PositionI maxPosition, Fn fn, BlockEditCallback callback = nullptr)
+    {
+        assert(minPosition.d == maxPosition.d);
+        PositionI minP = PositionI(min(minPosition.x, maxPosition.x), min(minPosition.y, maxPosition.y), min(minPosition.z, maxPosition.z), minPosition.d);
+        PositionI maxP = PositionI(max(minPosition.x, maxPosition.x), max(minPosition.y, maxPosition.y), max(minPosition.z, maxPosition.z), minPosition.d);
+        PositionI minChunkPosition = RenderObjectChunk::BlockChunkType::getChunkBasePosition(minP);
+        PositionI maxChunkPosition = RenderObjectChunk::BlockChunkType::getChunkBasePosition(maxP);
+        BlockEditBatch batch;
+        vector<VectorI> relativePositions;
+        for(PositionI chunkPosition = minChunkPosition; chunkPosition.x <= maxChunkPosition.x; chunkPosition.x += RenderObjectChunk::BlockChunkType::chunkSizeX)
+        {
+            for(chunkPosition.y = minChunkPosition.y; chunkPosition.y <= maxChunkPosition.y; chunkPosition.y += RenderObjectChunk::BlockChunkType::chunkSizeY)
             {
-                *ppchunk = shared_ptr<RenderObjectChunk>(new RenderObjectChunk(RenderObjectChunk::BlockChunkType::getChunkBasePosition(position)));
+                for(chunkPosition.z = minChunkPosition.z; chunkPosition.z <= maxChunkPosition.z; chunkPosition.z += RenderObjectChunk::BlockChunkType::chunkSizeZ)
+                {
+                    VectorI minRelativePosition = VectorI(max(minP.x - chunkPosition.x, 0), max(minP.y - chunkPosition.y, 0), max(minP.z - chunkPosition.z, 0));
+                    VectorI maxRelativePosition = VectorI(min(maxP.x - chunkPosition.x, RenderObjectChunk::BlockChunkType::chunkSizeX - 1),
+                                                          min(maxP.y - chunkPosition.y, RenderObjectChunk::BlockChunkType::chunkSizeY - 1),
+                                                          min(maxP.z - chunkPosition.z, RenderObjectChunk::BlockChunkType::chunkSizeZ - 1));
+                    relativePositions.clear();
+                    for(VectorI p = minRelativePosition; p.x <= maxRelativePosition.x; p.x++)
+                    {
+                        for(p.y = minRelativePosition.y; p.y <= maxRelativePosition.y; p.y++)
+                        {
+                            for(p.z = minRelativePosition.z; p.z <= maxRelativePosition.z; p.z++)
+                            {
+                                relativePositions.push_back(p);
+                            }
+                        }
+                    }
+                    editChunk(batch, chunkPosition, relativePositions, fn);
+                }
             }
         }
-        RenderObjectChunk &chunk = **ppchunk;
+        return finishBlockEdits(batch, callback);
+    }
+    /// sets every block in the box from minPosition to maxPosition (inclusive) to block; returns the number of blocks that changed
+    size_t fillBlocks(PositionI minPosition, PositionI maxPosition, RenderObjectBlock block, BlockEditCallback callback = nullptr)
+    {
+        return editBlocks(minPosition, maxPosition, [block](PositionI, RenderObjectBlock)
+        {
+            return block;
+        }, callback);
+    }
+    /// replaces every block in the box from minPosition to maxPosition (inclusive) that matches predicate with replacement; returns the number of blocks that changed
+    template <typename Fn>
+    size_t replaceBlocks(PositionI minPosition, PositionI maxPosition, Fn predicate, RenderObjectBlock replacement, BlockEditCallback callback = nullptr)
+    {
+        return editBlocks(minPosition, maxPosition, [&predicate, replacement](PositionI, RenderObjectBlock oldBlock)
+        {
+            return predicate(oldBlock) ? replacement : oldBlock;
+        }, callback);
+    }
+private:
+    size_t setBlocks(const vector<pair<PositionI, RenderObjectBlock>> &edits, BlockEditCallback callback, bool makeChunks)
+    {
+        typedef RenderObjectChunk::BlockChunkType BlockChunkType;
+        unordered_map<PositionI, unordered_map<size_t, RenderObjectBlock>> chunkEdits; // blocks keyed by array index
+        for(const pair<PositionI, RenderObjectBlock> &edit : edits)
+        {
+            PositionI position = std::get<0>(edit);
+            PositionI relativePosition = BlockChunkType::getChunkRelativePosition(position);
+            chunkEdits[BlockChunkType::getChunkBasePosition(position)][BlockChunkType::getArrayIndex(relativePosition.x, relativePosition.y, relativePosition.z)] = std::get<1>(edit);
+        }
+        BlockEditBatch batch;
+        vector<VectorI> relativePositions;
+        for(const auto &v : chunkEdits)
+        {
+            const unordered_map<size_t, RenderObjectBlock> &blocks = std::get<1>(v);
+            relativePositions.clear();
+            for(const auto &block : blocks)
+                relativePositions.push_back(BlockChunkType::getArrayRelativePosition(std::get<0>(block)));
+            editChunk(batch, std::get<0>(v), relativePositions, [&blocks](PositionI position, RenderObjectBlock)
+            {
+                PositionI relativePosition = BlockChunkType::getChunkRelativePosition(position);
+                return blocks.at(BlockChunkType::getArrayIndex(relativePosition.x, relativePosition.y, relativePosition.z));
+            }, makeChunks);
+        }
+        return finishBlockEdits(batch, callback);
+    }
+public:
+    /** sets each block in edits, grouping the edits by chunk; if a position is listed more than once, the last one wins.
+     * chunks that aren't loaded are made empty, so use setBlocksIfLoaded when the chunks come from storage.
+     * returns the number of blocks that changed
+     */
+    size_t setBlocks(const vector<pair<PositionI, RenderObjectBlock>> &edits, BlockEditCallback callback = nullptr)
+    {
+        return setBlocks(edits, callback, true);
+    }
+    /// like setBlocks but skips the edits in chunks that aren't loaded
+    size_t setBlocksIfLoaded(const vector<pair<PositionI, RenderObjectBlock>> &edits, BlockEditCallback callback = nullptr)
+    {
+        return setBlocks(edits, callback, false);
+    }
+    /// sets the block only if its chunk is loaded; returns if the block was set
+    bool setBlockIfLoaded(PositionI position, RenderObjectBlock block)
+    {
+        shared_ptr<RenderObjectChunk> pchunk = getChunk(RenderObjectChunk::BlockChunkType::getChunkBasePosition(position));
+        if(pchunk == nullptr)
+            return false;
         PositionI relativePosition = RenderObjectChunk::BlockChunkType::getChunkRelativePosition(position);
-        chunk.blockChunk.blocks[relativePosition.x][relativePosition.y][relativePosition.z] = block;
+        pchunk->blockChunk.set(relativePosition.x, relativePosition.y, relativePosition.z, block);
         invalidateBlock(position);
         changeTracker.onChange();
+        return true;
     }
     static shared_ptr<RenderObjectWorld> read(stream::Reader &reader, VariableSet &variableSet)
     {
@@ -662,12 +1639,12 @@ public:
         {
             cout << "Reading World ... (" << 100 * i / chunkCount << "%)\x1b[K\r" << flush;
             shared_ptr<RenderObjectChunk> chunk = stream::read<RenderObjectChunk>(reader, variableSet);
-            if(!chunk || retval->chunks.count(chunk->blockChunk.basePosition) > 0)
+            if(!chunk || retval->chunks.get(chunk->blockChunk.basePosition) != nullptr)
             {
                 cout << "Reading World ... Error!" << endl;
                 throw stream::InvalidDataValueException("chunk already in world");
             }
-            retval->chunks[chunk->blockChunk.basePosition] = chunk;
+            retval->chunks.set(chunk->blockChunk.basePosition, chunk);
         }
         uint32_t entityCount = stream::read<uint32_t>(reader);
         for(uint32_t i = 0; i < entityCount; i++)
@@ -680,12 +1657,18 @@ public:
     }
     void write(stream::Writer &writer, VariableSet &variableSet)
     {
-        uint32_t chunkCount = (uint32_t)chunks.size();
-        assert((size_t)chunkCount == chunks.size());
+        vector<shared_ptr<RenderObjectChunk>> chunksList;
+        chunksList.reserve(chunks.size());
+        chunks.forEach([&chunksList](shared_ptr<RenderObjectChunk> chunk)
+        {
+            chunksList.push_back(chunk);
+        });
+        uint32_t chunkCount = (uint32_t)chunksList.size();
+        assert((size_t)chunkCount == chunksList.size());
         stream::write<uint32_t>(writer, chunkCount);
-        for(auto iter = chunks.begin(); iter != chunks.end(); iter++)
+        for(shared_ptr<RenderObjectChunk> chunk : chunksList)
         {
-            stream::write<RenderObjectChunk>(writer, variableSet, std::get<1>(*iter));
+            stream::write<RenderObjectChunk>(writer, variableSet, chunk);
         }
         uint32_t entityCount = (uint32_t)entities.size();
         assert((size_t)entityCount == entities.size());
@@ -696,6 +1679,27 @@ public:
         }
         changeTracker.onWrite(variableSet);
     }
+    /// makes a world with the chunks and entities that write would write without serializing them;
+    /// the chunks share this world's block snapshots
+    shared_ptr<RenderObjectWorld> makeLocalCopy()
+    {
+        shared_ptr<RenderObjectWorld> retval = make_shared<RenderObjectWorld>();
+        chunks.forEach([&retval](shared_ptr<RenderObjectChunk> chunk)
+        {
+            retval->chunks.set(chunk->blockChunk.basePosition, RenderObjectChunk::make(chunk->blockChunk));
+        });
+        lock_guard<mutex> lockIt(entitiesLock);
+        for(shared_ptr<RenderObjectEntity> &e : entities)
+        {
+            shared_ptr<RenderObjectEntity> entity = make_shared<RenderObjectEntity>();
+            entity->descriptor = e->descriptor;
+            entity->position = e->position;
+            entity->velocity = e->velocity;
+            entity->age = e->age;
+            retval->entities.push_back(entity);
+        }
+        return retval;
+    }
     bool getChanged(VariableSet &variableSet) const
     {
         return changeTracker.getChanged(variableSet);
@@ -705,17 +1709,15 @@ public:
         assert(chunk);
         PositionI chunkPosition = chunk->blockChunk.basePosition;
         assert(RenderObjectChunk::BlockChunkType::getChunkBasePosition(chunkPosition) == chunkPosition);
+        touchChunk(*chunk);
+        shared_ptr<RenderObjectChunk> oldChunk = chunks.set(chunkPosition, chunk);
         {
-            lock_guard<mutex> lockIt(chunksLock);
-            chunks[chunkPosition] = chunk;
+            lock_guard<mutex> lockIt(evictionLock);
+            if(removeRecentlyEvictedChunk(chunkPosition))
+                evictionStatistics.reloadedChunks++;
         }
         changeTracker.onChange();
-        invalidateChunkMeshesAll(chunkPosition - VectorI(RenderObjectChunk::BlockChunkType::chunkSizeX, 0, 0));
-        invalidateChunkMeshesAll(chunkPosition + VectorI(RenderObjectChunk::BlockChunkType::chunkSizeX, 0, 0));
-        invalidateChunkMeshesAll(chunkPosition - VectorI(0, RenderObjectChunk::BlockChunkType::chunkSizeY, 0));
-        invalidateChunkMeshesAll(chunkPosition + VectorI(0, RenderObjectChunk::BlockChunkType::chunkSizeY, 0));
-        invalidateChunkMeshesAll(chunkPosition - VectorI(0, 0, RenderObjectChunk::BlockChunkType::chunkSizeZ));
-        invalidateChunkMeshesAll(chunkPosition + VectorI(0, 0, RenderObjectChunk::BlockChunkType::chunkSizeZ));
+        invalidateNeighborChunkMeshes(chunkPosition, oldChunk, chunk);
     }
     void createPhysicsObjects(shared_ptr<PhysicsWorld> pWorld, PositionI center, VectorI extents)
     {
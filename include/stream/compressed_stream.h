@@ -70,6 +70,19 @@ public:
         readBuffer();
         return buffer[bufferPointer++];
     }
+    virtual void readBytes(uint8_t * array, size_t count) override
+    {
+        while(count > 0)
+        {
+            if(!dataAvailable())
+                readBuffer();
+            size_t copySize = min(count, buffer.size() - bufferPointer);
+            memcpy((void *)array, (const void *)&buffer[bufferPointer], copySize);
+            bufferPointer += copySize;
+            array += copySize;
+            count -= copySize;
+        }
+    }
 };
 
 class CompressWriter final : public Writer
@@ -98,6 +111,11 @@ public:
         finish();
         writer.flush();
     }
+    virtual void flushUrgent() override
+    {
+        finish();
+        writer.flushUrgent();
+    }
     virtual void writeByte(uint8_t v) override
     {
         if(writeWaits())
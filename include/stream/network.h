@@ -33,16 +33,38 @@ public:
     }
 };
 
+struct NetworkWriterStatistics
+{
+    uint64_t flushes = 0; // flushes that had bytes to send
+    uint64_t urgentFlushes = 0;
+    uint64_t coalescedFlushes = 0; // flushes that were held back and sent together with later bytes
+    uint64_t sendCalls = 0; // sendmsg system calls
+    uint64_t sentBytes = 0;
+    double bytesPerSend() const
+    {
+        if(sendCalls == 0)
+            return 0;
+        return (double)sentBytes / sendCalls;
+    }
+    /// the system calls saved compared to sending and setting TCP_NODELAY on every flush
+    uint64_t savedSystemCalls() const
+    {
+        if(sendCalls >= 2 * flushes)
+            return 0;
+        return 2 * flushes - sendCalls;
+    }
+};
+
+/// gets the statistics of the writers of all the NetworkConnections and the connections accepted with NetworkServer::accept
+NetworkWriterStatistics getNetworkWriterStatistics();
+
 class NetworkConnection final : public StreamRW
 {
     friend class NetworkServer;
 private:
     shared_ptr<Reader> readerInternal;
     shared_ptr<Writer> writerInternal;
-    NetworkConnection(int readFd, int writeFd)
-        : readerInternal(new FileReader(fdopen(readFd, "r"))), writerInternal(new FileWriter(fdopen(writeFd, "w")))
-    {
-    }
+    NetworkConnection(int readFd, int writeFd);
 public:
     explicit NetworkConnection(wstring url, uint16_t port);
     shared_ptr<Reader> preader() override
@@ -65,6 +87,8 @@ public:
     explicit NetworkServer(uint16_t port);
     ~NetworkServer();
     shared_ptr<StreamRW> accept() override;
+    /// accepts a connection and returns its socket, for use with NetworkEventLoop
+    int acceptSocket();
 };
 
 }
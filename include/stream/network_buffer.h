@@ -0,0 +1,330 @@
+/*
+ * Voxels is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Voxels is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Voxels; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#ifndef NETWORK_BUFFER_H_INCLUDED
+#define NETWORK_BUFFER_H_INCLUDED
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <deque>
+#include <cstdint>
+
+using namespace std;
+
+namespace stream
+{
+
+struct NetworkBufferPoolStatistics
+{
+    uint64_t allocatedBuffers = 0; // buffers made because the pool was empty
+    uint64_t reusedBuffers = 0; // buffers taken from the pool
+    uint64_t recycledBuffers = 0; // released buffers put back in the pool
+    uint64_t freedBuffers = 0; // released buffers deleted because the pool was full or they were too big
+    size_t pooledBuffers = 0;
+    size_t pooledBytes = 0; // capacity of the pooled buffers
+    size_t capacity = 0;
+    size_t maxPooledBytes = 0;
+};
+
+/** pool of byte buffers for network events.
+ *
+ * buffers are reference counted with shared_ptr and go back to the pool when
+ * the last reference is released, so an event's payload can be shared by the
+ * reader, the decoder and the output queue without copying it. released
+ * buffers keep their capacity unless it is more than maxPooledBufferSize().
+ * at most getCapacity() buffers holding at most getMaxPooledBytes() bytes are kept.
+ */
+class NetworkBufferPool final
+{
+    NetworkBufferPool(const NetworkBufferPool &) = delete;
+    const NetworkBufferPool &operator =(const NetworkBufferPool &) = delete;
+    mutex lock;
+    vector<vector<uint8_t> *> freeBuffers;
+    size_t pooledBytes = 0;
+    size_t capacity = defaultCapacity();
+    size_t maxPooledBytes = defaultMaxPooledBytes();
+    NetworkBufferPoolStatistics statistics;
+    NetworkBufferPool()
+    {
+    }
+    static size_t defaultCapacity()
+    {
+        return 256;
+    }
+    static size_t defaultMaxPooledBytes()
+    {
+        return (size_t)16 << 20;
+    }
+    static size_t maxPooledBufferSize()
+    {
+        return (size_t)1 << 20;
+    }
+    void release(vector<uint8_t> *buffer)
+    {
+        buffer->clear();
+        unique_lock<mutex> lockIt(lock);
+        if(freeBuffers.size() >= capacity || buffer->capacity() > maxPooledBufferSize() || pooledBytes + buffer->capacity() > maxPooledBytes)
+        {
+            statistics.freedBuffers++;
+            lockIt.unlock();
+            delete buffer;
+            return;
+        }
+        statistics.recycledBuffers++;
+        pooledBytes += buffer->capacity();
+        freeBuffers.push_back(buffer);
+    }
+    /// takes a pooled buffer, preferring one that holds size bytes without growing; returns nullptr if the pool is empty
+    vector<uint8_t> *take(size_t size)
+    {
+        lock_guard<mutex> lockIt(lock);
+        if(freeBuffers.empty())
+        {
+            statistics.allocatedBuffers++;
+            return nullptr;
+        }
+        auto iter = freeBuffers.end() - 1;
+        for(auto i = freeBuffers.rbegin(); i != freeBuffers.rend(); i++)
+        {
+            if((*i)->capacity() >= size)
+            {
+                iter = i.base() - 1;
+                break;
+            }
+        }
+        vector<uint8_t> *buffer = *iter;
+        freeBuffers.erase(iter);
+        pooledBytes -= buffer->capacity();
+        statistics.reusedBuffers++;
+        return buffer;
+    }
+    shared_ptr<vector<uint8_t>> wrap(vector<uint8_t> *buffer)
+    {
+        return shared_ptr<vector<uint8_t>>(buffer, [this](vector<uint8_t> *releasedBuffer)
+        {
+            release(releasedBuffer);
+        });
+    }
+    void freeExtraBuffers(vector<vector<uint8_t> *> &extraBuffers) // must hold lock
+    {
+        while(freeBuffers.size() > capacity || (!freeBuffers.empty() && pooledBytes > maxPooledBytes))
+        {
+            extraBuffers.push_back(freeBuffers.back());
+            pooledBytes -= freeBuffers.back()->capacity();
+            freeBuffers.pop_back();
+            statistics.freedBuffers++;
+        }
+    }
+public:
+    /// the pool is never destroyed so buffers can be released during exit
+    static NetworkBufferPool &get()
+    {
+        static NetworkBufferPool *retval = new NetworkBufferPool;
+        return *retval;
+    }
+    /// gets an empty buffer with room for at least expectedSize bytes
+    shared_ptr<vector<uint8_t>> make(size_t expectedSize = 0)
+    {
+        vector<uint8_t> *buffer = take(expectedSize);
+        if(buffer == nullptr)
+            buffer = new vector<uint8_t>;
+        buffer->reserve(expectedSize);
+        return wrap(buffer);
+    }
+    /// gets a buffer holding bytes. they are copied into a pooled buffer that is big enough,
+    /// otherwise bytes' storage is moved in and goes to the pool when it's released
+    shared_ptr<vector<uint8_t>> make(vector<uint8_t> &&bytes)
+    {
+        vector<uint8_t> *buffer = take(bytes.size());
+        if(buffer == nullptr)
+            buffer = new vector<uint8_t>(std::move(bytes));
+        else if(buffer->capacity() >= bytes.size())
+            buffer->assign(bytes.begin(), bytes.end());
+        else
+            *buffer = std::move(bytes);
+        return wrap(buffer);
+    }
+    size_t getCapacity()
+    {
+        lock_guard<mutex> lockIt(lock);
+        return capacity;
+    }
+    /// sets the maximum number of released buffers kept for reuse, deleting the extra ones
+    void setCapacity(size_t newCapacity)
+    {
+        vector<vector<uint8_t> *> extraBuffers;
+        {
+            lock_guard<mutex> lockIt(lock);
+            capacity = newCapacity;
+            freeExtraBuffers(extraBuffers);
+        }
+        for(vector<uint8_t> *buffer : extraBuffers)
+            delete buffer;
+    }
+    size_t getMaxPooledBytes()
+    {
+        lock_guard<mutex> lockIt(lock);
+        return maxPooledBytes;
+    }
+    /// sets the maximum total capacity of the released buffers kept for reuse, deleting the extra ones
+    void setMaxPooledBytes(size_t newMaxPooledBytes)
+    {
+        vector<vector<uint8_t> *> extraBuffers;
+        {
+            lock_guard<mutex> lockIt(lock);
+            maxPooledBytes = newMaxPooledBytes;
+            freeExtraBuffers(extraBuffers);
+        }
+        for(vector<uint8_t> *buffer : extraBuffers)
+            delete buffer;
+    }
+    NetworkBufferPoolStatistics getStatistics()
+    {
+        lock_guard<mutex> lockIt(lock);
+        NetworkBufferPoolStatistics retval = statistics;
+        retval.pooledBuffers = freeBuffers.size();
+        retval.pooledBytes = pooledBytes;
+        retval.capacity = capacity;
+        retval.maxPooledBytes = maxPooledBytes;
+        return retval;
+    }
+};
+
+/** bytes waiting to be sent on a socket, kept as a list of shared segments.
+ *
+ * small writes are copied into a pooled buffer; shared payloads are queued by
+ * reference. send passes the segments to sendmsg as an iovec array so the
+ * event headers and payloads go out in one system call without being copied
+ * into a contiguous buffer first.
+ */
+class NetworkOutputQueue final
+{
+    NetworkOutputQueue(const NetworkOutputQueue &) = delete;
+    const NetworkOutputQueue &operator =(const NetworkOutputQueue &) = delete;
+private:
+    struct Segment final
+    {
+        shared_ptr<const uint8_t> bytes;
+        size_t size;
+        Segment(shared_ptr<const uint8_t> bytes, size_t size)
+            : bytes(bytes), size(size)
+        {
+        }
+    };
+    deque<Segment> segments;
+    size_t firstSegmentOffset = 0; // bytes of the first segment that are already sent
+    size_t byteCount = 0;
+    shared_ptr<vector<uint8_t>> tail; // pooled buffer collecting small writes; it's not in segments yet
+    void sealTail()
+    {
+        if(tail == nullptr)
+            return;
+        if(!tail->empty())
+            segments.push_back(Segment(shared_ptr<const uint8_t>(tail, tail->data()), tail->size()));
+        tail = nullptr;
+    }
+public:
+    /// shared payloads smaller than this are copied instead of queued by reference
+    static size_t minSharedSegmentSize()
+    {
+        return 256;
+    }
+    static size_t tailBufferSize()
+    {
+        return 16384;
+    }
+    NetworkOutputQueue()
+    {
+    }
+    NetworkOutputQueue(NetworkOutputQueue &&) = default;
+    NetworkOutputQueue &operator =(NetworkOutputQueue &&) = default;
+    size_t size() const
+    {
+        return byteCount;
+    }
+    bool empty() const
+    {
+        return byteCount == 0;
+    }
+    void append(uint8_t byte)
+    {
+        if(tail == nullptr)
+            tail = NetworkBufferPool::get().make(tailBufferSize());
+        tail->push_back(byte);
+        byteCount++;
+    }
+    void append(const uint8_t *bytes, size_t count)
+    {
+        if(count == 0)
+            return;
+        if(tail == nullptr)
+            tail = NetworkBufferPool::get().make(tailBufferSize());
+        tail->insert(tail->end(), bytes, bytes + count);
+        byteCount += count;
+    }
+    /// queues bytes by reference; they must not change until they are sent
+    void append(shared_ptr<const uint8_t> bytes, size_t count)
+    {
+        if(count < minSharedSegmentSize())
+        {
+            append(bytes.get(), count);
+            return;
+        }
+        sealTail();
+        segments.push_back(Segment(bytes, count));
+        byteCount += count;
+    }
+    /// moves all the bytes in queue to the end of this queue
+    void append(NetworkOutputQueue &&queue)
+    {
+        queue.sealTail();
+        if(empty())
+        {
+            *this = std::move(queue);
+            queue.clear();
+            return;
+        }
+        sealTail();
+        if(!queue.segments.empty())
+        {
+            Segment &first = queue.segments.front();
+            segments.push_back(Segment(shared_ptr<const uint8_t>(first.bytes, first.bytes.get() + queue.firstSegmentOffset), first.size - queue.firstSegmentOffset));
+            for(auto i = queue.segments.begin() + 1; i != queue.segments.end(); i++)
+                segments.push_back(std::move(*i));
+        }
+        byteCount += queue.byteCount;
+        queue.clear();
+    }
+    void clear()
+    {
+        segments.clear();
+        firstSegmentOffset = 0;
+        byteCount = 0;
+        tail = nullptr;
+    }
+    /** sends as much as the socket takes with sendmsg.
+     * returns false if the socket failed.
+     * for a non-blocking socket, or if wait is false, it returns true with bytes left in the queue when the socket is full.
+     * if sendCallCount isn't null the number of sendmsg calls is added to it.
+     */
+    bool send(int fd, uint64_t *sendCallCount = nullptr, bool wait = true);
+};
+
+}
+
+#endif // NETWORK_BUFFER_H_INCLUDED
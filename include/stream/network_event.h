@@ -2,69 +2,404 @@
 #define NETWORK_EVENT_H_INCLUDED
 
 #include "stream/stream.h"
+#include "stream/network_buffer.h"
 #include "util/enum_traits.h"
+#include <deque>
 
 enum class NetworkEventType : uint8_t
 {
-    Keepalive,
+    Keepalive, // the server replies to the client's keepalives with its float average and maximum tick times in seconds
     SendNewChunk,
     SendBlockUpdate,
     RequestChunk,
     SendPlayerProperties,
-    DEFINE_ENUM_LIMITS(Keepalive, SendPlayerProperties)
+    SendNewChunks, // a batch of chunks, each preceded by true and followed by false
+    SendBlockUpdates, // a batch of block updates grouped by chunk, see Server::writeBlockUpdates
+    RequestChunks, // a list of chunk positions with their ChunkRequestPriority, each preceded by true and followed by false
+    CancelChunkRequests, // a list of chunk positions that aren't needed any more, each preceded by true and followed by false
+    SubscribeChunks, // the float interest radius the server pushes chunks in; the client stops requesting chunks in it
+    UnsubscribeChunks, // a list of chunk positions the server stopped sending updates for, each preceded by true and followed by false
+    EventFragment, // a piece of a bulk event, see NetworkEventFragmenter
+    BulkBarrier, // the uint32 number of bulk events queued before the urgent events after it, see NetworkEventFragmenter
+    DEFINE_ENUM_LIMITS(Keepalive, BulkBarrier)
 };
 
+/// the logical channel an event is sent on; urgent events are sent between the fragments of bulk events
+enum class NetworkEventChannel : uint8_t
+{
+    Urgent,
+    Bulk,
+    DEFINE_ENUM_LIMITS(Urgent, Bulk)
+};
+
+/// how soon the client needs a requested chunk; requests with a lower priority are sent first
+enum class ChunkRequestPriority : uint8_t
+{
+    Urgent, // the chunks around the player
+    Visible,
+    Prefetch, // the chunks near the edge of the view distance
+    DEFINE_ENUM_LIMITS(Urgent, Prefetch)
+};
+
+/** a typed event with its payload.
+ *
+ * the payload is a reference-counted span that is usually in a pooled buffer
+ * from NetworkBufferPool: events parsed from a receive buffer point into that
+ * buffer and writing an event queues a reference to the payload, so the payload
+ * isn't copied between the socket and the decoder.
+ */
 class NetworkEvent final
 {
 public:
     NetworkEventType type;
 private:
-    vector<uint8_t> bytes;
+    shared_ptr<const uint8_t> payload;
+    size_t payloadSize;
+    static shared_ptr<const uint8_t> makePayload(vector<uint8_t> &&bytes)
+    {
+        if(bytes.empty())
+            return nullptr;
+        shared_ptr<vector<uint8_t>> buffer = stream::NetworkBufferPool::get().make(std::move(bytes));
+        return shared_ptr<const uint8_t>(buffer, buffer->data());
+    }
+    static shared_ptr<const uint8_t> makePayload(const uint8_t *bytes, size_t size)
+    {
+        if(size == 0)
+            return nullptr;
+        shared_ptr<vector<uint8_t>> buffer = stream::NetworkBufferPool::get().make(size);
+        buffer->assign(bytes, bytes + size);
+        return shared_ptr<const uint8_t>(buffer, buffer->data());
+    }
 public:
     NetworkEvent(NetworkEventType type = NetworkEventType::Keepalive)
-        : type(type), bytes()
+        : type(type), payload(), payloadSize(0)
     {
     }
     NetworkEvent(NetworkEventType type, const stream::MemoryWriter &writer)
-        : type(type), bytes(writer.getBuffer())
+        : NetworkEvent(type, writer.getBuffer())
     {
     }
     NetworkEvent(NetworkEventType type, stream::MemoryWriter &&writer)
-        : type(type), bytes(std::move(writer).getBuffer())
+        : NetworkEvent(type, std::move(writer).getBuffer())
     {
     }
     NetworkEvent(NetworkEventType type, const vector<uint8_t> & bytes)
-        : type(type), bytes(bytes)
+        : type(type), payload(makePayload(bytes.data(), bytes.size())), payloadSize(bytes.size())
     {
     }
     NetworkEvent(NetworkEventType type, vector<uint8_t> && bytes)
-        : type(type), bytes(bytes)
+        : type(type), payloadSize(bytes.size())
+    {
+        payload = makePayload(std::move(bytes));
+    }
+    /// makes an event that shares payload; the payload must not change while the event uses it
+    NetworkEvent(NetworkEventType type, shared_ptr<const uint8_t> payload, size_t payloadSize)
+        : type(type), payload(payload), payloadSize(payloadSize)
+    {
+    }
+    const uint8_t *data() const
+    {
+        return payload.get();
+    }
+    size_t size() const
+    {
+        return payloadSize;
+    }
+    shared_ptr<const uint8_t> getPayload() const
     {
+        return payload;
     }
     void write(stream::Writer &writer) const
     {
         stream::write<NetworkEventType>(writer, type);
-        uint32_t eventSize = bytes.size();
-        assert((size_t)eventSize == bytes.size());
+        uint32_t eventSize = payloadSize;
+        assert((size_t)eventSize == payloadSize);
         stream::write<uint32_t>(writer, eventSize);
-        writer.writeBytes(&bytes[0], bytes.size());
+        if(payloadSize > 0)
+            writer.writeSharedBytes(payload, payloadSize);
+    }
+    static constexpr size_t headerSize = 5; // the type and the uint32 size
+    static size_t maxEventSize() // larger payloads are rejected so a bad size can't make the receiver buffer it forever
+    {
+        return (size_t)1 << 24;
+    }
+    /// reads an event from the start of bytes without blocking; the event's payload points into bytes.
+    /// returns the number of bytes the event took or 0 if bytes doesn't hold the whole event yet
+    static size_t parse(shared_ptr<const uint8_t> bytes, size_t size, NetworkEvent &event)
+    {
+        if(size < headerSize)
+            return 0;
+        stream::MemoryReader headerReader(bytes, headerSize);
+        NetworkEventType type = stream::read<NetworkEventType>(headerReader);
+        uint32_t eventSize = stream::read<uint32_t>(headerReader);
+        if((size_t)eventSize > maxEventSize())
+            throw stream::InvalidDataValueException("network event too big");
+        if(size - headerSize < (size_t)eventSize)
+            return 0;
+        event = NetworkEvent(type, shared_ptr<const uint8_t>(bytes, bytes.get() + headerSize), (size_t)eventSize);
+        return headerSize + (size_t)eventSize;
     }
     static NetworkEvent read(stream::Reader &reader)
     {
         NetworkEventType type = stream::read<NetworkEventType>(reader);
         uint32_t eventSize = stream::read<uint32_t>(reader);
-        vector<uint8_t> bytes;
-        bytes.resize((size_t)eventSize);
-        reader.readBytes(&bytes[0], (size_t)eventSize);
-        return NetworkEvent(type, std::move(bytes));
+        if((size_t)eventSize > maxEventSize())
+            throw stream::InvalidDataValueException("network event too big");
+        if(eventSize == 0)
+            return NetworkEvent(type);
+        shared_ptr<vector<uint8_t>> buffer = stream::NetworkBufferPool::get().make((size_t)eventSize);
+        buffer->resize((size_t)eventSize);
+        reader.readBytes(buffer->data(), (size_t)eventSize);
+        return NetworkEvent(type, shared_ptr<const uint8_t>(buffer, buffer->data()), (size_t)eventSize);
+    }
+    /** reads an event and calls handleFn with it.
+     * if the reader can view the whole event, the payload points into the reader's buffer
+     * instead of being copied, so handleFn must not keep the event or its payload.
+     */
+    template <typename Fn>
+    static void readInPlace(stream::Reader &reader, Fn handleFn)
+    {
+        const uint8_t *header = reader.viewBytes(headerSize);
+        if(header == nullptr)
+        {
+            NetworkEvent event = read(reader);
+            handleFn(event);
+            return;
+        }
+        NetworkEventType type = (NetworkEventType)header[0];
+        if(type < enum_traits<NetworkEventType>::minimum || type > enum_traits<NetworkEventType>::maximum)
+            throw stream::InvalidDataValueException("read enum out of range");
+        size_t eventSize = ((size_t)header[1] << 24) | ((size_t)header[2] << 16) | ((size_t)header[3] << 8) | header[4];
+        if(eventSize > maxEventSize())
+            throw stream::InvalidDataValueException("network event too big");
+        const uint8_t *bytes = reader.viewBytes(headerSize + eventSize);
+        if(bytes == nullptr) // too big to view, so it's read into a pooled buffer
+        {
+            reader.skipBytes(headerSize);
+            shared_ptr<vector<uint8_t>> buffer = stream::NetworkBufferPool::get().make(eventSize);
+            buffer->resize(eventSize);
+            reader.readBytes(buffer->data(), eventSize);
+            NetworkEvent event(type, shared_ptr<const uint8_t>(buffer, buffer->data()), eventSize);
+            handleFn(event);
+            return;
+        }
+        NetworkEvent event(type);
+        if(eventSize > 0)
+            event = NetworkEvent(type, shared_ptr<const uint8_t>(bytes + headerSize, [](const uint8_t *){}), eventSize);
+        handleFn(event);
+        reader.skipBytes(headerSize + eventSize);
+    }
+    /// gets a reader over the payload; it shares the payload instead of copying it
+    shared_ptr<stream::Reader> getReader() const
+    {
+        return make_shared<stream::MemoryReader>(payload, payloadSize);
+    }
+    static NetworkEventChannel getChannel(NetworkEventType type)
+    {
+        switch(type)
+        {
+        case NetworkEventType::SendNewChunk:
+        case NetworkEventType::SendNewChunks:
+        case NetworkEventType::EventFragment:
+            return NetworkEventChannel::Bulk;
+        default:
+            return NetworkEventChannel::Urgent;
+        }
+    }
+};
+
+/** sends bulk events in fragments so that urgent events don't wait behind them.
+ *
+ * urgent events are written right away; bulk events are queued and writeFragment
+ * writes the next fragment, so urgent events written between fragments get ahead of
+ * the rest of the bulk events. the bulk events are still sent in order.
+ *
+ * a bulk event larger than fragmentSize() is sent as EventFragment events. the first
+ * fragment's payload starts with the type of the bulk event and its uint32 payload size,
+ * then every fragment has the next bytes of the payload.
+ *
+ * when an urgent event gets ahead of bulk events it is preceded by a BulkBarrier event
+ * with the number of bulk events queued so far, so the receiver can tell what it hasn't
+ * got yet; see NetworkEventAssembler.
+ */
+class NetworkEventFragmenter final
+{
+    NetworkEventFragmenter(const NetworkEventFragmenter &) = delete;
+    const NetworkEventFragmenter &operator =(const NetworkEventFragmenter &) = delete;
+private:
+    deque<NetworkEvent> bulkEvents;
+    size_t sentSize = 0; // the payload bytes of the first bulk event that are sent
+    size_t queuedSize = 0; // the payload bytes of the bulk events that aren't sent
+    uint32_t queuedBulkEventCount = 0; // every bulk event queued, wrapping around
+    uint32_t sentBarrier = 0;
+public:
+    NetworkEventFragmenter()
+    {
+    }
+    static size_t fragmentSize()
+    {
+        return 8192;
+    }
+    static size_t firstFragmentHeaderSize() // the type and the uint32 size of the bulk event
+    {
+        return 5;
+    }
+    /// returns if there are bulk events that aren't all sent
+    bool empty() const
+    {
+        return bulkEvents.empty();
+    }
+    /// the payload bytes of the queued bulk events that aren't sent yet
+    size_t size() const
+    {
+        return queuedSize;
+    }
+    /// writes an urgent event or queues a bulk event; returns the number of bytes written
+    size_t write(stream::Writer &writer, NetworkEvent event)
+    {
+        if(NetworkEvent::getChannel(event.type) == NetworkEventChannel::Bulk)
+        {
+            queuedSize += event.size();
+            queuedBulkEventCount++;
+            bulkEvents.push_back(std::move(event));
+            return 0;
+        }
+        size_t retval = 0;
+        if(!bulkEvents.empty() && sentBarrier != queuedBulkEventCount)
+        {
+            stream::write<NetworkEventType>(writer, NetworkEventType::BulkBarrier);
+            stream::write<uint32_t>(writer, sizeof(uint32_t));
+            stream::write<uint32_t>(writer, queuedBulkEventCount);
+            sentBarrier = queuedBulkEventCount;
+            retval += NetworkEvent::headerSize + sizeof(uint32_t);
+        }
+        event.write(writer);
+        return retval + NetworkEvent::headerSize + event.size();
+    }
+    /// writes the next fragment of the queued bulk events; returns the number of bytes written
+    size_t writeFragment(stream::Writer &writer)
+    {
+        if(bulkEvents.empty())
+            return 0;
+        NetworkEvent &event = bulkEvents.front();
+        if(sentSize == 0 && event.size() <= fragmentSize())
+        {
+            event.write(writer);
+            size_t retval = NetworkEvent::headerSize + event.size();
+            queuedSize -= event.size();
+            bulkEvents.pop_front();
+            return retval;
+        }
+        size_t size = min(fragmentSize(), event.size() - sentSize);
+        size_t headerSize = (sentSize == 0 ? firstFragmentHeaderSize() : 0);
+        stream::write<NetworkEventType>(writer, NetworkEventType::EventFragment);
+        stream::write<uint32_t>(writer, (uint32_t)(headerSize + size));
+        if(sentSize == 0)
+        {
+            stream::write<NetworkEventType>(writer, event.type);
+            stream::write<uint32_t>(writer, (uint32_t)event.size());
+        }
+        writer.writeSharedBytes(shared_ptr<const uint8_t>(event.getPayload(), event.data() + sentSize), size);
+        sentSize += size;
+        queuedSize -= size;
+        if(sentSize >= event.size())
+        {
+            sentSize = 0;
+            bulkEvents.pop_front();
+        }
+        return NetworkEvent::headerSize + headerSize + size;
+    }
+};
+
+/** puts back together the bulk events sent by a NetworkEventFragmenter.
+ *
+ * it counts the bulk events received so the receiver can tell if the urgent events
+ * it is handling got ahead of bulk events that aren't received yet.
+ */
+class NetworkEventAssembler final
+{
+    NetworkEventAssembler(const NetworkEventAssembler &) = delete;
+    const NetworkEventAssembler &operator =(const NetworkEventAssembler &) = delete;
+private:
+    shared_ptr<vector<uint8_t>> buffer; // the fragmented event's payload, nullptr if there isn't one
+    NetworkEventType fragmentedType = NetworkEventType::Keepalive;
+    size_t fragmentedSize = 0;
+    uint32_t receivedBulkEventCount = 0; // wrapping around
+    uint32_t bulkBarrier = 0;
+public:
+    NetworkEventAssembler()
+    {
+    }
+    /** takes the next received event and returns true with event set to the event to handle if there is one.
+     * fragments are collected until their event is complete. event may share received's payload.
+     */
+    bool add(const NetworkEvent &received, NetworkEvent &event)
+    {
+        switch(received.type)
+        {
+        case NetworkEventType::EventFragment:
+        {
+            const uint8_t *bytes = received.data();
+            size_t size = received.size();
+            if(buffer == nullptr)
+            {
+                stream::MemoryReader reader(received.getPayload(), min(size, NetworkEventFragmenter::firstFragmentHeaderSize()));
+                fragmentedType = stream::read<NetworkEventType>(reader);
+                if(NetworkEvent::getChannel(fragmentedType) != NetworkEventChannel::Bulk || fragmentedType == NetworkEventType::EventFragment)
+                    throw stream::InvalidDataValueException("fragmented event isn't a bulk event");
+                fragmentedSize = stream::read<uint32_t>(reader);
+                if(fragmentedSize > NetworkEvent::maxEventSize())
+                    throw stream::InvalidDataValueException("fragmented event too big");
+                bytes += NetworkEventFragmenter::firstFragmentHeaderSize();
+                size -= NetworkEventFragmenter::firstFragmentHeaderSize();
+                buffer = stream::NetworkBufferPool::get().make(fragmentedSize);
+            }
+            if(size > fragmentedSize - buffer->size())
+                throw stream::InvalidDataValueException("event fragment is past the end of its event");
+            buffer->insert(buffer->end(), bytes, bytes + size);
+            if(buffer->size() < fragmentedSize)
+                return false;
+            if(fragmentedSize == 0)
+                event = NetworkEvent(fragmentedType);
+            else
+                event = NetworkEvent(fragmentedType, shared_ptr<const uint8_t>(buffer, buffer->data()), fragmentedSize);
+            buffer = nullptr;
+            receivedBulkEventCount++;
+            return true;
+        }
+        case NetworkEventType::BulkBarrier:
+            bulkBarrier = stream::read<uint32_t>(*received.getReader());
+            return false;
+        default:
+            if(NetworkEvent::getChannel(received.type) == NetworkEventChannel::Bulk)
+            {
+                if(buffer != nullptr)
+                    throw stream::InvalidDataValueException("bulk event in the middle of a fragmented event");
+                receivedBulkEventCount++;
+            }
+            event = received;
+            return true;
+        }
+    }
+    /// the number of bulk events received, wrapping around
+    uint32_t getReceivedBulkEventCount() const
+    {
+        return receivedBulkEventCount;
+    }
+    /// the number of bulk events that were queued before the urgent event being handled, wrapping around
+    uint32_t getBulkBarrier() const
+    {
+        return isAheadOfBulkEvents() ? bulkBarrier : receivedBulkEventCount;
     }
-    shared_ptr<stream::Reader> getReader() const &
+    /// returns if the urgent event being handled got ahead of bulk events that aren't received yet
+    bool isAheadOfBulkEvents() const
     {
-        return make_shared<stream::MemoryReader>(bytes);
+        return (int32_t)(bulkBarrier - receivedBulkEventCount) > 0;
     }
-    shared_ptr<stream::Reader> getReader() &&
+    /// returns if the bulk events queued before bulkBarrier was read are all received
+    bool isReceived(uint32_t bulkBarrier) const
     {
-        return make_shared<stream::MemoryReader>(std::move(bytes));
+        return (int32_t)(receivedBulkEventCount - bulkBarrier) >= 0;
     }
 };
 
@@ -0,0 +1,141 @@
+/*
+ * Voxels is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Voxels is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Voxels; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#ifndef NETWORK_EVENT_LOOP_H_INCLUDED
+#define NETWORK_EVENT_LOOP_H_INCLUDED
+
+#include "stream/stream.h"
+#include "stream/network_event.h"
+#include "stream/network_buffer.h"
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace stream
+{
+
+class NetworkEventLoop;
+
+/** non-blocking socket driven by a NetworkEventLoop.
+ *
+ * complete NetworkEvents read from the socket are passed to the event handler
+ * on an I/O thread, so the handler must not block. their payloads point into
+ * the pooled receive buffer. written bytes are sent right away if the socket
+ * can take them and are queued until the socket is writable otherwise.
+ */
+class NetworkEventLoopConnection final
+{
+    friend class NetworkEventLoop;
+    NetworkEventLoopConnection(const NetworkEventLoopConnection &) = delete;
+    const NetworkEventLoopConnection &operator =(const NetworkEventLoopConnection &) = delete;
+public:
+    typedef function<void(NetworkEvent event)> EventHandler;
+    typedef function<void()> NotifyHandler;
+private:
+    NetworkEventLoop &eventLoop;
+    const int fd;
+    mutex lock;
+    shared_ptr<vector<uint8_t>> inputBuffer; // pooled; parsed events share it so it's replaced instead of reused
+    NetworkOutputQueue outputQueue;
+    bool handling = false; // if an I/O thread is handling this connection; it rearms the socket when it's done
+    bool closed = false;
+    bool readingPaused = false;
+    EventHandler eventHandler;
+    NotifyHandler drainedHandler, closedHandler;
+    shared_ptr<Writer> writerInternal;
+    NetworkEventLoopConnection(NetworkEventLoop &eventLoop, int fd, EventHandler eventHandler, NotifyHandler drainedHandler, NotifyHandler closedHandler);
+    void rearm(); // must hold lock
+    bool sendBuffered(); // must hold lock; returns false if the socket failed
+public:
+    ~NetworkEventLoopConnection();
+    /// queues bytes to be sent
+    void write(const uint8_t *bytes, size_t count);
+    /// queues all the bytes in queue to be sent, keeping its shared segments by reference
+    void write(NetworkOutputQueue &&queue);
+    /// gets a Writer that queues bytes and passes them to write when flushed
+    shared_ptr<Writer> pwriter()
+    {
+        return writerInternal;
+    }
+    size_t getPendingOutputBytes()
+    {
+        lock_guard<mutex> lockIt(lock);
+        return outputQueue.size();
+    }
+    bool isClosed()
+    {
+        lock_guard<mutex> lockIt(lock);
+        return closed;
+    }
+    /** stops reading from the socket until resumeReading is called, so a peer that sends
+     * faster than its events are handled is held back by TCP instead of filling memory.
+     * events already read are still passed to the event handler.
+     */
+    void pauseReading();
+    void resumeReading();
+    /// shuts down the socket; the closed handler is called from an I/O thread
+    void close();
+};
+
+/** epoll-based event loop that runs many non-blocking sockets on a small
+ * fixed set of I/O threads.
+ *
+ * each socket is registered one-shot so that only one I/O thread handles it
+ * at a time and is rearmed when that thread is done with it.
+ */
+class NetworkEventLoop final
+{
+    friend class NetworkEventLoopConnection;
+    NetworkEventLoop(const NetworkEventLoop &) = delete;
+    const NetworkEventLoop &operator =(const NetworkEventLoop &) = delete;
+private:
+    int epollFd;
+    int stopFd; // eventfd that wakes all the I/O threads to stop
+    vector<thread> ioThreads;
+    mutex connectionsLock;
+    unordered_map<int, shared_ptr<NetworkEventLoopConnection>> connections;
+    atomic_bool stopping;
+    static size_t readSizePerWakeup()
+    {
+        return (size_t)1 << 18;
+    }
+    static size_t recvSize()
+    {
+        return 16384;
+    }
+    void ioThread();
+    void handle(shared_ptr<NetworkEventLoopConnection> connection, uint32_t events);
+    void finishClose(shared_ptr<NetworkEventLoopConnection> connection);
+public:
+    explicit NetworkEventLoop(size_t ioThreadCount);
+    /// stops the I/O threads and closes all the connections
+    ~NetworkEventLoop();
+    /** starts running the socket fd, which the event loop takes ownership of.
+     * eventHandler is called with every event read, drainedHandler when all the buffered
+     * output is sent and closedHandler once when the connection is closed; the handlers
+     * are released after closedHandler is called.
+     */
+    shared_ptr<NetworkEventLoopConnection> add(int fd, NetworkEventLoopConnection::EventHandler eventHandler, NetworkEventLoopConnection::NotifyHandler drainedHandler, NetworkEventLoopConnection::NotifyHandler closedHandler);
+};
+
+}
+
+#endif // NETWORK_EVENT_LOOP_H_INCLUDED
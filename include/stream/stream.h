@@ -132,13 +132,29 @@ public:
     {
         return false;
     }
-    void readBytes(uint8_t * array, size_t count)
+    virtual void readBytes(uint8_t * array, size_t count)
     {
         for(size_t i = 0; i < count; i++)
         {
             array[i] = readByte();
         }
     }
+    /** gets a pointer to the next count bytes without reading them, waiting for them if needed,
+     * so that they can be parsed in place. the pointer is valid until the next read.
+     * returns nullptr if the reader doesn't keep the bytes in memory.
+     */
+    virtual const uint8_t * viewBytes(size_t count)
+    {
+        return nullptr;
+    }
+    /// reads count bytes and throws them away
+    virtual void skipBytes(size_t count)
+    {
+        for(size_t i = 0; i < count; i++)
+        {
+            readByte();
+        }
+    }
     uint8_t readU8()
     {
         uint8_t retval = readByte();
@@ -153,8 +169,9 @@ public:
     }
     uint16_t readU16()
     {
-        uint16_t v = readU8();
-        uint16_t retval = (v << 8) | readU8();
+        uint8_t bytes[2];
+        readBytes(bytes, sizeof(bytes));
+        uint16_t retval = ((uint16_t)bytes[0] << 8) | bytes[1];
         DUMP_V(readU16, retval);
         return retval;
     }
@@ -166,8 +183,9 @@ public:
     }
     uint32_t readU32()
     {
-        uint32_t v = readU16();
-        uint32_t retval = (v << 16) | readU16();
+        uint8_t bytes[4];
+        readBytes(bytes, sizeof(bytes));
+        uint32_t retval = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
         DUMP_V(readU32, retval);
         return retval;
     }
@@ -179,8 +197,11 @@ public:
     }
     uint64_t readU64()
     {
-        uint64_t v = readU32();
-        uint64_t retval = (v << 32) | readU32();
+        uint8_t bytes[8];
+        readBytes(bytes, sizeof(bytes));
+        uint64_t retval = 0;
+        for(uint8_t byte : bytes)
+            retval = (retval << 8) | byte;
         DUMP_V(readU64, retval);
         return retval;
     }
@@ -355,15 +376,27 @@ public:
     virtual void flush()
     {
     }
+    /// flushes without waiting for more bytes to send with them, for latency-critical data;
+    /// writers that hold back small flushes send right away
+    virtual void flushUrgent()
+    {
+        flush();
+    }
     virtual bool writeWaits()
     {
         return true;
     }
-    void writeBytes(const uint8_t * array, size_t count)
+    virtual void writeBytes(const uint8_t * array, size_t count)
     {
         for(size_t i = 0; i < count; i++)
             writeByte(array[i]);
     }
+    /// writes bytes that stay alive and unchanged as long as bytes is referenced;
+    /// writers that can send them later keep the reference instead of copying them
+    virtual void writeSharedBytes(shared_ptr<const uint8_t> bytes, size_t count)
+    {
+        writeBytes(bytes.get(), count);
+    }
     void writeU8(uint8_t v)
     {
         writeByte(v);
@@ -864,6 +897,15 @@ public:
         }
         return ch;
     }
+    virtual void readBytes(uint8_t * array, size_t count) override
+    {
+        if(fread((void *)array, 1, count, f) != count)
+        {
+            if(ferror(f))
+                throw IOException("IO Error : can't read from file");
+            throw EOFException();
+        }
+    }
 };
 
 class FileWriter final : public Writer
@@ -892,6 +934,11 @@ public:
         if(fputc(v, f) == EOF)
             throw IOException("IO Error : can't write to file");
     }
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        if(fwrite((const void *)array, 1, count, f) != count)
+            throw IOException("IO Error : can't write to file");
+    }
     virtual void flush() override
     {
         if(EOF == fflush(f))
@@ -941,6 +988,22 @@ public:
             throw EOFException();
         return mem.get()[offset++];
     }
+    virtual void readBytes(uint8_t * array, size_t count) override
+    {
+        memcpy((void *)array, (const void *)viewBytes(count), count);
+        offset += count;
+    }
+    virtual const uint8_t * viewBytes(size_t count) override
+    {
+        if(count > length - offset)
+            throw EOFException();
+        return mem.get() + offset;
+    }
+    virtual void skipBytes(size_t count) override
+    {
+        viewBytes(count);
+        offset += count;
+    }
 };
 
 class MemoryWriter final : public Writer
@@ -959,6 +1022,10 @@ public:
     {
         memory.push_back(v);
     }
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        memory.insert(memory.end(), array, array + count);
+    }
     const vector<uint8_t> & getBuffer() const &
     {
         return memory;
@@ -1195,6 +1262,11 @@ public:
         writeBuffer(true);
         pwriter->flush();
     }
+    virtual void flushUrgent() override
+    {
+        writeBuffer(true);
+        pwriter->flushUrgent();
+    }
     virtual void writeByte(uint8_t v) override
     {
         if(buffer.size() >= buffer.capacity() / 2)
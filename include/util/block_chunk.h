@@ -5,14 +5,19 @@
 #include "stream/stream.h"
 #include "util/variable_set.h"
 #include "stream/compressed_stream.h"
+#include "util/palette_array.h"
 #include <array>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
 
 using namespace std;
 
 template <typename T, int32_t ChunkSizeXV = 16, int32_t ChunkSizeYV = 16, int32_t ChunkSizeZV = 16, bool TransmitCompressedV = true>
 struct BlockChunk
 {
-    const PositionI basePosition;
+    PositionI basePosition; // only changed by reset
     static constexpr int32_t chunkSizeX = ChunkSizeXV;
     static constexpr int32_t chunkSizeY = ChunkSizeYV;
     static constexpr int32_t chunkSizeZ = ChunkSizeZV;
@@ -24,10 +29,6 @@ struct BlockChunk
     static_assert((chunkSizeZ & (chunkSizeZ - 1)) == 0, "chunkSizeZ must be a power of 2");
     static constexpr bool transmitCompressed = TransmitCompressedV;
     mutable ChangeTracker changeTracker;
-    constexpr BlockChunk(PositionI basePosition)
-        : basePosition(basePosition)
-    {
-    }
     static constexpr PositionI getChunkBasePosition(PositionI pos)
     {
         return PositionI(pos.x & ~(chunkSizeX - 1), pos.y & ~(chunkSizeY - 1), pos.z & ~(chunkSizeZ - 1), pos.d);
@@ -36,35 +37,311 @@ struct BlockChunk
     {
         return PositionI(pos.x & (chunkSizeX - 1), pos.y & (chunkSizeY - 1), pos.z & (chunkSizeZ - 1), pos.d);
     }
-    array<array<array<T, chunkSizeZ>, chunkSizeY>, chunkSizeX> blocks;
+    static constexpr size_t getArrayIndex(int32_t x, int32_t y, int32_t z)
+    {
+        return ((size_t)x * chunkSizeY + (size_t)y) * chunkSizeZ + (size_t)z;
+    }
+    static VectorI getArrayRelativePosition(size_t index)
+    {
+        return VectorI((int32_t)(index / chunkSizeZ / chunkSizeY), (int32_t)(index / chunkSizeZ % chunkSizeY), (int32_t)(index % chunkSizeZ));
+    }
+    typedef PaletteArray<T, (size_t)chunkSizeX * chunkSizeY * chunkSizeZ> BlocksArrayType;
+    /** one version of the blocks in a chunk.
+     * published snapshots are never modified, so a reader pins a consistent
+     * view of the chunk by holding a shared_ptr to one.
+     */
+    struct Snapshot final
+    {
+        uint64_t version; // unique across all chunks
+        BlocksArrayType blocks;
+        Snapshot()
+            : version(makeVersion())
+        {
+        }
+        Snapshot(const Snapshot &rt)
+            : version(makeVersion()), blocks(rt.blocks)
+        {
+        }
+        const T &get(int32_t x, int32_t y, int32_t z) const
+        {
+            assert(x >= 0 && x < chunkSizeX && y >= 0 && y < chunkSizeY && z >= 0 && z < chunkSizeZ);
+            return blocks.get(getArrayIndex(x, y, z));
+        }
+        const T &get(VectorI relativePosition) const
+        {
+            return get(relativePosition.x, relativePosition.y, relativePosition.z);
+        }
+        bool set(int32_t x, int32_t y, int32_t z, const T &value) // only for snapshots passed to edit; returns if the block changed
+        {
+            assert(x >= 0 && x < chunkSizeX && y >= 0 && y < chunkSizeY && z >= 0 && z < chunkSizeZ);
+            return blocks.set(getArrayIndex(x, y, z), value);
+        }
+        bool set(VectorI relativePosition, const T &value)
+        {
+            return set(relativePosition.x, relativePosition.y, relativePosition.z, value);
+        }
+    private:
+        static uint64_t makeVersion()
+        {
+            static atomic_uint_fast64_t nextVersion(1);
+            return nextVersion++;
+        }
+    };
+private:
+    /// the blocks of a compacted chunk : the distinct blocks and the compressed per-block indices into them
+    struct CompactedBlocks final
+    {
+        uint64_t version;
+        vector<T> palette;
+        vector<uint8_t> compressedIndices;
+    };
+    mutable shared_ptr<const Snapshot> snapshot; // only accessed with the atomic shared_ptr functions; nullptr while compacted
+    mutable shared_ptr<const CompactedBlocks> compactedBlocks; // only accessed while holding editLock
+    mutable mutex editLock;
+    shared_ptr<Snapshot> decodeSnapshot() const // must hold editLock; leaves the chunk compacted
+    {
+        assert(compactedBlocks != nullptr);
+        shared_ptr<Snapshot> newSnapshot = make_shared<Snapshot>();
+        stream::MemoryReader memoryReader(shared_ptr<const uint8_t>(compactedBlocks, compactedBlocks->compressedIndices.data()), compactedBlocks->compressedIndices.size());
+        stream::ExpandReader reader(memoryReader);
+        bool wideIndices = compactedBlocks->palette.size() > 0x100;
+        for(size_t i = 0; i < BlocksArrayType::size(); i++)
+        {
+            size_t index = (wideIndices ? reader.readU16() : reader.readU8());
+            assert(index < compactedBlocks->palette.size());
+            newSnapshot->blocks.set(i, compactedBlocks->palette[index]);
+        }
+        newSnapshot->version = compactedBlocks->version; // the blocks didn't change
+        return newSnapshot;
+    }
+    shared_ptr<const Snapshot> loadSnapshot() const // must hold editLock
+    {
+        shared_ptr<const Snapshot> retval = atomic_load(&snapshot);
+        if(retval != nullptr)
+            return retval;
+        retval = decodeSnapshot();
+        atomic_store(&snapshot, retval);
+        compactedBlocks = nullptr;
+        return retval;
+    }
+public:
+    BlockChunk(PositionI basePosition)
+        : basePosition(basePosition), snapshot(make_shared<Snapshot>())
+    {
+    }
+    /// makes a chunk that shares blocks
+    BlockChunk(PositionI basePosition, shared_ptr<const Snapshot> blocks)
+        : basePosition(basePosition), snapshot(blocks)
+    {
+        assert(blocks != nullptr);
+    }
+    /// gets the current version of the blocks; it doesn't change while it is held.
+    /// expands the blocks if the chunk is compacted
+    shared_ptr<const Snapshot> getSnapshot() const
+    {
+        shared_ptr<const Snapshot> retval = atomic_load(&snapshot);
+        if(retval != nullptr)
+            return retval;
+        lock_guard<mutex> lockIt(editLock);
+        return loadSnapshot();
+    }
+    /** gets the current version of the blocks without expanding the chunk.
+     * a compacted chunk is decoded into a snapshot that isn't kept, so reading the blocks
+     * doesn't undo compaction; for callers that don't count as using the chunk
+     */
+    shared_ptr<const Snapshot> peekSnapshot() const
+    {
+        shared_ptr<const Snapshot> retval = atomic_load(&snapshot);
+        if(retval != nullptr)
+            return retval;
+        lock_guard<mutex> lockIt(editLock);
+        retval = atomic_load(&snapshot);
+        if(retval != nullptr)
+            return retval;
+        return decodeSnapshot();
+    }
+    /// doesn't expand the chunk
+    uint64_t getVersion() const
+    {
+        shared_ptr<const Snapshot> blocks = atomic_load(&snapshot);
+        if(blocks != nullptr)
+            return blocks->version;
+        lock_guard<mutex> lockIt(editLock);
+        blocks = atomic_load(&snapshot);
+        if(blocks != nullptr)
+            return blocks->version;
+        return compactedBlocks->version;
+    }
+    bool isCompacted() const
+    {
+        return atomic_load(&snapshot) == nullptr;
+    }
+    /** replaces the blocks with a compressed copy that is expanded again the next time they are used.
+     * returns the number of bytes used by the blocks before and after, or (0, 0) if the chunk was already compacted
+     */
+    pair<size_t, size_t> compact()
+    {
+        lock_guard<mutex> lockIt(editLock);
+        shared_ptr<const Snapshot> blocks = atomic_load(&snapshot);
+        if(blocks == nullptr)
+            return pair<size_t, size_t>(0, 0);
+        shared_ptr<CompactedBlocks> newCompactedBlocks = make_shared<CompactedBlocks>();
+        newCompactedBlocks->version = blocks->version;
+        vector<size_t> indices;
+        indices.reserve(BlocksArrayType::size());
+        size_t lastIndex = 0;
+        for(size_t i = 0; i < BlocksArrayType::size(); i++)
+        {
+            const T &value = blocks->blocks.get(i);
+            if(lastIndex >= newCompactedBlocks->palette.size() || !(newCompactedBlocks->palette[lastIndex] == value))
+            {
+                lastIndex = std::find(newCompactedBlocks->palette.begin(), newCompactedBlocks->palette.end(), value) - newCompactedBlocks->palette.begin();
+                if(lastIndex == newCompactedBlocks->palette.size())
+                    newCompactedBlocks->palette.push_back(value);
+            }
+            indices.push_back(lastIndex);
+        }
+        bool wideIndices = newCompactedBlocks->palette.size() > 0x100;
+        stream::MemoryWriter memoryWriter;
+        {
+            stream::CompressWriter writer(memoryWriter);
+            for(size_t index : indices)
+            {
+                if(wideIndices)
+                    writer.writeU16((uint16_t)index);
+                else
+                    writer.writeU8((uint8_t)index);
+            }
+            writer.finish();
+        }
+        newCompactedBlocks->compressedIndices = std::move(memoryWriter).getBuffer();
+        newCompactedBlocks->compressedIndices.shrink_to_fit();
+        newCompactedBlocks->palette.shrink_to_fit();
+        size_t expandedSize = sizeof(Snapshot) + blocks->blocks.getMemoryUsage();
+        size_t compactedSize = sizeof(CompactedBlocks) + newCompactedBlocks->palette.capacity() * sizeof(T) + newCompactedBlocks->compressedIndices.capacity();
+        compactedBlocks = newCompactedBlocks;
+        atomic_store(&snapshot, shared_ptr<const Snapshot>());
+        return pair<size_t, size_t>(expandedSize, compactedSize);
+    }
+    /// returns the approximate number of bytes used by the blocks without expanding them
+    size_t getMemoryUsage() const
+    {
+        shared_ptr<const Snapshot> blocks = atomic_load(&snapshot);
+        if(blocks != nullptr)
+            return sizeof(Snapshot) + blocks->blocks.getMemoryUsage();
+        lock_guard<mutex> lockIt(editLock);
+        blocks = atomic_load(&snapshot);
+        if(blocks != nullptr)
+            return sizeof(Snapshot) + blocks->blocks.getMemoryUsage();
+        return sizeof(CompactedBlocks) + compactedBlocks->palette.capacity() * sizeof(T) + compactedBlocks->compressedIndices.capacity();
+    }
+    /** copies the current snapshot and passes the copy to editFn, which returns if it changed anything.
+     * if it did, the copy is published as the new version.
+     * edits are serialized with each other but never block readers.
+     */
+    template <typename Fn>
+    void edit(Fn editFn)
+    {
+        lock_guard<mutex> lockIt(editLock);
+        shared_ptr<Snapshot> newSnapshot = make_shared<Snapshot>(*loadSnapshot());
+        if(editFn(*newSnapshot))
+            atomic_store(&snapshot, shared_ptr<const Snapshot>(newSnapshot));
+    }
+    T get(int32_t x, int32_t y, int32_t z) const
+    {
+        return getSnapshot()->get(x, y, z);
+    }
+    T get(VectorI relativePosition) const
+    {
+        return get(relativePosition.x, relativePosition.y, relativePosition.z);
+    }
+    /// sets one block; copies the chunk, so use edit or update for more than one block
+    void set(int32_t x, int32_t y, int32_t z, const T &value)
+    {
+        if(get(x, y, z) == value)
+            return;
+        edit([&](Snapshot &blocks)
+        {
+            return blocks.set(x, y, z, value);
+        });
+    }
+    void set(VectorI relativePosition, const T &value)
+    {
+        set(relativePosition.x, relativePosition.y, relativePosition.z, value);
+    }
+    /** for each of relativePositions, replaces the block with newValueFn(relativePosition, oldValue)
+     * as one new version of the chunk.
+     * changedFn(relativePosition) is called for each block that changed.
+     */
+    template <typename NewValueFn, typename ChangedFn>
+    void update(const vector<VectorI> &relativePositions, NewValueFn newValueFn, ChangedFn changedFn)
+    {
+        edit([&](Snapshot &blocks)
+        {
+            bool changed = false;
+            for(VectorI relativePosition : relativePositions)
+            {
+                if(blocks.set(relativePosition, newValueFn(relativePosition, blocks.get(relativePosition))))
+                {
+                    changed = true;
+                    changedFn(relativePosition);
+                }
+            }
+            return changed;
+        });
+    }
     BlockChunk(const BlockChunk & rt)
-        : basePosition(rt.basePosition), blocks(rt.blocks)
+        : basePosition(rt.basePosition), snapshot(rt.getSnapshot())
     {
         changeTracker.onChange();
     }
+    /// makes this chunk an empty chunk at newBasePosition; only for recycling chunks that no other thread uses
+    void reset(PositionI newBasePosition)
+    {
+        lock_guard<mutex> lockIt(editLock);
+        basePosition = newBasePosition;
+        atomic_store(&snapshot, shared_ptr<const Snapshot>(make_shared<Snapshot>()));
+        compactedBlocks = nullptr;
+        changeTracker.onChange();
+    }
+    /// makes this chunk share the blocks of rt; only for recycling chunks that no other thread uses
+    void reset(const BlockChunk &rt)
+    {
+        shared_ptr<const Snapshot> newSnapshot = rt.getSnapshot();
+        lock_guard<mutex> lockIt(editLock);
+        basePosition = rt.basePosition;
+        atomic_store(&snapshot, newSnapshot);
+        compactedBlocks = nullptr;
+        changeTracker.onChange();
+    }
 private:
     static void readInternal(shared_ptr<BlockChunk> chunk, stream::Reader &reader, VariableSet &variableSet)
     {
-        for(int32_t x = 0; x < chunkSizeX; x++)
+        chunk->edit([&](Snapshot &blocks)
         {
-            for(int32_t y = 0; y < chunkSizeY; y++)
+            for(int32_t x = 0; x < chunkSizeX; x++)
             {
-                for(int32_t z = 0; z < chunkSizeZ; z++)
+                for(int32_t y = 0; y < chunkSizeY; y++)
                 {
-                    chunk->blocks[x][y][z] = (T)stream::read<T>(reader, variableSet);
+                    for(int32_t z = 0; z < chunkSizeZ; z++)
+                    {
+                        blocks.set(x, y, z, (T)stream::read<T>(reader, variableSet));
+                    }
                 }
             }
-        }
+            return true;
+        });
     }
     void writeInternal(stream::Writer &writer, VariableSet &variableSet) const
     {
+        shared_ptr<const Snapshot> blocks = peekSnapshot();
         for(int32_t x = 0; x < chunkSizeX; x++)
         {
             for(int32_t y = 0; y < chunkSizeY; y++)
             {
                 for(int32_t z = 0; z < chunkSizeZ; z++)
                 {
-                    stream::write<T>(writer, variableSet, blocks[x][y][z]);
+                    stream::write<T>(writer, variableSet, blocks->get(x, y, z));
                 }
             }
         }
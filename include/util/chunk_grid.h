@@ -0,0 +1,261 @@
+#ifndef CHUNK_GRID_H_INCLUDED
+#define CHUNK_GRID_H_INCLUDED
+
+#include "util/position.h"
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/// spatial index of chunks made of fixed-size pages of chunk slots keyed by
+/// region position. readers never take writeLock : the page table is an
+/// immutable snapshot published with atomic shared_ptr operations, so pages
+/// stay alive while a reader uses them, and slots are only accessed through
+/// the atomic shared_ptr operations. writers serialize on writeLock to change
+/// slots, so a page's occupancy is exact and a page is freed when its last
+/// chunk is removed. the table is rebuilt when pages are added or freed,
+/// keeping its load factor under maxLoadFactor().
+template <typename T, int32_t ChunkSizeX, int32_t ChunkSizeY, int32_t ChunkSizeZ, int PageSizeShiftAmount = 3>
+class ChunkGrid final
+{
+    ChunkGrid(const ChunkGrid &) = delete;
+    const ChunkGrid &operator =(const ChunkGrid &) = delete;
+public:
+    static constexpr int pageSizeShiftAmount = PageSizeShiftAmount;
+    static constexpr int32_t pageSize = (int32_t)1 << pageSizeShiftAmount;
+    static constexpr size_t slotsPerPage = (size_t)pageSize * pageSize * pageSize;
+private:
+    struct Page final
+    {
+        const PositionI regionPosition;
+        array<shared_ptr<T>, slotsPerPage> slots;
+        size_t occupancy = 0; // the chunks in slots; locked by writeLock
+        explicit Page(PositionI regionPosition)
+            : regionPosition(regionPosition)
+        {
+        }
+    };
+    /// an open-addressed hash table of the pages; it isn't changed once it's published
+    struct Table final
+    {
+        vector<shared_ptr<Page>> pages;
+        vector<Page *> buckets; // the size is a power of 2; nullptr for an empty bucket
+        explicit Table(vector<shared_ptr<Page>> pagesIn)
+            : pages(std::move(pagesIn))
+        {
+            size_t bucketCount = 16;
+            while((double)pages.size() > maxLoadFactor() * bucketCount)
+                bucketCount *= 2;
+            buckets.assign(bucketCount, nullptr);
+            for(const shared_ptr<Page> &page : pages)
+            {
+                size_t index = getBucketIndex(page->regionPosition, bucketCount);
+                while(buckets[index] != nullptr)
+                    index = (index + 1) & (bucketCount - 1);
+                buckets[index] = page.get();
+            }
+        }
+        Page *find(PositionI regionPosition) const
+        {
+            for(size_t index = getBucketIndex(regionPosition, buckets.size()); buckets[index] != nullptr; index = (index + 1) & (buckets.size() - 1))
+            {
+                if(buckets[index]->regionPosition == regionPosition)
+                    return buckets[index];
+            }
+            return nullptr;
+        }
+    };
+    shared_ptr<const Table> table;
+    atomic_size_t chunkCount;
+    mutex writeLock;
+    static double maxLoadFactor()
+    {
+        return 0.5;
+    }
+    static int32_t getChunkIndex(int32_t v, int32_t chunkSize)
+    {
+        return v / chunkSize; // v is a multiple of chunkSize
+    }
+    static PositionI getRegionPosition(PositionI chunkPosition)
+    {
+        return PositionI(getChunkIndex(chunkPosition.x, ChunkSizeX) >> pageSizeShiftAmount,
+                         getChunkIndex(chunkPosition.y, ChunkSizeY) >> pageSizeShiftAmount,
+                         getChunkIndex(chunkPosition.z, ChunkSizeZ) >> pageSizeShiftAmount,
+                         chunkPosition.d);
+    }
+    static size_t getSlotIndex(PositionI chunkPosition)
+    {
+        size_t x = getChunkIndex(chunkPosition.x, ChunkSizeX) & (pageSize - 1);
+        size_t y = getChunkIndex(chunkPosition.y, ChunkSizeY) & (pageSize - 1);
+        size_t z = getChunkIndex(chunkPosition.z, ChunkSizeZ) & (pageSize - 1);
+        return (x * pageSize + y) * pageSize + z;
+    }
+    static size_t getBucketIndex(PositionI regionPosition, size_t bucketCount)
+    {
+        return hash<PositionI>()(regionPosition) & (bucketCount - 1);
+    }
+    shared_ptr<const Table> getTable() const
+    {
+        return atomic_load(&table);
+    }
+    Page *findOrMakePage(PositionI regionPosition) // must hold writeLock
+    {
+        shared_ptr<const Table> oldTable = getTable();
+        Page *retval = oldTable->find(regionPosition);
+        if(retval != nullptr)
+            return retval;
+        vector<shared_ptr<Page>> pages = oldTable->pages;
+        pages.push_back(make_shared<Page>(regionPosition));
+        retval = pages.back().get();
+        atomic_store(&table, shared_ptr<const Table>(make_shared<Table>(std::move(pages))));
+        return retval;
+    }
+    void freePage(Page *page) // must hold writeLock; page must be empty
+    {
+        shared_ptr<const Table> oldTable = getTable();
+        vector<shared_ptr<Page>> pages;
+        pages.reserve(oldTable->pages.size());
+        for(const shared_ptr<Page> &v : oldTable->pages)
+        {
+            if(v.get() != page)
+                pages.push_back(v);
+        }
+        atomic_store(&table, shared_ptr<const Table>(make_shared<Table>(std::move(pages))));
+    }
+    /// stores value in page's slot for chunkPosition, keeping the occupancy; must hold writeLock
+    shared_ptr<T> exchangeSlot(Page *page, PositionI chunkPosition, shared_ptr<T> value)
+    {
+        shared_ptr<T> retval = atomic_exchange(&page->slots[getSlotIndex(chunkPosition)], value);
+        if(retval == nullptr && value != nullptr)
+        {
+            page->occupancy++;
+            chunkCount++;
+        }
+        else if(retval != nullptr && value == nullptr)
+        {
+            page->occupancy--;
+            chunkCount--;
+            if(page->occupancy == 0)
+                freePage(page);
+        }
+        return retval;
+    }
+    static shared_ptr<T> loadSlot(const Page *page, PositionI chunkPosition)
+    {
+        return atomic_load(&page->slots[getSlotIndex(chunkPosition)]);
+    }
+public:
+    ChunkGrid()
+        : table(make_shared<Table>(vector<shared_ptr<Page>>())), chunkCount(0)
+    {
+    }
+    size_t size() const
+    {
+        return chunkCount;
+    }
+    shared_ptr<T> get(PositionI chunkPosition) const
+    {
+        shared_ptr<const Table> table = getTable();
+        const Page *page = table->find(getRegionPosition(chunkPosition));
+        if(page == nullptr)
+            return nullptr;
+        return loadSlot(page, chunkPosition);
+    }
+    /// gets the chunks neighboring chunkPosition in the order NX, PX, NY, PY, NZ, PZ;
+    /// neighbors in the same page are read without another page lookup
+    array<shared_ptr<T>, 6> getNeighbors(PositionI chunkPosition) const
+    {
+        const array<VectorI, 6> deltas =
+        {
+            VectorI(-ChunkSizeX, 0, 0),
+            VectorI(ChunkSizeX, 0, 0),
+            VectorI(0, -ChunkSizeY, 0),
+            VectorI(0, ChunkSizeY, 0),
+            VectorI(0, 0, -ChunkSizeZ),
+            VectorI(0, 0, ChunkSizeZ),
+        };
+        PositionI regionPosition = getRegionPosition(chunkPosition);
+        shared_ptr<const Table> table = getTable();
+        const Page *page = table->find(regionPosition);
+        array<shared_ptr<T>, 6> retval;
+        for(size_t i = 0; i < deltas.size(); i++)
+        {
+            PositionI neighborPosition = chunkPosition + deltas[i];
+            PositionI neighborRegionPosition = getRegionPosition(neighborPosition);
+            const Page *neighborPage = (neighborRegionPosition == regionPosition ? page : table->find(neighborRegionPosition));
+            if(neighborPage != nullptr)
+                retval[i] = loadSlot(neighborPage, neighborPosition);
+        }
+        return retval;
+    }
+    /// publishes value at chunkPosition and returns the previous value
+    shared_ptr<T> set(PositionI chunkPosition, shared_ptr<T> value)
+    {
+        lock_guard<mutex> lockIt(writeLock);
+        Page *page;
+        if(value == nullptr)
+        {
+            page = getTable()->find(getRegionPosition(chunkPosition));
+            if(page == nullptr)
+                return nullptr;
+        }
+        else
+            page = findOrMakePage(getRegionPosition(chunkPosition));
+        return exchangeSlot(page, chunkPosition, value);
+    }
+    /// removes the chunk at chunkPosition if it is still expectedValue
+    bool remove(PositionI chunkPosition, shared_ptr<T> expectedValue)
+    {
+        if(expectedValue == nullptr)
+            return false;
+        lock_guard<mutex> lockIt(writeLock);
+        Page *page = getTable()->find(getRegionPosition(chunkPosition));
+        if(page == nullptr || atomic_load(&page->slots[getSlotIndex(chunkPosition)]) != expectedValue)
+            return false;
+        exchangeSlot(page, chunkPosition, nullptr);
+        return true;
+    }
+    /// gets the chunk at chunkPosition, calling makeFn to make it if it doesn't exist
+    template <typename Fn>
+    shared_ptr<T> getOrMake(PositionI chunkPosition, Fn makeFn)
+    {
+        shared_ptr<T> retval = get(chunkPosition);
+        if(retval != nullptr)
+            return retval;
+        lock_guard<mutex> lockIt(writeLock);
+        Page *page = findOrMakePage(getRegionPosition(chunkPosition));
+        retval = atomic_load(&page->slots[getSlotIndex(chunkPosition)]);
+        if(retval != nullptr) // made while we waited for writeLock
+            return retval;
+        retval = makeFn();
+        if(retval == nullptr)
+        {
+            if(page->occupancy == 0)
+                freePage(page);
+            return nullptr;
+        }
+        exchangeSlot(page, chunkPosition, retval);
+        return retval;
+    }
+    /// calls fn for every chunk in the grid
+    template <typename Fn>
+    void forEach(Fn fn) const
+    {
+        shared_ptr<const Table> table = getTable();
+        for(const shared_ptr<Page> &page : table->pages)
+        {
+            for(const shared_ptr<T> &slot : page->slots)
+            {
+                shared_ptr<T> chunk = atomic_load(&slot);
+                if(chunk != nullptr)
+                    fn(chunk);
+            }
+        }
+    }
+};
+
+#endif // CHUNK_GRID_H_INCLUDED
@@ -0,0 +1,152 @@
+#ifndef PALETTE_ARRAY_H_INCLUDED
+#define PALETTE_ARRAY_H_INCLUDED
+
+#include <vector>
+#include <cstdint>
+#include <cassert>
+
+using namespace std;
+
+/// fixed-size array that stores each distinct value once in a palette and
+/// keeps per-element palette indices bit-packed; the index width grows
+/// (0, 1, 2, 4, 8, then 16 bits) as the palette grows.
+/// not thread-safe : BlockChunk shares it between threads as immutable snapshots
+template <typename T, size_t Size>
+class PaletteArray final
+{
+    static_assert(Size > 0, "Size must be positive");
+    static_assert(Size <= 0x10000, "Size is too big for 16-bit palette indices");
+public:
+    static constexpr size_t size()
+    {
+        return Size;
+    }
+private:
+    typedef uint32_t WordType;
+    static constexpr size_t wordBits = 32;
+    vector<T> palette;
+    vector<size_t> paletteUseCounts; // a palette entry with a use count of 0 is free
+    size_t bitsPerIndex = 0;
+    vector<WordType> indices; // empty when bitsPerIndex == 0
+    static size_t getBitsForPaletteSize(size_t paletteSize)
+    {
+        size_t bits = 0;
+        while(((size_t)1 << bits) < paletteSize)
+        {
+            bits = (bits == 0 ? 1 : bits * 2);
+        }
+        return bits;
+    }
+    size_t getIndex(size_t position) const
+    {
+        if(bitsPerIndex == 0)
+            return 0;
+        size_t bitPosition = position * bitsPerIndex;
+        WordType mask = (WordType)(((WordType)1 << bitsPerIndex) - 1);
+        return (indices[bitPosition / wordBits] >> (bitPosition % wordBits)) & mask;
+    }
+    void setIndex(size_t position, size_t index)
+    {
+        if(bitsPerIndex == 0)
+        {
+            assert(index == 0);
+            return;
+        }
+        size_t bitPosition = position * bitsPerIndex;
+        WordType mask = (WordType)(((WordType)1 << bitsPerIndex) - 1);
+        WordType &word = indices[bitPosition / wordBits];
+        word &= ~(WordType)(mask << (bitPosition % wordBits));
+        word |= (WordType)(((WordType)index & mask) << (bitPosition % wordBits));
+    }
+    void widen(size_t newBitsPerIndex)
+    {
+        assert(newBitsPerIndex > bitsPerIndex);
+        vector<WordType> newIndices;
+        newIndices.resize((Size * newBitsPerIndex + wordBits - 1) / wordBits, 0);
+        for(size_t position = 0; position < Size; position++)
+        {
+            size_t index = getIndex(position);
+            size_t bitPosition = position * newBitsPerIndex;
+            newIndices[bitPosition / wordBits] |= (WordType)((WordType)index << (bitPosition % wordBits));
+        }
+        indices = std::move(newIndices);
+        bitsPerIndex = newBitsPerIndex;
+    }
+    size_t findOrAddPaletteEntry(const T &value)
+    {
+        size_t freeEntry = palette.size();
+        for(size_t i = 0; i < palette.size(); i++)
+        {
+            if(paletteUseCounts[i] == 0)
+            {
+                if(freeEntry == palette.size())
+                    freeEntry = i;
+                continue;
+            }
+            if(palette[i] == value)
+                return i;
+        }
+        if(freeEntry < palette.size())
+        {
+            palette[freeEntry] = value;
+            return freeEntry;
+        }
+        size_t newBitsPerIndex = getBitsForPaletteSize(palette.size() + 1);
+        if(newBitsPerIndex > bitsPerIndex)
+            widen(newBitsPerIndex);
+        palette.push_back(value);
+        paletteUseCounts.push_back(0);
+        return palette.size() - 1;
+    }
+public:
+    explicit PaletteArray(const T &initialValue = T())
+        : palette{initialValue}, paletteUseCounts{Size}
+    {
+    }
+    const T &get(size_t position) const
+    {
+        assert(position < Size);
+        return palette[getIndex(position)];
+    }
+    bool set(size_t position, const T &value) // returns if the value changed
+    {
+        assert(position < Size);
+        size_t oldIndex = getIndex(position);
+        if(palette[oldIndex] == value)
+            return false;
+        if(--paletteUseCounts[oldIndex] == 0)
+            palette[oldIndex] = T(); // release the old value
+        size_t newIndex = findOrAddPaletteEntry(value);
+        paletteUseCounts[newIndex]++;
+        setIndex(position, newIndex);
+        return true;
+    }
+    void fill(const T &value)
+    {
+        palette.assign(1, value);
+        paletteUseCounts.assign(1, Size);
+        bitsPerIndex = 0;
+        indices.clear();
+        indices.shrink_to_fit();
+    }
+    size_t paletteSize() const
+    {
+        size_t retval = 0;
+        for(size_t useCount : paletteUseCounts)
+        {
+            if(useCount > 0)
+                retval++;
+        }
+        return retval;
+    }
+    size_t getBitsPerIndex() const
+    {
+        return bitsPerIndex;
+    }
+    size_t getMemoryUsage() const // not counting sizeof(PaletteArray)
+    {
+        return palette.capacity() * sizeof(T) + paletteUseCounts.capacity() * sizeof(size_t) + indices.capacity() * sizeof(WordType);
+    }
+};
+
+#endif // PALETTE_ARRAY_H_INCLUDED
@@ -0,0 +1,98 @@
+#ifndef WORKER_POOL_H_INCLUDED
+#define WORKER_POOL_H_INCLUDED
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <queue>
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+/// fixed set of threads that run posted tasks, either as soon as possible
+/// or at a given time. tasks that are due at the same time run in the order
+/// they were posted.
+class WorkerPool final
+{
+    WorkerPool(const WorkerPool &) = delete;
+    const WorkerPool &operator =(const WorkerPool &) = delete;
+public:
+    typedef chrono::steady_clock::time_point TimePoint;
+private:
+    struct Task final
+    {
+        TimePoint runTime;
+        uint64_t sequenceNumber;
+        function<void()> fn;
+        Task(TimePoint runTime, uint64_t sequenceNumber, function<void()> fn)
+            : runTime(runTime), sequenceNumber(sequenceNumber), fn(fn)
+        {
+        }
+        bool operator <(const Task &rt) const // reversed for priority_queue
+        {
+            if(runTime != rt.runTime)
+                return runTime > rt.runTime;
+            return sequenceNumber > rt.sequenceNumber;
+        }
+    };
+    mutex lock;
+    condition_variable_any cond;
+    priority_queue<Task> tasks;
+    uint64_t nextSequenceNumber = 0;
+    bool stopping = false;
+    vector<thread> threads;
+    void worker()
+    {
+        unique_lock<mutex> lockIt(lock);
+        while(!stopping)
+        {
+            if(tasks.empty())
+            {
+                cond.wait(lock);
+                continue;
+            }
+            if(tasks.top().runTime > chrono::steady_clock::now())
+            {
+                cond.wait_until(lock, tasks.top().runTime);
+                continue;
+            }
+            function<void()> fn = tasks.top().fn;
+            tasks.pop();
+            lockIt.unlock();
+            fn();
+            lockIt.lock();
+        }
+    }
+public:
+    explicit WorkerPool(size_t threadCount)
+    {
+        for(size_t i = 0; i < threadCount; i++)
+            threads.push_back(thread(&WorkerPool::worker, this));
+    }
+    /// stops the threads; tasks that haven't started are dropped
+    ~WorkerPool()
+    {
+        {
+            lock_guard<mutex> lockIt(lock);
+            stopping = true;
+            cond.notify_all();
+        }
+        for(thread &t : threads)
+            t.join();
+    }
+    void post(function<void()> fn)
+    {
+        post(fn, TimePoint::min());
+    }
+    void post(function<void()> fn, TimePoint runTime)
+    {
+        lock_guard<mutex> lockIt(lock);
+        tasks.push(Task(runTime, nextSequenceNumber++, fn));
+        cond.notify_one();
+    }
+};
+
+#endif // WORKER_POOL_H_INCLUDED
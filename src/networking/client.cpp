@@ -11,8 +11,13 @@
 #include <chrono>
 #include <cmath>
 #include <condition_variable>
+#include <random>
+#include <algorithm>
 #include "stream/network_event.h"
+#include "stream/network.h"
 #include "util/cached_variable.h"
+#include "networking/chunk_payload_cache.h"
+#include "networking/local_connection.h"
 
 using namespace std;
 
@@ -20,17 +25,46 @@ namespace
 {
 class Client
 {
+    const bool headless; // a load test bot; it has no graphics
     shared_ptr<RenderObjectWorld> world;
     flag running, starting;
     shared_ptr<stream::StreamRW> streamRW;
     VariableSet variableSet;
+    unordered_map<BlockTypeId, RenderObjectBlock> serverBlockTypes; // blocks by the server's block type id; only used by the reader
+    NetworkEventAssembler eventAssembler; // only used by the reader
+    struct DeferredBlockUpdate final
+    {
+        uint32_t bulkBarrier; // the update is dropped if its chunk isn't loaded once the bulk events before this are received
+        PositionI chunkPosition;
+        shared_ptr<RenderObjectChunk> chunk; // the whole chunk or nullptr if the update is blocks
+        vector<pair<PositionI, RenderObjectBlock>> blocks;
+    };
+    deque<DeferredBlockUpdate> deferredBlockUpdates; // block updates that got ahead of the chunks they change; only used by the reader
     CachedVariable<PositionF> viewPosition = PositionF(0.5, 0.5 + 64 + 10, 0.5, Dimension::Overworld);
     float viewPhi = 0, viewTheta = 0;
+    CachedVariable<VectorF> sentViewDirection = VectorF(0); // the view direction last sent to the server
     float deltaPhi = 0, deltaTheta = 0;
     atomic_bool positionChanged;
-    unordered_set<PositionI> neededChunks;
-    mutex neededChunksLock;
+    unordered_map<PositionI, chrono::steady_clock::time_point> neededChunks; // with when they were first needed
+    unordered_set<PositionI> sentChunkRequests;
+    vector<PositionI> cancelledChunkRequests; // sent requests for chunks that aren't needed any more
+    mutex neededChunksLock; // locks neededChunks, sentChunkRequests and cancelledChunkRequests
+    CachedVariable<float> subscribedRadius = 0.0f; // the radius the server pushes chunks in, 0 if it doesn't push chunks
     flag somethingToWrite;
+public:
+    struct BotStatistics
+    {
+        vector<float> chunkLatencies; // seconds from when each chunk was needed to when it was received
+        vector<float> keepaliveRoundTripTimes; // in seconds
+        uint64_t bytesReceived = 0; // in events
+        float serverAverageTickTime = 0, serverMaxTickTime = 0; // in seconds, from the last keepalive
+        bool gotServerTickTime = false;
+    };
+private:
+    BotStatistics botStatistics; // only kept by headless clients
+    mutex botStatisticsLock; // locks botStatistics and keepaliveSendTime
+    atomic_bool needKeepalive;
+    chrono::steady_clock::time_point keepaliveSendTime;
     PositionF getViewPosition() const
     {
         return viewPosition;
@@ -43,6 +77,14 @@ class Client
     {
         return viewTheta;
     }
+    VectorF getViewDirection() const
+    {
+        return Matrix::rotateX(getViewPhi()).concat(Matrix::rotateY(getViewTheta())).applyNoTranslate(VectorF(0, 0, -1));
+    }
+    static float getViewDirectionResendCos() // the view direction is sent again when it turns by more than acos of this
+    {
+        return cos(5 * M_PI / 180);
+    }
     void setViewTheta(float v)
     {
         viewTheta = v;
@@ -63,44 +105,310 @@ class Client
     {
         return 64;
     }
+    float getInterestRadius()
+    {
+        return getViewDistance();
+    }
+    static chrono::steady_clock::duration getPushedChunkWaitTime() // chunks the server pushes are requested if they aren't received this long after they're needed
+    {
+        return chrono::seconds(1);
+    }
+    static size_t maxChunkRequestsPerEvent()
+    {
+        return 1024;
+    }
+    ChunkRequestPriority getChunkRequestPriority(PositionI chunkPosition, PositionF viewPosition)
+    {
+        VectorF chunkCenter = (VectorI)chunkPosition + 0.5 * VectorF(RenderObjectChunk::BlockChunkType::chunkSizeX, RenderObjectChunk::BlockChunkType::chunkSizeY, RenderObjectChunk::BlockChunkType::chunkSizeZ);
+        float distance = abs(chunkCenter - (VectorF)viewPosition);
+        if(distance < 2 * RenderObjectChunk::BlockChunkType::chunkSizeX)
+            return ChunkRequestPriority::Urgent;
+        if(distance < 0.75f * getViewDistance())
+            return ChunkRequestPriority::Visible;
+        return ChunkRequestPriority::Prefetch;
+    }
+    static size_t getChunkMemoryBudget()
+    {
+        return (size_t)256 << 20;
+    }
+    static size_t getBotChunkMemoryBudget() // the chunk memory budget of headless clients, which run many to a process
+    {
+        return (size_t)32 << 20;
+    }
+    static chrono::steady_clock::duration getColdChunkAge()
+    {
+        return chrono::seconds(30);
+    }
+    static chrono::steady_clock::duration getBotTickInterval()
+    {
+        return chrono::milliseconds(100);
+    }
+    static chrono::steady_clock::duration getBotKeepaliveInterval() // how often headless clients measure the round trip time and get the server tick time
+    {
+        return chrono::seconds(1);
+    }
+    /// reads the descriptors of the block types the server didn't send before
+    void readNewBlockTypes(stream::Reader &reader)
+    {
+        uint16_t newBlockTypeCount = stream::read<uint16_t>(reader);
+        for(size_t i = 0; i < newBlockTypeCount; i++)
+        {
+            BlockTypeId typeId = stream::read_checked<uint16_t>(reader, [](uint16_t v){return v != RenderObjectBlockRegistry::nullId;});
+            serverBlockTypes[typeId] = RenderObjectBlock((shared_ptr<RenderObjectBlockDescriptor>)stream::read<RenderObjectBlockDescriptor>(reader, variableSet));
+        }
+    }
+    RenderObjectBlock getServerBlockType(BlockTypeId typeId)
+    {
+        if(typeId == RenderObjectBlockRegistry::nullId)
+            return RenderObjectBlock();
+        auto iter = serverBlockTypes.find(typeId);
+        if(iter == serverBlockTypes.end())
+            throw stream::InvalidDataValueException("block type wasn't sent");
+        return std::get<1>(*iter);
+    }
+    /// reads a chunk in a SendNewChunks event, see ChunkPayload
+    shared_ptr<RenderObjectChunk> readChunkPayload(stream::Reader &reader)
+    {
+        readNewBlockTypes(reader);
+        return ChunkPayload::read(reader, [this](BlockTypeId typeId)
+        {
+            return getServerBlockType(typeId);
+        });
+    }
+    /// marks the chunks as not needed any more; headless clients record how long they took to get
+    void receivedChunks(const vector<PositionI> &chunkPositions)
+    {
+        auto now = chrono::steady_clock::now();
+        vector<float> chunkLatencies;
+        {
+            lock_guard<mutex> lockIt(neededChunksLock);
+            for(PositionI chunkPosition : chunkPositions)
+            {
+                auto iter = neededChunks.find(chunkPosition);
+                if(iter == neededChunks.end()) // pushed before we needed it
+                    continue;
+                chunkLatencies.push_back(chrono::duration_cast<chrono::duration<float>>(now - std::get<1>(*iter)).count());
+                neededChunks.erase(iter);
+            }
+        }
+        if(!headless)
+            return;
+        lock_guard<mutex> lockIt(botStatisticsLock);
+        botStatistics.chunkLatencies.insert(botStatistics.chunkLatencies.end(), chunkLatencies.begin(), chunkLatencies.end());
+    }
+    /// reads the server's reply to our keepalive : its float average and maximum tick times in seconds
+    void readKeepalive(const NetworkEvent &event)
+    {
+        auto now = chrono::steady_clock::now();
+        shared_ptr<stream::Reader> pEventReader = event.getReader();
+        lock_guard<mutex> lockIt(botStatisticsLock);
+        botStatistics.keepaliveRoundTripTimes.push_back(chrono::duration_cast<chrono::duration<float>>(now - keepaliveSendTime).count());
+        if(!pEventReader->dataAvailable()) // older servers send an empty keepalive
+            return;
+        botStatistics.serverAverageTickTime = pEventReader->readFiniteF32();
+        botStatistics.serverMaxTickTime = pEventReader->readFiniteF32();
+        botStatistics.gotServerTickTime = true;
+    }
+    /// handles an event from the server; the event is only valid during the call
+    void handleEvent(const NetworkEvent &event)
+    {
+        if(headless)
+        {
+            lock_guard<mutex> lockIt(botStatisticsLock);
+            botStatistics.bytesReceived += NetworkEvent::headerSize + event.size();
+        }
+        switch(event.type)
+        {
+        case NetworkEventType::Keepalive:
+            if(headless)
+                readKeepalive(event);
+            break;
+        case NetworkEventType::SendNewChunk:
+        {
+            shared_ptr<RenderObjectChunk> chunk = stream::read<RenderObjectChunk>(*event.getReader(), variableSet);
+            if(!chunk)
+                break;
+            world->setChunk(chunk);
+            receivedChunks(vector<PositionI>{chunk->blockChunk.basePosition});
+            break;
+        }
+        case NetworkEventType::SubscribeChunks:
+            subscribedRadius = event.getReader()->readFiniteF32();
+            break;
+        case NetworkEventType::UnsubscribeChunks:
+        {
+            shared_ptr<stream::Reader> pEventReader = event.getReader();
+            stream::Reader &eventReader = *pEventReader;
+            vector<PositionI> unsubscribedChunks;
+            while(eventReader.readBool())
+            {
+                PositionI chunkPosition = stream::read<PositionI>(eventReader);
+                world->removeChunk(chunkPosition); // the server doesn't send updates for it any more
+                unsubscribedChunks.push_back(chunkPosition);
+            }
+            lock_guard<mutex> lockIt(neededChunksLock);
+            for(PositionI chunkPosition : unsubscribedChunks)
+            {
+                neededChunks.erase(chunkPosition);
+                sentChunkRequests.erase(chunkPosition);
+            }
+            break;
+        }
+        case NetworkEventType::SendBlockUpdate:
+        {
+            shared_ptr<stream::Reader> pEventReader = event.getReader();
+            stream::Reader &eventReader = *pEventReader;
+            PositionI blockPosition = stream::read<PositionI>(eventReader);
+            RenderObjectBlock block = stream::read<RenderObjectBlock>(eventReader, variableSet);
+            world->setBlockIfLoaded(blockPosition, block); // unloaded chunks get the update when they are sent
+            break;
+        }
+        case NetworkEventType::RequestChunk:
+        case NetworkEventType::RequestChunks:
+        case NetworkEventType::CancelChunkRequests:
+            break;
+        case NetworkEventType::SendPlayerProperties:
+            break;
+        case NetworkEventType::SendBlockUpdates:
+        {
+            typedef RenderObjectChunk::BlockChunkType BlockChunkType;
+            shared_ptr<stream::Reader> pEventReader = event.getReader();
+            stream::Reader &eventReader = *pEventReader;
+            vector<pair<PositionI, RenderObjectBlock>> blockUpdates;
+            while(eventReader.readBool())
+            {
+                readNewBlockTypes(eventReader);
+                if(eventReader.readBool()) // the whole chunk
+                {
+                    shared_ptr<RenderObjectChunk> chunk = ChunkPayload::read(eventReader, [this](BlockTypeId typeId)
+                    {
+                        return getServerBlockType(typeId);
+                    });
+                    if(world->getChunk(chunk->blockChunk.basePosition) != nullptr) // unloaded chunks get the blocks when they are sent
+                        world->setChunk(chunk);
+                    else if(eventAssembler.isAheadOfBulkEvents())
+                        deferredBlockUpdates.push_back(DeferredBlockUpdate{eventAssembler.getBulkBarrier(), chunk->blockChunk.basePosition, chunk, {}});
+                    continue;
+                }
+                PositionI chunkPosition = stream::read<PositionI>(eventReader);
+                if(chunkPosition != BlockChunkType::getChunkBasePosition(chunkPosition))
+                    throw stream::InvalidDataValueException("block update chunk position is not a chunk base position");
+                uint32_t updateCount = stream::read<uint32_t>(eventReader);
+                // the chunk may be in a bulk event that this got ahead of
+                bool defer = eventAssembler.isAheadOfBulkEvents() && world->getChunk(chunkPosition) == nullptr;
+                if(defer)
+                    deferredBlockUpdates.push_back(DeferredBlockUpdate{eventAssembler.getBulkBarrier(), chunkPosition, nullptr, {}});
+                vector<pair<PositionI, RenderObjectBlock>> &updates = (defer ? deferredBlockUpdates.back().blocks : blockUpdates);
+                for(uint32_t i = 0; i < updateCount; i++)
+                {
+                    uint16_t index = eventReader.readLimitedU16(0, (uint16_t)((size_t)BlockChunkType::chunkSizeX * BlockChunkType::chunkSizeY * BlockChunkType::chunkSizeZ - 1));
+                    RenderObjectBlock block = getServerBlockType(stream::read<uint16_t>(eventReader));
+                    updates.push_back(make_pair(chunkPosition + BlockChunkType::getArrayRelativePosition(index), block));
+                }
+            }
+            world->setBlocksIfLoaded(blockUpdates); // unloaded chunks get the updates when they are sent
+            break;
+        }
+        case NetworkEventType::SendNewChunks:
+        {
+            shared_ptr<stream::Reader> pEventReader = event.getReader();
+            stream::Reader &eventReader = *pEventReader;
+            vector<PositionI> chunkPositions;
+            while(eventReader.readBool())
+            {
+                shared_ptr<RenderObjectChunk> chunk = readChunkPayload(eventReader);
+                world->setChunk(chunk);
+                chunkPositions.push_back(chunk->blockChunk.basePosition);
+            }
+            receivedChunks(chunkPositions);
+            break;
+        }
+        case NetworkEventType::EventFragment:
+        case NetworkEventType::BulkBarrier:
+            break; // handled by eventAssembler
+        }
+    }
+    /// handles an event from a LocalConnection, which has the chunks of chunk events as snapshots
+    void handleLocalEvent(const LocalEvent &event)
+    {
+        switch(event.event.type)
+        {
+        case NetworkEventType::SendNewChunks:
+        {
+            vector<PositionI> chunkPositions;
+            for(const LocalChunk &chunk : event.chunks)
+            {
+                world->setChunk(chunk.makeChunk());
+                chunkPositions.push_back(chunk.basePosition);
+            }
+            receivedChunks(chunkPositions);
+            break;
+        }
+        case NetworkEventType::SendBlockUpdates:
+            for(const LocalChunk &chunk : event.chunks)
+            {
+                if(world->getChunk(chunk.basePosition) != nullptr) // unloaded chunks get the blocks when they are sent
+                    world->setChunk(chunk.makeChunk());
+            }
+            break;
+        default:
+            handleEvent(event.event);
+            break;
+        }
+    }
+    /// applies the deferred block updates to the chunks that are loaded now and drops the ones for chunks that aren't coming
+    void applyDeferredBlockUpdates()
+    {
+        vector<pair<PositionI, RenderObjectBlock>> blockUpdates;
+        for(auto i = deferredBlockUpdates.begin(); i != deferredBlockUpdates.end();)
+        {
+            if(world->getChunk(i->chunkPosition) != nullptr)
+            {
+                if(i->chunk != nullptr)
+                {
+                    world->setBlocksIfLoaded(blockUpdates); // keep the updates in order
+                    blockUpdates.clear();
+                    world->setChunk(i->chunk);
+                }
+                else
+                    blockUpdates.insert(blockUpdates.end(), i->blocks.begin(), i->blocks.end());
+                i = deferredBlockUpdates.erase(i);
+            }
+            else if(eventAssembler.isReceived(i->bulkBarrier)) // the server had evicted the chunk before sending it
+                i = deferredBlockUpdates.erase(i);
+            else
+                i++;
+        }
+        world->setBlocksIfLoaded(blockUpdates);
+    }
     void reader(shared_ptr<stream::Reader> preader)
     {
         try
         {
-            world = stream::read<RenderObjectWorld>(*preader, variableSet);
+            shared_ptr<LocalEventReader> localReader = dynamic_pointer_cast<LocalEventReader>(preader);
+            if(localReader != nullptr)
+                world = localReader->receiveWorld();
+            else
+                world = stream::read<RenderObjectWorld>(*preader, variableSet);
+            world->setChunkMemoryBudget(headless ? getBotChunkMemoryBudget() : getChunkMemoryBudget());
+            world->setColdChunkAge(getColdChunkAge());
             starting = false;
-            NetworkEvent event;
             while(running)
             {
-                event = stream::read<NetworkEvent>(*preader);
-                switch(event.type)
-                {
-                case NetworkEventType::Keepalive:
-                    break;
-                case NetworkEventType::SendNewChunk:
+                if(localReader != nullptr)
                 {
-                    shared_ptr<RenderObjectChunk> chunk = stream::read<RenderObjectChunk>(*event.getReader(), variableSet);
-                    if(!chunk)
-                        break;
-                    world->setChunk(chunk);
-                    lock_guard<mutex> lockIt(neededChunksLock);
-                    neededChunks.erase(chunk->blockChunk.basePosition);
-                    break;
+                    handleLocalEvent(localReader->receive());
+                    continue;
                 }
-                case NetworkEventType::SendBlockUpdate:
+                NetworkEvent::readInPlace(*preader, [this](NetworkEvent &receivedEvent)
                 {
-                    shared_ptr<stream::Reader> pEventReader = event.getReader();
-                    stream::Reader &eventReader = *pEventReader;
-                    PositionI blockPosition = stream::read<PositionI>(eventReader);
-                    RenderObjectBlock block = stream::read<RenderObjectBlock>(eventReader, variableSet);
-                    world->setBlock(blockPosition, block);
-                    break;
-                }
-                case NetworkEventType::RequestChunk:
-                    break;
-                case NetworkEventType::SendPlayerProperties:
-                    break;
-                }
+                    NetworkEvent event;
+                    if(!eventAssembler.add(receivedEvent, event))
+                        return;
+                    handleEvent(event);
+                    if(NetworkEvent::getChannel(event.type) == NetworkEventChannel::Bulk && !deferredBlockUpdates.empty())
+                        applyDeferredBlockUpdates();
+                });
             }
         }
         catch(stream::IOException &e)
@@ -113,49 +421,97 @@ class Client
         somethingToWrite.set();
         cout << "client reader stopped.\x1b[K" << endl;
     }
+    /// writes event, or sends it if writer is a LocalEventWriter
+    static void writeEvent(stream::Writer &writer, NetworkEvent event)
+    {
+        LocalEventWriter *localWriter = dynamic_cast<LocalEventWriter *>(&writer);
+        if(localWriter != nullptr)
+            localWriter->send(LocalEvent(std::move(event)));
+        else
+            stream::write<NetworkEvent>(writer, event);
+    }
     void writer(shared_ptr<stream::Writer> pwriter)
     {
-        unordered_set<PositionI> sentChunkRequests;
         try
         {
             while(running)
             {
-                bool didAnything = false;
+                bool didAnything = false, isUrgent = false;
+                if(needKeepalive.exchange(false))
+                {
+                    {
+                        lock_guard<mutex> lockIt(botStatisticsLock);
+                        keepaliveSendTime = chrono::steady_clock::now();
+                    }
+                    writeEvent(*pwriter, NetworkEvent(NetworkEventType::Keepalive));
+                    didAnything = true;
+                    isUrgent = true;
+                }
                 {
-                    PositionI chunkPosition;
-                    bool gotChunk = false;
+                    vector<PositionI> newChunkRequests, cancelledChunks;
                     {
+                        PositionF viewPosition = getViewPosition();
+                        float pushRadius = subscribedRadius;
+                        auto pushedChunkRequestTime = chrono::steady_clock::now() - getPushedChunkWaitTime();
                         lock_guard<mutex> lockIt(neededChunksLock);
-                        for(PositionI cPos : neededChunks)
+                        cancelledChunks.swap(cancelledChunkRequests);
+                        for(const pair<const PositionI, chrono::steady_clock::time_point> &neededChunk : neededChunks)
                         {
-                            if(std::get<1>(sentChunkRequests.insert(cPos)))
-                            {
-                                gotChunk = true;
-                                chunkPosition = cPos;
+                            if(newChunkRequests.size() >= maxChunkRequestsPerEvent())
                                 break;
-                            }
+                            PositionI cPos = std::get<0>(neededChunk);
+                            if(pushRadius > 0 && std::get<1>(neededChunk) > pushedChunkRequestTime && cPos.d == viewPosition.d && absSquared((VectorF)cPos - (VectorF)viewPosition) <= pushRadius * pushRadius)
+                                continue; // the server pushes it; it's only requested if it takes too long
+                            if(std::get<1>(sentChunkRequests.insert(cPos)))
+                                newChunkRequests.push_back(cPos);
                         }
                     }
-                    if(gotChunk)
+                    if(!cancelledChunks.empty())
                     {
                         didAnything = true;
                         stream::MemoryWriter eventWriter;
-                        stream::write<PositionI>(eventWriter, chunkPosition);
-                        stream::write<NetworkEvent>(*pwriter, NetworkEvent(NetworkEventType::RequestChunk, std::move(eventWriter)));
-                        pwriter->flush();
+                        for(PositionI chunkPosition : cancelledChunks)
+                        {
+                            eventWriter.writeBool(true);
+                            stream::write<PositionI>(eventWriter, chunkPosition);
+                        }
+                        eventWriter.writeBool(false);
+                        writeEvent(*pwriter, NetworkEvent(NetworkEventType::CancelChunkRequests, std::move(eventWriter)));
+                    }
+                    if(!newChunkRequests.empty())
+                    {
+                        didAnything = true;
+                        stream::MemoryWriter eventWriter;
+                        PositionF viewPosition = getViewPosition();
+                        for(PositionI chunkPosition : newChunkRequests)
+                        {
+                            eventWriter.writeBool(true);
+                            stream::write<PositionI>(eventWriter, chunkPosition);
+                            stream::write<ChunkRequestPriority>(eventWriter, getChunkRequestPriority(chunkPosition, viewPosition));
+                        }
+                        eventWriter.writeBool(false);
+                        writeEvent(*pwriter, NetworkEvent(NetworkEventType::RequestChunks, std::move(eventWriter)));
                     }
                 }
                 {
                     if(positionChanged.exchange(false))
                     {
                         stream::MemoryWriter eventWriter;
+                        VectorF viewDirection = getViewDirection();
+                        sentViewDirection = viewDirection;
                         stream::write<PositionF>(eventWriter, getViewPosition());
-                        stream::write<NetworkEvent>(*pwriter, NetworkEvent(NetworkEventType::SendPlayerProperties, std::move(eventWriter)));
-                        pwriter->flush();
+                        stream::write<VectorF>(eventWriter, viewDirection);
+                        eventWriter.writeF32(getInterestRadius());
+                        writeEvent(*pwriter, NetworkEvent(NetworkEventType::SendPlayerProperties, std::move(eventWriter)));
                         didAnything = true;
+                        isUrgent = true; // the server pushes chunks for the new position
                     }
                 }
-                if(!didAnything)
+                if(isUrgent)
+                    pwriter->flushUrgent();
+                else if(didAnything)
+                    pwriter->flush();
+                else
                 {
                     somethingToWrite.waitThenReset(true);
                 }
@@ -169,14 +525,96 @@ class Client
         running = false;
         cout << "client writer stopped.\x1b[K" << endl;
     }
+    /// forgets the chunks we need or requested that are now out of view;
+    /// the server drops requests that are far enough away, so they are requested again when they come back in view
+    void forgetDistantChunkRequests()
+    {
+        PositionF viewPosition = getViewPosition();
+        float maxDistance = getViewDistance() + RenderObjectChunk::BlockChunkType::chunkSizeX;
+        auto isDistant = [&](PositionI chunkPosition)
+        {
+            return chunkPosition.d != viewPosition.d || absSquared((VectorF)chunkPosition - (VectorF)viewPosition) > maxDistance * maxDistance;
+        };
+        lock_guard<mutex> lockIt(neededChunksLock);
+        for(auto i = neededChunks.begin(); i != neededChunks.end();)
+        {
+            if(isDistant(std::get<0>(*i)))
+                i = neededChunks.erase(i);
+            else
+                i++;
+        }
+        for(auto i = sentChunkRequests.begin(); i != sentChunkRequests.end();)
+        {
+            if(isDistant(*i) && world->getChunk(*i) == nullptr) // then it isn't received yet
+            {
+                cancelledChunkRequests.push_back(*i);
+                i = sentChunkRequests.erase(i);
+            }
+            else
+                i++;
+        }
+        if(!cancelledChunkRequests.empty())
+            somethingToWrite.set();
+    }
+    void evictChunks()
+    {
+        world->evictChunks(vector<PositionI>{(PositionI)getViewPosition()}, getViewDistance() + RenderObjectChunk::BlockChunkType::chunkSizeX, [this](shared_ptr<RenderObjectChunk> chunk)
+        {
+            lock_guard<mutex> lockIt(neededChunksLock);
+            sentChunkRequests.erase(chunk->blockChunk.basePosition); // so we request it again when we need it
+            if(subscribedRadius.read() > 0) // so the server pushes it again when it comes back into the interest radius
+                cancelledChunkRequests.push_back(chunk->blockChunk.basePosition);
+        });
+        forgetDistantChunkRequests();
+        world->compactColdChunks();
+    }
+    /// finds the chunks in view that aren't loaded, like RenderObjectWorld::draw does, for headless clients
+    void findNeededChunks()
+    {
+        typedef RenderObjectChunk::BlockChunkType BlockChunkType;
+        PositionF viewPosition = getViewPosition();
+        int32_t viewDistance = getViewDistance();
+        PositionI minPosition = BlockChunkType::getChunkBasePosition((PositionI)viewPosition - VectorI(viewDistance));
+        PositionI maxPosition = BlockChunkType::getChunkBasePosition((PositionI)viewPosition + VectorI(viewDistance));
+        vector<PositionI> missingChunks;
+        for(PositionI chunkPosition = minPosition; chunkPosition.x <= maxPosition.x; chunkPosition.x += BlockChunkType::chunkSizeX)
+        {
+            for(chunkPosition.y = minPosition.y; chunkPosition.y <= maxPosition.y; chunkPosition.y += BlockChunkType::chunkSizeY)
+            {
+                for(chunkPosition.z = minPosition.z; chunkPosition.z <= maxPosition.z; chunkPosition.z += BlockChunkType::chunkSizeZ)
+                {
+                    VectorF chunkCenter = (VectorI)chunkPosition + 0.5 * VectorF(BlockChunkType::chunkSizeX, BlockChunkType::chunkSizeY, BlockChunkType::chunkSizeZ);
+                    if(absSquared(chunkCenter - (VectorF)viewPosition) > viewDistance * viewDistance)
+                        continue;
+                    if(world->getChunk(chunkPosition) == nullptr)
+                        missingChunks.push_back(chunkPosition);
+                }
+            }
+        }
+        if(missingChunks.empty())
+            return;
+        auto now = chrono::steady_clock::now();
+        {
+            lock_guard<mutex> lockIt(neededChunksLock);
+            for(PositionI chunkPosition : missingChunks)
+                neededChunks.insert(make_pair(chunkPosition, now));
+        }
+        somethingToWrite.set();
+    }
     void meshGenerator()
     {
         starting.wait(false);
+        auto lastEvictTime = chrono::steady_clock::now();
         while(running)
         {
             assert(world);
             if(!world->generateMeshes((PositionI)getViewPosition()));
                 this_thread::sleep_for(chrono::milliseconds(5));
+            if(chrono::steady_clock::now() - lastEvictTime >= chrono::seconds(1))
+            {
+                lastEvictTime = chrono::steady_clock::now();
+                evictChunks();
+            }
         }
     }
     bool isWDown = false;
@@ -350,9 +788,63 @@ class Client
     }
 
 public:
-    Client(shared_ptr<stream::StreamRW> streamRW)
-        : streamRW(streamRW), positionChanged(true)
+    Client(shared_ptr<stream::StreamRW> streamRW, bool headless = false)
+        : headless(headless), streamRW(streamRW), positionChanged(true), needKeepalive(false)
+    {
+    }
+    /** runs the client without graphics as a load test bot for duration after it gets the world,
+     * flying along path, which gives the position for the seconds since the start.
+     * returns false if the connection failed.
+     */
+    bool runBot(function<PositionF(double time)> path, chrono::steady_clock::duration duration)
+    {
+        assert(headless);
+        running = true;
+        starting = true;
+        thread(&Client::reader, this, streamRW->preader()).detach();
+        thread(&Client::writer, this, streamRW->pwriter()).detach();
+        streamRW = nullptr;
+        starting.wait(false);
+        auto startTime = chrono::steady_clock::now();
+        auto lastKeepaliveTime = startTime - getBotKeepaliveInterval(), lastEvictTime = startTime;
+        PositionF lastPosition = path(0);
+        while(running && chrono::steady_clock::now() - startTime < duration)
+        {
+            auto now = chrono::steady_clock::now();
+            PositionF position = path(chrono::duration_cast<chrono::duration<double>>(now - startTime).count());
+            VectorF deltaPosition = (VectorF)position - (VectorF)lastPosition;
+            lastPosition = position;
+            if(absSquared(deltaPosition) > 0)
+                setViewTheta(atan2(-deltaPosition.x, -deltaPosition.z));
+            setViewPosition(position);
+            if(dot(getViewDirection(), sentViewDirection.read()) < getViewDirectionResendCos())
+            {
+                positionChanged = true;
+                somethingToWrite.set();
+            }
+            findNeededChunks();
+            if(now - lastKeepaliveTime >= getBotKeepaliveInterval())
+            {
+                lastKeepaliveTime = now;
+                needKeepalive = true;
+                somethingToWrite.set();
+            }
+            if(now - lastEvictTime >= chrono::seconds(1))
+            {
+                lastEvictTime = now;
+                evictChunks();
+            }
+            this_thread::sleep_for(getBotTickInterval());
+        }
+        bool retval = running;
+        running = false;
+        somethingToWrite.set();
+        return retval;
+    }
+    BotStatistics getBotStatistics()
     {
+        lock_guard<mutex> lockIt(botStatisticsLock);
+        return botStatistics;
     }
     void run()
     {
@@ -380,7 +872,7 @@ public:
                 }, false, [&](PositionI chunkPos)
                 {
                     lock_guard<mutex> lockIt(neededChunksLock);
-                    neededChunks.insert(chunkPos);
+                    neededChunks.insert(make_pair(chunkPos, chrono::steady_clock::now()));
                     anyNeededChunks = true;
                 });
             }
@@ -396,6 +888,11 @@ public:
             deltaTheta *= 0.5;
             setViewPhi(limit<float>(getViewPhi() + deltaPhi * 0.5, -M_PI / 2, M_PI / 2));
             deltaPhi *= 0.5;
+            if(dot(getViewDirection(), sentViewDirection.read()) < getViewDirectionResendCos())
+            {
+                positionChanged = true;
+                somethingToWrite.set();
+            }
             if(!isPaused)
             {
                 VectorF deltaPosition = VectorF(0);
@@ -425,9 +922,146 @@ public:
         endGraphics();
     }
 };
+
+PositionF getBotStartPosition()
+{
+    return PositionF(0.5, 0.5 + 64 + 10, 0.5, Dimension::Overworld);
+}
+
+/// flies between random points within range blocks of start horizontally
+class RandomBotPath final
+{
+    minstd_rand randomEngine;
+    PositionF start;
+    float speed, range;
+    PositionF from, to;
+    double fromTime = 0, toTime = 0;
+    void nextPoint()
+    {
+        uniform_real_distribution<float> distribution(-range, range);
+        from = to;
+        fromTime = toTime;
+        to = start + VectorF(distribution(randomEngine), 0, distribution(randomEngine));
+        toTime = fromTime + abs((VectorF)to - (VectorF)from) / speed;
+    }
+public:
+    RandomBotPath(unsigned seed, PositionF start, float speed, float range)
+        : randomEngine(seed), start(start), speed(speed), range(range), from(start), to(start)
+    {
+    }
+    PositionF operator ()(double time)
+    {
+        while(time >= toTime)
+            nextPoint();
+        float t = (float)((time - fromTime) / (toTime - fromTime));
+        return from + t * ((VectorF)to - (VectorF)from);
+    }
+};
+
+function<PositionF(double time)> makeBotPath(const LoadTestOptions &options, size_t botIndex)
+{
+    constexpr float range = 256;
+    PositionF start = getBotStartPosition();
+    float speed = options.speed;
+    switch(options.path)
+    {
+    case LoadTestPath::Random:
+        return RandomBotPath((unsigned)botIndex + 1, start, speed, range);
+    case LoadTestPath::Circle:
+    {
+        float startAngle = (float)(2 * M_PI * botIndex / options.botCount);
+        float radius = range / 2;
+        return [start, speed, startAngle, radius](double time)
+        {
+            float angle = startAngle + (float)(time * speed / radius);
+            return start + VectorF(radius * cos(angle), 0, radius * sin(angle));
+        };
+    }
+    }
+    assert(false);
+    return nullptr;
+}
+
+/// gets the value that fraction of values are less than or equal to; sorts values
+float getPercentile(vector<float> &values, double fraction)
+{
+    if(values.empty())
+        return 0;
+    sort(values.begin(), values.end());
+    size_t index = (size_t)ceil(fraction * values.size());
+    return values[index > 0 ? index - 1 : 0];
+}
 }
 
 void runClient(shared_ptr<stream::StreamRW> streamRW)
 {
     (new Client(streamRW))->run();
 }
+
+size_t runLoadTest(LoadTestOptions options, function<shared_ptr<stream::StreamRW>()> connect)
+{
+    size_t connectionFailures = 0;
+    vector<Client *> bots; // not deleted because their reader threads can still be running after the test
+    for(size_t i = 0; i < options.botCount; i++)
+    {
+        try
+        {
+            bots.push_back(new Client(connect(), true));
+        }
+        catch(stream::IOException &e)
+        {
+            cerr << "load test bot connection failed : " << e.what() << endl;
+            connectionFailures++;
+        }
+    }
+    cout << "Load Test : running " << bots.size() << " bots for " << options.duration << "s" << endl;
+    vector<int> botSucceeded(bots.size(), 0);
+    vector<thread> botThreads;
+    auto duration = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(options.duration));
+    for(size_t i = 0; i < bots.size(); i++)
+    {
+        botThreads.push_back(thread([&options, &bots, &botSucceeded, duration, i]()
+        {
+            botSucceeded[i] = bots[i]->runBot(makeBotPath(options, i), duration) ? 1 : 0;
+        }));
+    }
+    for(thread &t : botThreads)
+        t.join();
+    vector<float> chunkLatencies, keepaliveRoundTripTimes;
+    uint64_t bytesReceived = 0;
+    float serverAverageTickTime = 0, serverMaxTickTime = 0;
+    size_t serverTickTimeCount = 0;
+    for(size_t i = 0; i < bots.size(); i++)
+    {
+        if(!botSucceeded[i])
+            connectionFailures++;
+        Client::BotStatistics statistics = bots[i]->getBotStatistics();
+        chunkLatencies.insert(chunkLatencies.end(), statistics.chunkLatencies.begin(), statistics.chunkLatencies.end());
+        keepaliveRoundTripTimes.insert(keepaliveRoundTripTimes.end(), statistics.keepaliveRoundTripTimes.begin(), statistics.keepaliveRoundTripTimes.end());
+        bytesReceived += statistics.bytesReceived;
+        if(statistics.gotServerTickTime)
+        {
+            serverAverageTickTime += statistics.serverAverageTickTime;
+            serverMaxTickTime = max(serverMaxTickTime, statistics.serverMaxTickTime);
+            serverTickTimeCount++;
+        }
+    }
+    if(serverTickTimeCount > 0)
+        serverAverageTickTime /= serverTickTimeCount;
+    size_t chunkCount = chunkLatencies.size();
+    cout << "Load Test Results : " << options.botCount << " bots, " << connectionFailures << " connection failures\n";
+    cout << "Chunk Latency : p50 " << 1000 * getPercentile(chunkLatencies, 0.5) << "ms p99 " << 1000 * getPercentile(chunkLatencies, 0.99) << "ms (" << chunkCount << " chunks)\n";
+    cout << "Keepalive Round Trip : p50 " << 1000 * getPercentile(keepaliveRoundTripTimes, 0.5) << "ms p99 " << 1000 * getPercentile(keepaliveRoundTripTimes, 0.99) << "ms\n";
+    stream::NetworkWriterStatistics writerStatistics = stream::getNetworkWriterStatistics();
+    if(writerStatistics.sendCalls > 0)
+    {
+        cout << "Sent : " << writerStatistics.sentBytes / 1024 << " KiB in " << writerStatistics.sendCalls << " sends (" << writerStatistics.bytesPerSend() << " bytes/send) ";
+        cout << writerStatistics.coalescedFlushes << " coalesced flushes " << writerStatistics.savedSystemCalls() << " system calls saved\n";
+    }
+    cout << "Received : " << bytesReceived / 1024 << " KiB (" << (options.duration > 0 ? bytesReceived / options.duration / 1024 : 0) << " KiB/s)\n";
+    if(serverTickTimeCount > 0)
+        cout << "Server Tick Time : average " << 1000 * serverAverageTickTime << "ms max " << 1000 * serverMaxTickTime << "ms" << endl;
+    else
+        cout << "Server Tick Time : not reported" << endl;
+    return connectionFailures;
+}
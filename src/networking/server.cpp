@@ -5,6 +5,12 @@
 #include "util/flag.h"
 #include "texture/texture_atlas.h"
 #include "render/generate.h"
+#include "render/chunk_storage.h"
+#include "networking/chunk_payload_cache.h"
+#include "networking/local_connection.h"
+#include "stream/network.h"
+#include "stream/network_event_loop.h"
+#include "util/worker_pool.h"
 #include <thread>
 #include <cmath>
 #include <mutex>
@@ -12,6 +18,7 @@
 #include <condition_variable>
 #include <chrono>
 #include <random>
+#include <sstream>
 #include "util/unlock_guard.h"
 
 using namespace std;
@@ -113,12 +120,49 @@ shared_ptr<RenderObjectBlockDescriptor> getStone()
     return retval;
 }
 
+struct SendQueueStatistics
+{
+    size_t queuedChunks = 0; // requested chunks that aren't sent yet
+    size_t queuedBlockUpdates = 0;
+    double oldestChunkRequestAge = 0; // in seconds
+    double averageChunkRequestAge = 0; // in seconds
+    double oldestBlockUpdateAge = 0; // in seconds
+    uint64_t droppedStaleChunks = 0;
+    uint64_t sentBytes = 0;
+    uint64_t deltaChunkUpdates = 0; // changed chunks sent as deltas
+    uint64_t fullChunkUpdates = 0; // changed chunks sent whole because that was smaller than the delta
+    uint64_t cancelledChunks = 0;
+    uint64_t pushedChunks = 0; // chunks queued because they came into a connection's interest radius
+    uint64_t unsubscribedChunks = 0; // sent chunks dropped because they left a connection's interest radius
+    /// combines the statistics of two connections
+    void add(const SendQueueStatistics &rt)
+    {
+        if(queuedChunks + rt.queuedChunks > 0)
+            averageChunkRequestAge = (averageChunkRequestAge * queuedChunks + rt.averageChunkRequestAge * rt.queuedChunks) / (queuedChunks + rt.queuedChunks);
+        queuedChunks += rt.queuedChunks;
+        queuedBlockUpdates += rt.queuedBlockUpdates;
+        oldestChunkRequestAge = max(oldestChunkRequestAge, rt.oldestChunkRequestAge);
+        oldestBlockUpdateAge = max(oldestBlockUpdateAge, rt.oldestBlockUpdateAge);
+        droppedStaleChunks += rt.droppedStaleChunks;
+        sentBytes += rt.sentBytes;
+        deltaChunkUpdates += rt.deltaChunkUpdates;
+        fullChunkUpdates += rt.fullChunkUpdates;
+        cancelledChunks += rt.cancelledChunks;
+        pushedChunks += rt.pushedChunks;
+        unsubscribedChunks += rt.unsubscribedChunks;
+    }
+};
+
 class Server
 {
     shared_ptr<stream::StreamServer> streamServer;
     shared_ptr<RenderObjectWorld> world;
+    shared_ptr<ChunkStorage> storage;
+    ChunkPayloadCache chunkPayloadCache;
+    ChunkSnapshotHistory chunkHistory; // versions of edited chunks that clients may have, to make deltas against
     atomic_uint connectionCount;
     flag anyConnections, running;
+    CachedVariable<float> averageTickTime = 0.0f, maxTickTime = 0.0f; // in seconds, over the last second; sent in keepalives
     static PositionF initialPositionF()
     {
         return PositionF(0.5, 64 + 10 + 0.5, 0.5, Dimension::Overworld);
@@ -131,29 +175,150 @@ class Server
     {
         return 16;
     }
+    static size_t chunkMemoryBudget() // 0 for unlimited
+    {
+        return (size_t)512 << 20;
+    }
+    static chrono::steady_clock::duration coldChunkAge()
+    {
+        return chrono::seconds(30);
+    }
+    static wstring worldDirectory()
+    {
+        return L"world";
+    }
+    static size_t chunkBatchByteBudget() // a batch is sent once its chunks take this many bytes
+    {
+        return (size_t)256 << 10;
+    }
+    static chrono::steady_clock::duration chunkBatchTimeBudget() // a batch is sent once it took this long to make
+    {
+        return chrono::milliseconds(10);
+    }
+    static size_t deltaFullChunkSizeThreshold() // chunk deltas bigger than this are compared with the size of the whole chunk
+    {
+        return 256;
+    }
+    static size_t blockUpdateBatchSize() // the most block updates sent in one batch
+    {
+        return 4096;
+    }
+    static chrono::steady_clock::duration blockUpdateMaxDelay() // the longest time block updates wait for more to fill a batch
+    {
+        return chrono::milliseconds(2);
+    }
+    static size_t ioThreadCount() // threads that run the sockets when serving a NetworkServer
+    {
+        return 2;
+    }
+    static size_t workerThreadCount() // threads that handle the events of and write to connections run by the event loop
+    {
+        return 4;
+    }
+    static size_t maxPendingOutputBytes() // no more chunk fragments are written to a connection while it has this much unsent; urgent events wait behind at most this much
+    {
+        return (size_t)1 << 17;
+    }
+    static size_t maxPendingEvents() // an event loop connection stops reading while it has this many events waiting to be handled
+    {
+        return 256;
+    }
+    static size_t maxPendingEventBytes() // or this many bytes of events waiting to be handled
+    {
+        return (size_t)1 << 20;
+    }
+    static double sendBytesPerSecond() // the bandwidth budget of each connection
+    {
+        return 8 << 20;
+    }
+    static double sendBurstBytes() // the most bytes a connection can save up from its bandwidth budget
+    {
+        return 512 << 10;
+    }
+    static float staleChunkDistance() // chunks the client requested that are farther than this from the player are dropped
+    {
+        return 128;
+    }
+    static float behindChunkPriorityFactor() // how much farther away chunks behind the player seem when picking chunks to send
+    {
+        return 3;
+    }
+    static float maxInterestRadius() // the largest interest radius a client can subscribe to
+    {
+        return 256;
+    }
+    static float unsubscribeMargin() // sent chunks are unsubscribed when they are this much farther than the interest radius
+    {
+        return 2 * RenderObjectChunk::BlockChunkType::chunkSizeX;
+    }
     struct Connection
     {
         atomic_uint &connectionCount;
         flag &anyConnections;
         VariableSet variableSet;
         CachedVariable<PositionF> viewPosition;
+        CachedVariable<VectorF> viewDirection; // unit vector, (0, 0, 0) if the client didn't send it
         atomic_bool hasViewPosition;
         atomic_bool done;
         atomic_bool needKeepalive;
-        unordered_set<PositionI> requestedChunks;
+        struct ChunkRequest final
+        {
+            chrono::steady_clock::time_point requestTime;
+            ChunkRequestPriority priority;
+            bool pushed; // queued by updateInterest instead of requested by the client
+            ChunkRequest(chrono::steady_clock::time_point requestTime, ChunkRequestPriority priority, bool pushed = false)
+                : requestTime(requestTime), priority(priority), pushed(pushed)
+            {
+            }
+        };
+        unordered_map<PositionI, ChunkRequest> requestedChunks;
         mutex requestedChunksLock;
         mutex eventWaitMutex;
         condition_variable_any eventWaitCond;
-        unordered_set<PositionI> sentChunks;
+        unordered_map<PositionI, uint64_t> sentChunks; // the version of each chunk the client has
+        unordered_set<BlockTypeId> sentBlockTypes; // the block types the client has the descriptors of; locked by requestedChunksLock
+        // interest management state, locked by requestedChunksLock
+        float interestRadius = 0; // 0 until the client subscribes by sending its interest radius
+        PositionI interestCenter; // the base position of the chunk the player was in when the interest was last updated
+        bool needSubscribe = false; // the SubscribeChunks event isn't sent yet
+        vector<PositionI> pendingUnsubscribes;
         mutex blockUpdatesMutex;
         unordered_set<PositionI> blockUpdatesSet;
         deque<PositionI> blockUpdatesQueue;
+        chrono::steady_clock::time_point blockUpdatesQueuedTime; // when the oldest update in blockUpdatesQueue was queued
+        // used when the connection is run by the event loop instead of a reader and a writer thread
+        shared_ptr<stream::NetworkEventLoopConnection> socket;
+        shared_ptr<stream::Writer> socketWriter;
+        function<void()> onNotify;
+        atomic_bool started; // socket and onNotify are set
+        mutex serviceLock;
+        deque<NetworkEvent> pendingEvents;
+        size_t pendingEventBytes = 0;
+        bool readingPaused = false; // socket reading is paused until pendingEvents is handled
+        bool needService = false;
+        bool serviceScheduled = false;
+        bool sentWorld = false;
+        // send scheduler state, only used by whatever writes to the connection
+        double sendBudget; // bytes that can be sent now; goes negative when urgent events overdraw it
+        NetworkEventFragmenter eventFragmenter; // chunks are sent in fragments so urgent events can be sent between them
+        chrono::steady_clock::time_point sendBudgetTime;
+        atomic_uint_fast64_t droppedStaleChunks, sentBytes;
+        atomic_uint_fast64_t deltaChunkUpdates, fullChunkUpdates; // changed chunks sent as deltas and as whole chunks
+        atomic_uint_fast64_t cancelledChunks; // chunk requests the client cancelled before they were sent
+        atomic_uint_fast64_t pushedChunks, unsubscribedChunks;
         Connection(atomic_uint &connectionCount, flag &anyConnections)
-            : connectionCount(connectionCount), anyConnections(anyConnections), done(false)
+            : connectionCount(connectionCount), anyConnections(anyConnections), viewDirection(VectorF(0)), done(false), needKeepalive(false), started(false), sendBudget(sendBurstBytes()), sendBudgetTime(chrono::steady_clock::now()), droppedStaleChunks(0), sentBytes(0), deltaChunkUpdates(0), fullChunkUpdates(0), cancelledChunks(0), pushedChunks(0), unsubscribedChunks(0)
         {
             connectionCount++;
             anyConnections = true;
         }
+        /// wakes up whatever writes to this connection
+        void notify()
+        {
+            eventWaitCond.notify_all();
+            if(started && onNotify)
+                onNotify();
+        }
         ~Connection()
         {
             if(--connectionCount <= 0)
@@ -162,46 +327,108 @@ class Server
     };
     list<weak_ptr<Connection>> connectionsList;
     mutex connectionsListLock;
+    void handleEvent(Connection &connection, NetworkEvent &event)
+    {
+        switch(event.type)
+        {
+        case NetworkEventType::Keepalive:
+            connection.needKeepalive = true;
+            connection.notify();
+            break;
+        case NetworkEventType::SendNewChunk:
+            break;
+        case NetworkEventType::SendBlockUpdate:
+            break;
+        case NetworkEventType::RequestChunk:
+        {
+            shared_ptr<stream::Reader> pEventReader = event.getReader();
+            PositionI chunkPosition = stream::read<PositionI>(*pEventReader);
+            if(chunkPosition != RenderObjectChunk::BlockChunkType::getChunkBasePosition(chunkPosition))
+                break;
+            lock_guard<mutex> lockIt(connection.requestedChunksLock);
+            addChunkRequest(connection, chunkPosition, ChunkRequestPriority::Visible);
+            connection.notify();
+            break;
+        }
+        case NetworkEventType::RequestChunks:
+        {
+            shared_ptr<stream::Reader> pEventReader = event.getReader();
+            stream::Reader &eventReader = *pEventReader;
+            lock_guard<mutex> lockIt(connection.requestedChunksLock);
+            while(eventReader.readBool())
+            {
+                PositionI chunkPosition = stream::read<PositionI>(eventReader);
+                ChunkRequestPriority priority = stream::read<ChunkRequestPriority>(eventReader);
+                if(chunkPosition != RenderObjectChunk::BlockChunkType::getChunkBasePosition(chunkPosition))
+                    continue;
+                addChunkRequest(connection, chunkPosition, priority);
+            }
+            connection.notify();
+            break;
+        }
+        case NetworkEventType::CancelChunkRequests:
+        {
+            shared_ptr<stream::Reader> pEventReader = event.getReader();
+            stream::Reader &eventReader = *pEventReader;
+            vector<PositionI> cancelledChunks;
+            {
+                lock_guard<mutex> lockIt(connection.requestedChunksLock);
+                while(eventReader.readBool())
+                {
+                    PositionI chunkPosition = stream::read<PositionI>(eventReader);
+                    connection.sentChunks.erase(chunkPosition); // the client dropped it, so it's pushed again when it comes back into the interest radius
+                    if(connection.requestedChunks.erase(chunkPosition) != 0)
+                        cancelledChunks.push_back(chunkPosition);
+                }
+            }
+            connection.cancelledChunks += cancelledChunks.size();
+            cancelGenerateChunks(cancelledChunks);
+            break;
+        }
+        case NetworkEventType::SendPlayerProperties:
+        {
+            shared_ptr<stream::Reader> pEventReader = event.getReader();
+            PositionF position = stream::read<PositionF>(*pEventReader);
+            connection.viewPosition.write(position);
+            if(pEventReader->dataAvailable()) // older clients only send the position
+                connection.viewDirection.write(normalizeNoThrow(stream::read<VectorF>(*pEventReader)));
+            float interestRadius = 0;
+            if(pEventReader->dataAvailable()) // clients that don't send an interest radius only get the chunks they request
+                interestRadius = pEventReader->readLimitedF32(0, maxInterestRadius());
+            connection.hasViewPosition = true;
+            if(interestRadius > 0)
+                updateInterest(connection, position, interestRadius);
+            break;
+        }
+        case NetworkEventType::SendNewChunks:
+        case NetworkEventType::SendBlockUpdates:
+        case NetworkEventType::SubscribeChunks:
+        case NetworkEventType::UnsubscribeChunks:
+        case NetworkEventType::EventFragment: // clients don't send bulk events
+        case NetworkEventType::BulkBarrier:
+            break;
+        }
+    }
     void reader(shared_ptr<Connection> pconnection, shared_ptr<stream::Reader> preader)
     {
         Connection &connection = *pconnection;
         connection.viewPosition.write(initialPositionF());
         connection.hasViewPosition = true;
-        NetworkEvent event;
+        shared_ptr<LocalEventReader> localReader = dynamic_pointer_cast<LocalEventReader>(preader);
         while(running && !connection.done)
         {
             try
             {
-                event = stream::read<NetworkEvent>(*preader);
-                switch(event.type)
+                if(localReader != nullptr)
                 {
-                case NetworkEventType::Keepalive:
-                    connection.needKeepalive = true;
-                    connection.eventWaitCond.notify_all();
-                    break;
-                case NetworkEventType::SendNewChunk:
-                    break;
-                case NetworkEventType::SendBlockUpdate:
-                    break;
-                case NetworkEventType::RequestChunk:
-                {
-                    shared_ptr<stream::Reader> pEventReader = event.getReader();
-                    PositionI chunkPosition = stream::read<PositionI>(*pEventReader);
-                    if(chunkPosition != RenderObjectChunk::BlockChunkType::getChunkBasePosition(chunkPosition))
-                        break;
-                    lock_guard<mutex> lockIt(connection.requestedChunksLock);
-                    connection.requestedChunks.insert(chunkPosition);
-                    connection.eventWaitCond.notify_all();
-                    break;
+                    LocalEvent event = localReader->receive();
+                    handleEvent(connection, event.event);
+                    continue;
                 }
-                case NetworkEventType::SendPlayerProperties:
+                NetworkEvent::readInPlace(*preader, [&](NetworkEvent &event)
                 {
-                    shared_ptr<stream::Reader> pEventReader = event.getReader();
-                    connection.viewPosition.write(stream::read<PositionF>(*pEventReader));
-                    connection.hasViewPosition = true;
-                    break;
-                }
-                }
+                    handleEvent(connection, event);
+                });
             }
             catch(stream::IOException &e)
             {
@@ -213,59 +440,430 @@ class Server
         connection.done = true;
         cout << "server reader stopped\x1b[K" << endl;
     }
-    bool writeRequestedChunks(Connection &connection, stream::Writer &writer)
+    /// must hold connection.requestedChunksLock
+    static void addChunkRequest(Connection &connection, PositionI chunkPosition, ChunkRequestPriority priority)
+    {
+        connection.sentChunks.erase(chunkPosition); // the client evicted it if we already sent it
+        auto iter = connection.requestedChunks.find(chunkPosition);
+        if(iter == connection.requestedChunks.end())
+            connection.requestedChunks.insert(make_pair(chunkPosition, Connection::ChunkRequest(chrono::steady_clock::now(), priority)));
+        else
+            std::get<1>(*iter).priority = priority;
+    }
+    static ChunkRequestPriority getPushedChunkPriority(float distanceSquared, float interestRadius)
+    {
+        if(distanceSquared < 4 * RenderObjectChunk::BlockChunkType::chunkSizeX * RenderObjectChunk::BlockChunkType::chunkSizeX)
+            return ChunkRequestPriority::Urgent;
+        if(distanceSquared < 0.75f * 0.75f * interestRadius * interestRadius)
+            return ChunkRequestPriority::Visible;
+        return ChunkRequestPriority::Prefetch;
+    }
+    /** moves the connection's area of interest to the player, which is done when the player moves into
+     * another chunk or the interest radius changes.
+     * the chunks within interestRadius of the player that the client doesn't have are queued to be pushed to it
+     * without waiting for it to request them. the sent chunks that are more than unsubscribeMargin() outside the
+     * interest radius are queued to be unsubscribed and the pushed chunks that aren't sent yet are dropped.
+     */
+    void updateInterest(Connection &connection, PositionF playerPos, float interestRadius)
+    {
+        typedef RenderObjectChunk::BlockChunkType BlockChunkType;
+        PositionI interestCenter = BlockChunkType::getChunkBasePosition((PositionI)playerPos);
+        vector<PositionI> droppedChunks;
+        {
+            lock_guard<mutex> lockIt(connection.requestedChunksLock);
+            if(connection.interestRadius == interestRadius && connection.interestCenter == interestCenter)
+                return;
+            if(connection.interestRadius == 0)
+                connection.needSubscribe = true;
+            connection.interestRadius = interestRadius;
+            connection.interestCenter = interestCenter;
+            float keepDistance = interestRadius + unsubscribeMargin();
+            for(auto i = connection.sentChunks.begin(); i != connection.sentChunks.end();)
+            {
+                if(chunkDistanceMetric(std::get<0>(*i), playerPos) > keepDistance * keepDistance)
+                {
+                    connection.pendingUnsubscribes.push_back(std::get<0>(*i));
+                    connection.unsubscribedChunks++;
+                    i = connection.sentChunks.erase(i);
+                }
+                else
+                    i++;
+            }
+            for(auto i = connection.requestedChunks.begin(); i != connection.requestedChunks.end();)
+            {
+                if(std::get<1>(*i).pushed && chunkDistanceMetric(std::get<0>(*i), playerPos) > keepDistance * keepDistance)
+                {
+                    droppedChunks.push_back(std::get<0>(*i));
+                    i = connection.requestedChunks.erase(i);
+                }
+                else
+                    i++;
+            }
+            auto now = chrono::steady_clock::now();
+            PositionI minPosition = BlockChunkType::getChunkBasePosition((PositionI)playerPos - VectorI((int32_t)ceil(interestRadius)));
+            PositionI maxPosition = BlockChunkType::getChunkBasePosition((PositionI)playerPos + VectorI((int32_t)ceil(interestRadius)));
+            for(PositionI chunkPosition = minPosition; chunkPosition.x <= maxPosition.x; chunkPosition.x += BlockChunkType::chunkSizeX)
+            {
+                for(chunkPosition.y = minPosition.y; chunkPosition.y <= maxPosition.y; chunkPosition.y += BlockChunkType::chunkSizeY)
+                {
+                    for(chunkPosition.z = minPosition.z; chunkPosition.z <= maxPosition.z; chunkPosition.z += BlockChunkType::chunkSizeZ)
+                    {
+                        float distanceSquared = chunkDistanceMetric(chunkPosition, playerPos);
+                        if(distanceSquared > interestRadius * interestRadius)
+                            continue;
+                        if(connection.sentChunks.find(chunkPosition) != connection.sentChunks.end())
+                            continue;
+                        if(connection.requestedChunks.find(chunkPosition) != connection.requestedChunks.end())
+                            continue;
+                        connection.requestedChunks.insert(make_pair(chunkPosition, Connection::ChunkRequest(now, getPushedChunkPriority(distanceSquared, interestRadius), true)));
+                        connection.pushedChunks++;
+                    }
+                }
+            }
+        }
+        cancelGenerateChunks(droppedChunks);
+        connection.notify();
+    }
+    /** sends event to the connection : local connections get it with chunks right away and
+     * the others get it through the connection's eventFragmenter.
+     * returns the number of bytes written.
+     */
+    size_t writeEvent(Connection &connection, stream::Writer &writer, NetworkEvent event, vector<LocalChunk> chunks = vector<LocalChunk>())
+    {
+        LocalEventWriter *localWriter = dynamic_cast<LocalEventWriter *>(&writer);
+        if(localWriter == nullptr)
+            return connection.eventFragmenter.write(writer, std::move(event));
+        size_t retval = NetworkEvent::headerSize + event.size();
+        localWriter->send(LocalEvent(std::move(event), std::move(chunks)));
+        return retval;
+    }
+    /** writes the uint16 number of blockTypes the client doesn't have yet, then for each
+     * the uint16 block type id and the block descriptor.
+     * must hold connection.requestedChunksLock
+     */
+    void writeNewBlockTypes(Connection &connection, stream::Writer &writer, const vector<BlockTypeId> &blockTypes)
+    {
+        vector<BlockTypeId> newBlockTypes;
+        for(BlockTypeId typeId : blockTypes)
+        {
+            if(typeId != RenderObjectBlockRegistry::nullId && std::get<1>(connection.sentBlockTypes.insert(typeId)))
+                newBlockTypes.push_back(typeId);
+        }
+        stream::write<uint16_t>(writer, (uint16_t)newBlockTypes.size());
+        for(BlockTypeId typeId : newBlockTypes)
+        {
+            stream::write<uint16_t>(writer, typeId);
+            stream::write<RenderObjectBlockDescriptor>(writer, connection.variableSet, RenderObjectBlockRegistry::get().getDescriptorPtr(typeId));
+        }
+    }
+    /** writes a chunk in a SendNewChunks event : the block types the client doesn't have yet
+     * (see writeNewBlockTypes) then the shared payload.
+     * must hold connection.requestedChunksLock
+     */
+    void writeChunkPayload(Connection &connection, stream::Writer &writer, const ChunkPayload &payload)
+    {
+        writeNewBlockTypes(connection, writer, payload.blockTypes);
+        writer.writeBytes(payload.bytes.data(), payload.bytes.size());
+    }
+    /** queues the requested chunks with the best priority as one SendNewChunks event of about byteBudget bytes
+     * in the connection's eventFragmenter; writeEvents sends it in fragments. local connections get the
+     * chunks' snapshots right away instead of the payloads.
+     * chunks are sent by the priority the client requested them with or they were pushed with, then nearest first.
+     * requested chunks that are farther than staleChunkDistance() from the player are dropped, and pushed
+     * chunks that are farther than the interest radius and unsubscribeMargin(), like the sent chunks updateInterest unsubscribes.
+     * returns the number of bytes written right away, which is 0 unless the connection is local.
+     */
+    size_t writeRequestedChunks(Connection &connection, stream::Writer &writer, size_t byteBudget)
     {
         lock_guard<mutex> lockIt(connection.requestedChunksLock);
-        vector<PositionI> requestedChunks;
+        PositionF playerPos = connection.viewPosition;
+        VectorF viewDirection = connection.viewDirection;
+        vector<tuple<PositionI, ChunkRequestPriority, float>> requestedChunks;
         requestedChunks.reserve(connection.requestedChunks.size());
         for(auto i = connection.requestedChunks.begin(); i != connection.requestedChunks.end();)
         {
-            PositionI pos = *i;
+            PositionI pos = std::get<0>(*i);
             if(connection.sentChunks.find(pos) != connection.sentChunks.end())
             {
                 i = connection.requestedChunks.erase(i);
                 continue;
             }
-            else
-                i++;
+            float distanceSquared = chunkDistanceMetric(pos, playerPos);
+            // pushed chunks can be farther than staleChunkDistance() since the interest radius can be bigger
+            float staleDistance = (std::get<1>(*i).pushed ? connection.interestRadius + unsubscribeMargin() : staleChunkDistance());
+            if(distanceSquared > staleDistance * staleDistance) // the player moved away
+            {
+                i = connection.requestedChunks.erase(i);
+                connection.droppedStaleChunks++;
+                continue;
+            }
+            ChunkRequestPriority priority = std::get<1>(*i).priority;
+            i++;
             if(!queueGenerateChunk(pos)) // then the chunk exists
             {
-                requestedChunks.push_back(pos);
+                requestedChunks.push_back(make_tuple(pos, priority, chunkPriorityMetric(pos, playerPos, viewDirection)));
             }
         }
         if(requestedChunks.empty())
-            return false;
-        PositionF playerPos = connection.viewPosition;
-        std::sort(requestedChunks.begin(), requestedChunks.end(), [&](PositionI a, PositionI b)
+            return 0;
+        std::sort(requestedChunks.begin(), requestedChunks.end(), [](const tuple<PositionI, ChunkRequestPriority, float> &a, const tuple<PositionI, ChunkRequestPriority, float> &b)
         {
-            return chunkDistanceMetric(a, playerPos) < chunkDistanceMetric(b, playerPos);
+            if(std::get<1>(a) != std::get<1>(b))
+                return std::get<1>(a) < std::get<1>(b);
+            return std::get<2>(a) < std::get<2>(b);
         });
+        // send the best chunks in one batch, up to the byte and time budgets
+        byteBudget = min(byteBudget, chunkBatchByteBudget());
+        auto startTime = chrono::steady_clock::now();
+        bool isLocal = dynamic_cast<LocalEventWriter *>(&writer) != nullptr;
         stream::MemoryWriter chunkDataWriter;
-        stream::write<RenderObjectChunk>(chunkDataWriter, connection.variableSet, world->getChunk(requestedChunks.front()));
-        NetworkEvent event(NetworkEventType::SendNewChunk, std::move(chunkDataWriter));
-        stream::write<NetworkEvent>(writer, std::move(event));
-        connection.requestedChunks.erase(requestedChunks.front());
-        connection.sentChunks.insert(requestedChunks.front());
-        writer.flush();
-        return true;
+        vector<LocalChunk> localChunks;
+        size_t chunkCount = 0;
+        for(const tuple<PositionI, ChunkRequestPriority, float> &requestedChunk : requestedChunks)
+        {
+            PositionI chunkPosition = std::get<0>(requestedChunk);
+            if(chunkDataWriter.getBuffer().size() >= byteBudget || chrono::steady_clock::now() - startTime >= chunkBatchTimeBudget())
+                break;
+            shared_ptr<RenderObjectChunk> chunk = world->getChunk(chunkPosition);
+            if(chunk == nullptr) // evicted since queueGenerateChunk; it is generated again for the next batch
+                continue;
+            if(isLocal) // the client shares the snapshot, so it isn't encoded
+            {
+                shared_ptr<const RenderObjectChunk::BlockChunkType::Snapshot> blocks = chunk->blockChunk.getSnapshot();
+                localChunks.push_back(LocalChunk{chunkPosition, blocks});
+                connection.requestedChunks.erase(chunkPosition);
+                connection.sentChunks[chunkPosition] = blocks->version;
+                chunkCount++;
+                continue;
+            }
+            shared_ptr<const ChunkPayload> payload = chunkPayloadCache.get(*chunk);
+            chunkDataWriter.writeBool(true);
+            writeChunkPayload(connection, chunkDataWriter, *payload);
+            connection.requestedChunks.erase(chunkPosition);
+            connection.sentChunks[chunkPosition] = payload->version;
+            chunkCount++;
+        }
+        if(chunkCount == 0)
+            return 0;
+        if(isLocal)
+            return writeEvent(connection, writer, NetworkEvent(NetworkEventType::SendNewChunks), std::move(localChunks));
+        chunkDataWriter.writeBool(false);
+        return writeEvent(connection, writer, NetworkEvent(NetworkEventType::SendNewChunks, std::move(chunkDataWriter)));
     }
-    bool writeBlockUpdates(Connection &connection, stream::Writer &writer)
+    /** writes the changes to the chunks of up to blockUpdateBatchSize() queued block updates as one SendBlockUpdates event.
+     * the updates are held back until a full batch is queued or the oldest has waited
+     * blockUpdateMaxDelay(); wakeTime is lowered to when the held back updates are due.
+     *
+     * each changed chunk is sent as a delta against the version the client has, or as the whole
+     * chunk if that is smaller or that version isn't in chunkHistory anymore. chunks the client
+     * doesn't have are skipped.
+     *
+     * the event is a list of chunks, each preceded by true and followed by false. a chunk is the
+     * block types the client doesn't have yet (see writeNewBlockTypes) and a bool that is true for
+     * a whole chunk, which is followed by the chunk payload. a delta is followed by the chunk base
+     * position, the uint32 number of changed blocks, then for each the uint16 array index of the
+     * block relative to the chunk base and the uint16 block type id. local connections get the changed
+     * chunks' snapshots instead.
+     * returns the number of bytes written.
+     */
+    size_t writeBlockUpdates(Connection &connection, stream::Writer &writer, chrono::steady_clock::time_point &wakeTime)
     {
-        PositionI position;
+        typedef RenderObjectChunk::BlockChunkType BlockChunkType;
+        static_assert((size_t)BlockChunkType::chunkSizeX * BlockChunkType::chunkSizeY * BlockChunkType::chunkSizeZ <= 0x10000, "block array index doesn't fit in uint16_t");
+        unordered_set<PositionI> changedChunks;
         {
             lock_guard<mutex> lockIt(connection.blockUpdatesMutex);
             if(connection.blockUpdatesQueue.empty())
-                return false;
-            position = connection.blockUpdatesQueue.front();
-            connection.blockUpdatesQueue.pop_front();
-            connection.blockUpdatesSet.erase(position);
+                return 0;
+            if(connection.blockUpdatesQueue.size() < blockUpdateBatchSize())
+            {
+                auto flushTime = connection.blockUpdatesQueuedTime + blockUpdateMaxDelay();
+                if(chrono::steady_clock::now() < flushTime)
+                {
+                    wakeTime = min(wakeTime, flushTime);
+                    return 0;
+                }
+            }
+            for(size_t i = 0; i < blockUpdateBatchSize() && !connection.blockUpdatesQueue.empty(); i++)
+            {
+                PositionI position = connection.blockUpdatesQueue.front();
+                connection.blockUpdatesQueue.pop_front();
+                connection.blockUpdatesSet.erase(position);
+                changedChunks.insert(BlockChunkType::getChunkBasePosition(position));
+            }
         }
+        bool isLocal = dynamic_cast<LocalEventWriter *>(&writer) != nullptr;
         stream::MemoryWriter eventWriter;
-        stream::write<PositionI>(eventWriter, position);
-        stream::write<RenderObjectBlock>(eventWriter, connection.variableSet, world->getBlock(position));
-        stream::write<NetworkEvent>(writer, NetworkEvent(NetworkEventType::SendBlockUpdate, std::move(eventWriter)));
+        vector<LocalChunk> localChunks;
+        size_t chunkCount = 0;
+        lock_guard<mutex> lockIt(connection.requestedChunksLock);
+        for(PositionI chunkPosition : changedChunks)
+        {
+            auto sentChunkIter = connection.sentChunks.find(chunkPosition);
+            if(sentChunkIter == connection.sentChunks.end()) // the client gets the blocks when it requests the chunk
+                continue;
+            shared_ptr<RenderObjectChunk> chunk = world->getChunk(chunkPosition);
+            if(chunk == nullptr) // evicted; the client has the blocks it was last sent
+                continue;
+            uint64_t &sentVersion = std::get<1>(*sentChunkIter);
+            shared_ptr<const BlockChunkType::Snapshot> blocks = chunk->blockChunk.getSnapshot();
+            if(blocks->version == sentVersion)
+                continue;
+            if(isLocal) // passing the snapshot costs less than finding the changes
+            {
+                localChunks.push_back(LocalChunk{chunkPosition, blocks});
+                sentVersion = blocks->version;
+                chunkCount++;
+                connection.fullChunkUpdates++;
+                continue;
+            }
+            shared_ptr<const BlockChunkType::Snapshot> sentBlocks = chunkHistory.get(chunkPosition, sentVersion);
+            vector<uint16_t> changedIndices;
+            vector<BlockTypeId> blockTypes;
+            unordered_set<BlockTypeId> blockTypesSet;
+            if(sentBlocks != nullptr)
+            {
+                for(size_t i = 0; i < BlockChunkType::BlocksArrayType::size(); i++)
+                {
+                    RenderObjectBlock block = blocks->blocks.get(i);
+                    if(block == sentBlocks->blocks.get(i))
+                        continue;
+                    changedIndices.push_back((uint16_t)i);
+                    if(std::get<1>(blockTypesSet.insert(block.typeId)))
+                        blockTypes.push_back(block.typeId);
+                }
+                if(changedIndices.empty())
+                {
+                    sentVersion = blocks->version;
+                    continue;
+                }
+            }
+            chunkCount++;
+            eventWriter.writeBool(true);
+            size_t deltaSize = sizeof(PositionI) + sizeof(uint32_t) + changedIndices.size() * (sizeof(uint16_t) + sizeof(BlockTypeId));
+            shared_ptr<const ChunkPayload> payload;
+            if(sentBlocks == nullptr || deltaSize > deltaFullChunkSizeThreshold()) // the whole chunk is sent if the client's version is too old to make a delta
+            {
+                payload = chunkPayloadCache.get(*chunk);
+                if(sentBlocks != nullptr && payload->bytes.size() >= deltaSize)
+                    payload = nullptr;
+            }
+            if(payload != nullptr)
+            {
+                writeNewBlockTypes(connection, eventWriter, payload->blockTypes);
+                eventWriter.writeBool(true);
+                eventWriter.writeBytes(payload->bytes.data(), payload->bytes.size());
+                sentVersion = payload->version;
+                connection.fullChunkUpdates++;
+                continue;
+            }
+            writeNewBlockTypes(connection, eventWriter, blockTypes);
+            eventWriter.writeBool(false);
+            stream::write<PositionI>(eventWriter, chunkPosition);
+            stream::write<uint32_t>(eventWriter, (uint32_t)changedIndices.size());
+            for(uint16_t index : changedIndices)
+            {
+                eventWriter.writeU16(index);
+                stream::write<uint16_t>(eventWriter, blocks->blocks.get(index).typeId);
+            }
+            sentVersion = blocks->version;
+            connection.deltaChunkUpdates++;
+        }
+        if(chunkCount == 0)
+            return 0;
+        if(isLocal)
+            return writeEvent(connection, writer, NetworkEvent(NetworkEventType::SendBlockUpdates), std::move(localChunks));
+        eventWriter.writeBool(false);
+        size_t retval = writeEvent(connection, writer, NetworkEvent(NetworkEventType::SendBlockUpdates, std::move(eventWriter)));
         writer.flush();
-        return true;
+        return retval;
+    }
+    /** writes the SubscribeChunks event when the client first subscribes and an UnsubscribeChunks event
+     * with the chunks that left the interest radius. they are urgent so the client drops the chunks
+     * before they are pushed again.
+     * returns the number of bytes written.
+     */
+    size_t writeInterestEvents(Connection &connection, stream::Writer &writer)
+    {
+        bool needSubscribe;
+        float interestRadius;
+        vector<PositionI> unsubscribedChunks;
+        {
+            lock_guard<mutex> lockIt(connection.requestedChunksLock);
+            needSubscribe = connection.needSubscribe;
+            connection.needSubscribe = false;
+            interestRadius = connection.interestRadius;
+            unsubscribedChunks.swap(connection.pendingUnsubscribes);
+        }
+        size_t retval = 0;
+        if(needSubscribe)
+        {
+            stream::MemoryWriter eventWriter;
+            eventWriter.writeF32(interestRadius);
+            retval += writeEvent(connection, writer, NetworkEvent(NetworkEventType::SubscribeChunks, std::move(eventWriter)));
+        }
+        if(!unsubscribedChunks.empty())
+        {
+            stream::MemoryWriter eventWriter;
+            for(PositionI chunkPosition : unsubscribedChunks)
+            {
+                eventWriter.writeBool(true);
+                stream::write<PositionI>(eventWriter, chunkPosition);
+            }
+            eventWriter.writeBool(false);
+            retval += writeEvent(connection, writer, NetworkEvent(NetworkEventType::UnsubscribeChunks, std::move(eventWriter)));
+        }
+        if(retval > 0)
+            writer.flush();
+        return retval;
+    }
+    /** the send scheduler : writes whatever is ready to be sent to connection and returns if anything was written.
+     * keepalives, interest changes and block updates are urgent and always sent; chunks are only sent while the connection
+     * has bandwidth budget left, which refills at sendBytesPerSecond(). chunks are written one fragment per call so
+     * urgent events written by the next call don't wait for the rest of the chunks. wakeTime is set to when
+     * something that is held back can be sent.
+     */
+    bool writeEvents(Connection &connection, stream::Writer &writer, chrono::steady_clock::time_point &wakeTime, bool canWriteChunks)
+    {
+        auto now = chrono::steady_clock::now();
+        connection.sendBudget = min(sendBurstBytes(), connection.sendBudget + sendBytesPerSecond() * chrono::duration_cast<chrono::duration<double>>(now - connection.sendBudgetTime).count());
+        connection.sendBudgetTime = now;
+        if(dynamic_cast<LocalEventWriter *>(&writer) != nullptr) // nothing goes over a network
+            connection.sendBudget = sendBurstBytes();
+        size_t sentBytes = 0;
+        if(connection.needKeepalive.exchange(false))
+        {
+            stream::MemoryWriter eventWriter;
+            eventWriter.writeF32(averageTickTime.read());
+            eventWriter.writeF32(maxTickTime.read());
+            sentBytes += writeEvent(connection, writer, NetworkEvent(NetworkEventType::Keepalive, std::move(eventWriter)));
+            writer.flushUrgent(); // so the client measures the round trip time instead of the write coalescing delay
+        }
+        sentBytes += writeInterestEvents(connection, writer);
+        sentBytes += writeBlockUpdates(connection, writer, wakeTime);
+        connection.sendBudget -= sentBytes;
+        if(canWriteChunks)
+        {
+            if(connection.sendBudget > 0)
+            {
+                size_t chunkBytes = 0;
+                if(connection.eventFragmenter.empty())
+                    chunkBytes += writeRequestedChunks(connection, writer, (size_t)connection.sendBudget);
+                chunkBytes += connection.eventFragmenter.writeFragment(writer);
+                if(chunkBytes > 0)
+                    writer.flush();
+                connection.sendBudget -= chunkBytes;
+                sentBytes += chunkBytes;
+            }
+            if(connection.sendBudget <= 0)
+            {
+                lock_guard<mutex> lockIt(connection.requestedChunksLock);
+                if(!connection.requestedChunks.empty() || !connection.eventFragmenter.empty()) // wake up when the budget is positive again
+                    wakeTime = min(wakeTime, now + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>((1 - connection.sendBudget) / sendBytesPerSecond())));
+            }
+        }
+        connection.sentBytes += sentBytes;
+        return sentBytes > 0;
     }
     void writer(shared_ptr<Connection> pconnection, shared_ptr<stream::Writer> pwriter)
     {
@@ -273,30 +871,22 @@ class Server
         Connection &connection = *pconnection;
         try
         {
-            stream::write<RenderObjectWorld>(*pwriter, variableSet, world);
+            shared_ptr<LocalEventWriter> localWriter = dynamic_pointer_cast<LocalEventWriter>(pwriter);
+            if(localWriter != nullptr)
+                localWriter->sendWorld(*world);
+            else
+                stream::write<RenderObjectWorld>(*pwriter, variableSet, world);
             pwriter->flush();
             while(running && !connection.done)
             {
-                bool didAnything = false;
-                if(connection.needKeepalive.exchange(false))
-                {
-                    NetworkEvent event(NetworkEventType::Keepalive);
-                    stream::write<NetworkEvent>(*pwriter, event);
-                    pwriter->flush();
-                    didAnything = true;
-                }
-                if(writeBlockUpdates(connection, *pwriter))
-                {
-                    didAnything = true;
-                }
-                if(writeRequestedChunks(connection, *pwriter))
-                {
-                    didAnything = true;
-                }
-                if(didAnything)
+                auto wakeTime = chrono::steady_clock::time_point::max();
+                if(writeEvents(connection, *pwriter, wakeTime, true))
                     continue;
                 lock_guard<mutex> lockIt(connection.eventWaitMutex);
-                connection.eventWaitCond.wait(connection.eventWaitMutex);
+                if(wakeTime == chrono::steady_clock::time_point::max())
+                    connection.eventWaitCond.wait(connection.eventWaitMutex);
+                else
+                    connection.eventWaitCond.wait_until(connection.eventWaitMutex, wakeTime);
             }
         }
         catch(stream::IOException &e)
@@ -318,47 +908,212 @@ class Server
         thread(&Server::reader, this, pconnection, streamRW->preader()).detach();
         thread(&Server::writer, this, pconnection, streamRW->pwriter()).detach();
     }
+    shared_ptr<stream::NetworkEventLoop> eventLoop;
+    shared_ptr<WorkerPool> workers;
+    /// makes sure serviceConnection runs for the connection after this call
+    void wakeConnection(shared_ptr<Connection> pconnection)
+    {
+        Connection &connection = *pconnection;
+        if(!connection.started)
+            return;
+        {
+            lock_guard<mutex> lockIt(connection.serviceLock);
+            connection.needService = true;
+            if(connection.serviceScheduled)
+                return;
+            connection.serviceScheduled = true;
+        }
+        workers->post([this, pconnection]()
+        {
+            serviceConnection(pconnection);
+        });
+    }
+    /** handles the events read from an event loop connection and writes what is ready to it.
+     * runs on a worker thread; at most one runs per connection at a time so the events are handled in order.
+     * chunk fragments are held back while the socket has maxPendingOutputBytes() unsent; the socket's drained
+     * handler wakes the connection again. reading the socket is resumed here once the events that paused it are handled.
+     */
+    void serviceConnection(shared_ptr<Connection> pconnection)
+    {
+        Connection &connection = *pconnection;
+        auto wakeTime = chrono::steady_clock::time_point::max();
+        try
+        {
+            for(;;)
+            {
+                deque<NetworkEvent> events;
+                {
+                    lock_guard<mutex> lockIt(connection.serviceLock);
+                    events.swap(connection.pendingEvents);
+                    connection.pendingEventBytes = 0;
+                    connection.needService = false;
+                }
+                for(NetworkEvent &event : events)
+                    handleEvent(connection, event);
+                events.clear();
+                {
+                    lock_guard<mutex> lockIt(connection.serviceLock);
+                    if(connection.readingPaused)
+                    {
+                        connection.readingPaused = false;
+                        connection.socket->resumeReading();
+                    }
+                }
+                if(!connection.sentWorld)
+                {
+                    stream::write<RenderObjectWorld>(*connection.socketWriter, connection.variableSet, world);
+                    connection.socketWriter->flush();
+                    connection.sentWorld = true;
+                }
+                bool canWriteChunks = connection.socket->getPendingOutputBytes() < maxPendingOutputBytes();
+                wakeTime = chrono::steady_clock::time_point::max();
+                bool didAnything = running && !connection.done && writeEvents(connection, *connection.socketWriter, wakeTime, canWriteChunks);
+                lock_guard<mutex> lockIt(connection.serviceLock);
+                if(!didAnything && !connection.needService)
+                {
+                    connection.serviceScheduled = false;
+                    break;
+                }
+            }
+        }
+        catch(stream::IOException &e)
+        {
+            cerr << "IO Error : " << e.what() << endl;
+            connection.done = true;
+            connection.socket->close();
+            lock_guard<mutex> lockIt(connection.serviceLock);
+            connection.serviceScheduled = false;
+            return;
+        }
+        if(wakeTime != chrono::steady_clock::time_point::max())
+        {
+            weak_ptr<Connection> wpConnection = pconnection;
+            workers->post([this, wpConnection]()
+            {
+                shared_ptr<Connection> pconnection = wpConnection.lock();
+                if(pconnection)
+                    wakeConnection(pconnection);
+            }, wakeTime);
+        }
+    }
+    /// runs a socket from a NetworkServer on the event loop instead of on a reader and a writer thread
+    void startEventLoopConnection(int fd)
+    {
+        shared_ptr<Connection> pconnection = shared_ptr<Connection>(new Connection(connectionCount, anyConnections));
+        Connection &connection = *pconnection;
+        connection.viewPosition.write(initialPositionF());
+        connection.hasViewPosition = true;
+        weak_ptr<Connection> wpConnection = pconnection;
+        connection.socket = eventLoop->add(fd, [this, pconnection](NetworkEvent event)
+        {
+            {
+                lock_guard<mutex> lockIt(pconnection->serviceLock);
+                pconnection->pendingEventBytes += event.size();
+                pconnection->pendingEvents.push_back(std::move(event));
+                // the events keep the receive buffers alive, so stop reading until the worker catches up
+                if(pconnection->started && !pconnection->readingPaused && (pconnection->pendingEvents.size() >= maxPendingEvents() || pconnection->pendingEventBytes >= maxPendingEventBytes()))
+                {
+                    pconnection->readingPaused = true;
+                    pconnection->socket->pauseReading();
+                }
+            }
+            wakeConnection(pconnection);
+        }, [this, pconnection]()
+        {
+            wakeConnection(pconnection);
+        }, [pconnection]()
+        {
+            pconnection->done = true;
+            cout << "server connection closed\x1b[K" << endl;
+        });
+        connection.socketWriter = connection.socket->pwriter();
+        connection.onNotify = [this, wpConnection]()
+        {
+            shared_ptr<Connection> pconnection = wpConnection.lock();
+            if(pconnection)
+                wakeConnection(pconnection);
+        };
+        connection.started = true;
+        {
+            lock_guard<mutex> lockIt(connectionsListLock);
+            connectionsList.push_back(pconnection);
+        }
+        wakeConnection(pconnection); // sends the world
+    }
     unordered_set<PositionI> blockUpdateSet;
     mutex blockUpdateLock;
-    void setBlock(PositionI pos, RenderObjectBlock block)
+    void setBlocks(const vector<pair<PositionI, RenderObjectBlock>> &edits)
     {
+        if(edits.empty())
+            return;
         lock_guard<mutex> lockIt(blockUpdateLock);
-        world->setBlock(pos, block);
-        blockUpdateSet.insert(pos);
+        unordered_set<PositionI> editedChunks;
+        for(const pair<PositionI, RenderObjectBlock> &edit : edits)
+        {
+            PositionI chunkPosition = RenderObjectChunk::BlockChunkType::getChunkBasePosition(std::get<0>(edit));
+            if(!std::get<1>(editedChunks.insert(chunkPosition)))
+                continue;
+            shared_ptr<RenderObjectChunk> chunk = world->getChunk(chunkPosition);
+            if(chunk != nullptr) // clients may have this version, so keep it to make deltas against
+                chunkHistory.add(chunkPosition, chunk->blockChunk.getSnapshot());
+        }
+        // an unloaded chunk would be made blank and then overwrite the stored terrain, so skip its edits
+        world->setBlocksIfLoaded(edits, [this](shared_ptr<RenderObjectChunk> chunk, const vector<PositionI> &changedPositions)
+        {
+            blockUpdateSet.insert(changedPositions.begin(), changedPositions.end());
+            chunkPayloadCache.invalidate(chunk->blockChunk.basePosition);
+            storage->markDirty(chunk);
+        });
     }
     void generateChunk(PositionI chunkPosition)
     {
+        shared_ptr<RenderObjectChunk> chunk;
+        try
         {
+            chunk = storage->load(chunkPosition);
+        }
+        catch(stream::IOException &e)
+        {
+            cerr << "error loading chunk : " << e.what() << endl;
+        }
+        if(chunk == nullptr)
+        {
+            const RenderObjectBlock stone = getStone(), dirt = getDirt(), grass = getGrass(), air = getAir();
             RenderObjectChunk::BlockChunkType blockChunk(chunkPosition);
-            for(int32_t x = chunkPosition.x; x < chunkPosition.x + RenderObjectChunk::BlockChunkType::chunkSizeX; x++)
+            blockChunk.edit([&](RenderObjectChunk::BlockChunkType::Snapshot &blocks)
             {
-                for(int32_t z = chunkPosition.z; z < chunkPosition.z + RenderObjectChunk::BlockChunkType::chunkSizeZ; z++)
+                for(int32_t x = chunkPosition.x; x < chunkPosition.x + RenderObjectChunk::BlockChunkType::chunkSizeX; x++)
                 {
-                    int32_t landHeight = (int32_t)(64 + 4 * (sin((float)x / 3) * sin((float)z / 3)));
-                    for(int32_t y = chunkPosition.y; y < chunkPosition.y + RenderObjectChunk::BlockChunkType::chunkSizeY; y++)
+                    for(int32_t z = chunkPosition.z; z < chunkPosition.z + RenderObjectChunk::BlockChunkType::chunkSizeZ; z++)
                     {
-                        if(y < landHeight - 5)
-                        {
-                            blockChunk.blocks[x - chunkPosition.x][y - chunkPosition.y][z - chunkPosition.z] = getStone();
-                        }
-                        else if(y < landHeight)
+                        int32_t landHeight = (int32_t)(64 + 4 * (sin((float)x / 3) * sin((float)z / 3)));
+                        for(int32_t y = chunkPosition.y; y < chunkPosition.y + RenderObjectChunk::BlockChunkType::chunkSizeY; y++)
                         {
-                            blockChunk.blocks[x - chunkPosition.x][y - chunkPosition.y][z - chunkPosition.z] = getDirt();
-                        }
-                        else if(y <= landHeight)
-                        {
-                            blockChunk.blocks[x - chunkPosition.x][y - chunkPosition.y][z - chunkPosition.z] = getGrass();
-                        }
-                        else
-                        {
-                            blockChunk.blocks[x - chunkPosition.x][y - chunkPosition.y][z - chunkPosition.z] = getAir();
+                            if(y < landHeight - 5)
+                            {
+                                blocks.set(x - chunkPosition.x, y - chunkPosition.y, z - chunkPosition.z, stone);
+                            }
+                            else if(y < landHeight)
+                            {
+                                blocks.set(x - chunkPosition.x, y - chunkPosition.y, z - chunkPosition.z, dirt);
+                            }
+                            else if(y <= landHeight)
+                            {
+                                blocks.set(x - chunkPosition.x, y - chunkPosition.y, z - chunkPosition.z, grass);
+                            }
+                            else
+                            {
+                                blocks.set(x - chunkPosition.x, y - chunkPosition.y, z - chunkPosition.z, air);
+                            }
                         }
                     }
                 }
-            }
-            shared_ptr<RenderObjectChunk> chunk = make_shared<RenderObjectChunk>(blockChunk);
-            world->setChunk(chunk);
+                return true;
+            });
+            chunk = RenderObjectChunk::make(blockChunk);
+            storage->markDirty(chunk);
         }
+        world->setChunk(chunk);
         lock_guard<mutex> lockIt(generateChunksLock);
         generatedChunks.insert(chunkPosition);
     }
@@ -382,6 +1137,13 @@ class Server
         }
         cout << "Generating World ... Done." << endl;
     }
+    /// chunkDistanceMetric scaled up by as much as behindChunkPriorityFactor() the farther chunkPos is from viewDirection
+    static float chunkPriorityMetric(PositionI chunkPos, PositionF playerPos, VectorF viewDirection)
+    {
+        VectorF chunkCenter = (VectorI)chunkPos + 0.5 * VectorF(RenderObjectChunk::BlockChunkType::chunkSizeX, RenderObjectChunk::BlockChunkType::chunkSizeY, RenderObjectChunk::BlockChunkType::chunkSizeZ);
+        float cosAngle = dot(normalizeNoThrow(chunkCenter - (VectorF)playerPos), viewDirection); // 0 if there's no view direction
+        return chunkDistanceMetric(chunkPos, playerPos) * (1 + (behindChunkPriorityFactor() - 1) * 0.5f * (1 - cosAngle));
+    }
     static float chunkDistanceMetric(PositionI chunkPos, PositionF playerPos)
     {
         return (chunkPos.d != playerPos.d ? 16 : 1) * absSquared((VectorI)chunkPos - 0.5 * VectorF(RenderObjectChunk::BlockChunkType::chunkSizeX, RenderObjectChunk::BlockChunkType::chunkSizeY, RenderObjectChunk::BlockChunkType::chunkSizeZ) - (VectorF)playerPos);
@@ -410,13 +1172,92 @@ class Server
                 i++;
             Connection &connection = *pConnection;
             lock_guard<mutex> lockIt2(connection.blockUpdatesMutex);
+            if(connection.blockUpdatesQueue.empty())
+                connection.blockUpdatesQueuedTime = chrono::steady_clock::now();
             for(PositionI pos : blockUpdates)
             {
                 if(std::get<1>(connection.blockUpdatesSet.insert(pos)))
                     connection.blockUpdatesQueue.push_back(pos);
             }
-            connection.eventWaitCond.notify_all();
+            connection.notify();
+        }
+    }
+    void notifyAllConnections()
+    {
+        lock_guard<mutex> lockIt(connectionsListLock);
+        for(weak_ptr<Connection> wpConnection : connectionsList)
+        {
+            shared_ptr<Connection> pConnection = wpConnection.lock();
+            if(pConnection)
+                pConnection->notify();
+        }
+    }
+    static SendQueueStatistics getSendQueueStatistics(Connection &connection)
+    {
+        SendQueueStatistics retval;
+        auto now = chrono::steady_clock::now();
+        {
+            lock_guard<mutex> lockIt(connection.requestedChunksLock);
+            retval.queuedChunks = connection.requestedChunks.size();
+            double totalAge = 0;
+            for(const auto &v : connection.requestedChunks)
+            {
+                double age = chrono::duration_cast<chrono::duration<double>>(now - std::get<1>(v).requestTime).count();
+                totalAge += age;
+                retval.oldestChunkRequestAge = max(retval.oldestChunkRequestAge, age);
+            }
+            if(retval.queuedChunks > 0)
+                retval.averageChunkRequestAge = totalAge / retval.queuedChunks;
+        }
+        {
+            lock_guard<mutex> lockIt(connection.blockUpdatesMutex);
+            retval.queuedBlockUpdates = connection.blockUpdatesQueue.size();
+            if(retval.queuedBlockUpdates > 0)
+                retval.oldestBlockUpdateAge = chrono::duration_cast<chrono::duration<double>>(now - connection.blockUpdatesQueuedTime).count();
+        }
+        retval.droppedStaleChunks = connection.droppedStaleChunks;
+        retval.deltaChunkUpdates = connection.deltaChunkUpdates;
+        retval.fullChunkUpdates = connection.fullChunkUpdates;
+        retval.cancelledChunks = connection.cancelledChunks;
+        retval.pushedChunks = connection.pushedChunks;
+        retval.unsubscribedChunks = connection.unsubscribedChunks;
+        retval.sentBytes = connection.sentBytes;
+        return retval;
+    }
+    /// gets the send queue statistics of all the connections combined
+    SendQueueStatistics getSendQueueStatistics()
+    {
+        SendQueueStatistics retval;
+        lock_guard<mutex> lockIt(connectionsListLock);
+        for(weak_ptr<Connection> wpConnection : connectionsList)
+        {
+            shared_ptr<Connection> pConnection = wpConnection.lock();
+            if(pConnection)
+                retval.add(getSendQueueStatistics(*pConnection));
+        }
+        return retval;
+    }
+    void evictChunks()
+    {
+        vector<PositionI> playerPositions;
+        {
+            lock_guard<mutex> lockIt(connectionsListLock);
+            for(weak_ptr<Connection> wpConnection : connectionsList)
+            {
+                shared_ptr<Connection> pConnection = wpConnection.lock();
+                if(pConnection && pConnection->hasViewPosition)
+                    playerPositions.push_back((PositionI)(PositionF)pConnection->viewPosition);
+            }
         }
+        if(playerPositions.empty())
+            playerPositions.push_back((PositionI)initialPositionF());
+        // one pass for all players so evicting around one player never evicts the chunks around another
+        world->evictChunks(playerPositions, 2 * generateDistance(), [this](shared_ptr<RenderObjectChunk> chunk)
+        {
+            // storage keeps the chunk until it's written, so it is loaded again the next time it's needed
+            lock_guard<mutex> lockIt(generateChunksLock);
+            generatedChunks.erase(chunk->blockChunk.basePosition);
+        });
     }
     flag starting;
     void simulate()
@@ -427,8 +1268,17 @@ class Server
         default_random_engine randomEngine;
         uniform_int_distribution<int32_t> xzPositionDistribution(-16, 16), yPositionDistribution(32, 96), blockTypeDistribution(0, 3);
         bool gotConnection = false;
+        const RenderObjectBlock dirt = getDirt(), glass = getGlass(), air = getAir(), stone = getStone();
+        auto lastEvictTime = chrono::steady_clock::now();
+        vector<pair<PositionI, RenderObjectBlock>> edits;
+        string sendQueueStatus;
+        uint64_t lastSentBytes = 0;
+        double totalTickTime = 0, maxTickTimeThisSecond = 0;
+        size_t tickCount = 0;
         while(running)
         {
+            auto tickStartTime = chrono::steady_clock::now();
+            edits.clear();
             for(size_t i = 0; i < 1; i++)
             {
                 PositionI pos = PositionI(xzPositionDistribution(randomEngine), yPositionDistribution(randomEngine), xzPositionDistribution(randomEngine), Dimension::Overworld);
@@ -441,30 +1291,65 @@ class Server
                     switch(blockType)
                     {
                     case 0:
-                        block = getDirt();
+                        block = dirt;
                         break;
                     case 1:
-                        block = getGlass();
+                        block = glass;
                         break;
                     case 2:
-                        block = getAir();
+                        block = air;
                         break;
                     default:
-                        block = getStone();
+                        block = stone;
                         break;
                     }
-                    setBlock(pos, block);
+                    edits.push_back(make_pair(pos, block));
                 }
             }
+            setBlocks(edits);
 
             moveAllBlockUpdatesToConnections();
 
+            if(chrono::steady_clock::now() - lastEvictTime >= chrono::seconds(1))
+            {
+                lastEvictTime = chrono::steady_clock::now();
+                evictChunks();
+                world->compactColdChunks();
+                SendQueueStatistics sendQueueStatistics = getSendQueueStatistics();
+                ostringstream ss;
+                ss << " Send Queues : " << sendQueueStatistics.queuedChunks << " chunks (oldest " << sendQueueStatistics.oldestChunkRequestAge;
+                ss << "s, average " << sendQueueStatistics.averageChunkRequestAge << "s) " << sendQueueStatistics.queuedBlockUpdates;
+                ss << " block updates (oldest " << sendQueueStatistics.oldestBlockUpdateAge << "s) " << sendQueueStatistics.droppedStaleChunks << " stale dropped ";
+                ss << sendQueueStatistics.cancelledChunks << " cancelled " << sendQueueStatistics.pushedChunks << " pushed ";
+                ss << sendQueueStatistics.unsubscribedChunks << " unsubscribed ";
+                ss << (sendQueueStatistics.sentBytes - min(lastSentBytes, sendQueueStatistics.sentBytes)) / 1024 << " KiB/s ";
+                ss << sendQueueStatistics.deltaChunkUpdates << " delta/" << sendQueueStatistics.fullChunkUpdates << " full chunk updates";
+                ChunkPayloadCacheStatistics payloadCacheStatistics = chunkPayloadCache.getStatistics();
+                ss << " Payload Cache : " << payloadCacheStatistics.entries << " chunks " << payloadCacheStatistics.bytes / 1024 << " KiB ";
+                ss << payloadCacheStatistics.hits << " hits " << payloadCacheStatistics.encodes << " encodes";
+                if(tickCount > 0)
+                {
+                    averageTickTime = (float)(totalTickTime / tickCount);
+                    maxTickTime = (float)maxTickTimeThisSecond;
+                }
+                ss << " Tick : " << 1000 * averageTickTime.read() << "ms average " << 1000 * maxTickTime.read() << "ms max";
+                totalTickTime = 0;
+                maxTickTimeThisSecond = 0;
+                tickCount = 0;
+                lastSentBytes = sendQueueStatistics.sentBytes;
+                sendQueueStatus = ss.str();
+            }
+
             auto currentTime = chrono::steady_clock::now();
+            double tickTime = chrono::duration_cast<chrono::duration<double>>(currentTime - tickStartTime).count();
+            totalTickTime += tickTime;
+            maxTickTimeThisSecond = max(maxTickTimeThisSecond, tickTime);
+            tickCount++;
             auto sleepTillTime = lastTime + chrono::nanoseconds((int_fast64_t)(1e9 / 20.0));
             lastTime = currentTime;
             if(currentTime < sleepTillTime)
                 this_thread::sleep_for(sleepTillTime - currentTime);
-            cout << "Connection Count : " << connectionCount << "\x1b[K\r" << flush;
+            cout << "Connection Count : " << connectionCount << sendQueueStatus << "\x1b[K\r" << flush;
             if(anyConnections)
                 gotConnection = true;
             else if(gotConnection)
@@ -473,6 +1358,7 @@ class Server
                 generateChunksCond.notify_all();
             }
         }
+        storage->flush();
         exit(0);
     }
     unordered_set<PositionI> needGenerateChunks;
@@ -493,6 +1379,34 @@ class Server
             generateChunksCond.notify_all();
         return true;
     }
+    /// stops generating the chunks that were cancelled by a connection if no other connection requested them
+    void cancelGenerateChunks(const vector<PositionI> &cancelledChunks)
+    {
+        if(cancelledChunks.empty())
+            return;
+        unordered_set<PositionI> unneededChunks(cancelledChunks.begin(), cancelledChunks.end());
+        {
+            lock_guard<mutex> lockIt(connectionsListLock);
+            for(weak_ptr<Connection> wpConnection : connectionsList)
+            {
+                shared_ptr<Connection> pConnection = wpConnection.lock();
+                if(!pConnection)
+                    continue;
+                lock_guard<mutex> lockIt2(pConnection->requestedChunksLock);
+                for(auto i = unneededChunks.begin(); i != unneededChunks.end();)
+                {
+                    if(pConnection->requestedChunks.find(*i) != pConnection->requestedChunks.end())
+                        i = unneededChunks.erase(i);
+                    else
+                        i++;
+                }
+            }
+        }
+        // a chunk requested again after this is queued again by writeRequestedChunks
+        lock_guard<mutex> lockIt(generateChunksLock);
+        for(PositionI chunkPosition : unneededChunks)
+            needGenerateChunks.erase(chunkPosition);
+    }
     void chunkGenerator()
     {
         vector<pair<PositionI, float>> chunksList;
@@ -552,12 +1466,20 @@ class Server
                 generateChunk(chunkPosition);
             }
             generatingChunks.erase(chunkPosition);
+            notifyAllConnections(); // the chunk may be requested
         }
     }
 public:
     Server(shared_ptr<stream::StreamServer> streamServer)
-        : streamServer(streamServer), world(make_shared<RenderObjectWorld>())
+        : streamServer(streamServer), world(make_shared<RenderObjectWorld>()), storage(make_shared<ChunkStorage>(worldDirectory()))
     {
+        world->setChunkMemoryBudget(chunkMemoryBudget());
+        world->setColdChunkAge(coldChunkAge());
+        storage->registerBlockType(L"stone", getStone());
+        storage->registerBlockType(L"dirt", getDirt());
+        storage->registerBlockType(L"grass", getGrass());
+        storage->registerBlockType(L"glass", getGlass());
+        storage->registerBlockType(L"air", getAir());
     }
     void run()
     {
@@ -568,20 +1490,34 @@ public:
         for(size_t i = 0; i < generateChunkThreadCount; i++)
             thread(&Server::chunkGenerator, this).detach();
         starting.wait(false);
-        while(running)
+        shared_ptr<stream::NetworkServer> networkServer = dynamic_pointer_cast<stream::NetworkServer>(streamServer);
+        if(networkServer != nullptr)
         {
-            try
+            eventLoop = make_shared<stream::NetworkEventLoop>(ioThreadCount());
+            workers = make_shared<WorkerPool>(workerThreadCount());
+            while(running)
             {
-                startConnection(streamServer->accept());
+                startEventLoopConnection(networkServer->acceptSocket());
             }
-            catch(stream::NoStreamsLeftException &)
+        }
+        else
+        {
+            while(running)
             {
-                break;
+                try
+                {
+                    startConnection(streamServer->accept());
+                }
+                catch(stream::NoStreamsLeftException &)
+                {
+                    break;
+                }
             }
         }
         anyConnections.wait(false);
         running = false;
         generateChunksCond.notify_all();
+        storage->flush();
     }
 };
 }
@@ -17,6 +17,7 @@
  */
 #include "networking/client.h"
 #include "networking/server.h"
+#include "networking/local_connection.h"
 #include "stream/stream.h"
 #include "stream/network.h"
 #include "util/util.h"
@@ -53,6 +54,8 @@ void help()
     isQuiet = false;
     outputVersion();
     cout << "usage : voxels [-h | --help] [-q | --quiet] [--server] [--client <server url>]\n";
+    cout << "        [--load-test <bot count> [--load-test-time <seconds>] [--load-test-path random|circle]]\n";
+    cout << "--load-test runs headless bots against the server given with --client or against a server in this process\n";
 }
 
 int error(wstring msg)
@@ -70,8 +73,9 @@ int myMain(vector<wstring> args)
     args.erase(args.begin());
     while(!args.empty() && args.front() == L"")
         args.erase(args.begin());
-    bool isServer = false, isClient = false;
+    bool isServer = false, isClient = false, isLoadTest = false;
     wstring clientAddr;
+    LoadTestOptions loadTestOptions;
     for(auto i = args.begin(); i != args.end(); i++)
     {
         wstring arg = *i;
@@ -105,9 +109,59 @@ int myMain(vector<wstring> args)
             arg = *i;
             clientAddr = arg;
         }
+        else if(arg == L"--load-test")
+        {
+            if(isServer)
+                return error(L"can't specify both server and load test");
+            if(isLoadTest)
+                return error(L"can't specify two load test flags");
+            isLoadTest = true;
+            i++;
+            if(i == args.end())
+                return error(L"--load-test missing bot count");
+            arg = *i;
+            try
+            {
+                loadTestOptions.botCount = stoul(string_cast<string>(arg));
+            }
+            catch(exception &)
+            {
+                return error(L"invalid bot count : " + arg);
+            }
+        }
+        else if(arg == L"--load-test-time")
+        {
+            i++;
+            if(i == args.end())
+                return error(L"--load-test-time missing time");
+            arg = *i;
+            try
+            {
+                loadTestOptions.duration = stod(string_cast<string>(arg));
+            }
+            catch(exception &)
+            {
+                return error(L"invalid load test time : " + arg);
+            }
+        }
+        else if(arg == L"--load-test-path")
+        {
+            i++;
+            if(i == args.end())
+                return error(L"--load-test-path missing path");
+            arg = *i;
+            if(arg == L"random")
+                loadTestOptions.path = LoadTestPath::Random;
+            else if(arg == L"circle")
+                loadTestOptions.path = LoadTestPath::Circle;
+            else
+                return error(L"invalid load test path : " + arg);
+        }
         else
             return error(L"unrecognized argument : " + arg);
     }
+    if(isServer && isLoadTest)
+        return error(L"can't specify both server and load test");
     thread serverThread;
     try
     {
@@ -119,13 +173,42 @@ int myMain(vector<wstring> args)
             runServer(server);
             return 0;
         }
+        if(isLoadTest)
+        {
+            size_t connectionFailures;
+            if(isClient)
+            {
+                connectionFailures = runLoadTest(loadTestOptions, [&]()
+                {
+                    return make_shared<stream::NetworkConnection>(clientAddr, GameVersion::port);
+                });
+            }
+            else
+            {
+                vector<shared_ptr<stream::StreamBidirectionalPipe>> pipes;
+                list<shared_ptr<stream::StreamRW>> serverStreams;
+                for(size_t i = 0; i < loadTestOptions.botCount; i++)
+                {
+                    pipes.push_back(make_shared<stream::StreamBidirectionalPipe>());
+                    serverStreams.push_back(pipes.back()->pport1());
+                }
+                // the server runs until the process exits
+                thread(serverThreadFn, shared_ptr<stream::StreamServer>(new stream::StreamServerWrapper(serverStreams))).detach();
+                size_t nextPipe = 0;
+                connectionFailures = runLoadTest(loadTestOptions, [&]()
+                {
+                    return pipes[nextPipe++]->pport2();
+                });
+            }
+            return connectionFailures > 0 ? 1 : 0;
+        }
         if(isClient)
         {
             shared_ptr<stream::NetworkConnection> connection = make_shared<stream::NetworkConnection>(clientAddr, GameVersion::port);
             runClient(connection);
             return 0;
         }
-        stream::StreamBidirectionalPipe pipe;
+        LocalConnection connection; // the client in this process gets events and chunks without serializing them
         shared_ptr<stream::NetworkServer> server = nullptr;
         try
         {
@@ -136,8 +219,8 @@ int myMain(vector<wstring> args)
         {
             cout << e.what() << endl;
         }
-        serverThread = thread(serverThreadFn, shared_ptr<stream::StreamServer>(new stream::StreamServerWrapper(list<shared_ptr<stream::StreamRW>>{pipe.pport1()}, server)));
-        runClient(pipe.pport2());
+        serverThread = thread(serverThreadFn, shared_ptr<stream::StreamServer>(new stream::StreamServerWrapper(list<shared_ptr<stream::StreamRW>>{connection.pport1()}, server)));
+        runClient(connection.pport2());
     }
     catch(exception & e)
     {
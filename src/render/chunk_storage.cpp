@@ -0,0 +1,587 @@
+#include "render/chunk_storage.h"
+#include "util/variable_set.h"
+#include "util/string_cast.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <array>
+#include <algorithm>
+#include <unordered_set>
+
+using namespace std;
+
+namespace
+{
+void throwErrno()
+{
+    throw stream::IOException(string("IO Error : ") + strerror(errno));
+}
+
+void writeAll(int fd, const uint8_t *data, size_t size, off_t offset)
+{
+    while(size > 0)
+    {
+        ssize_t retval = pwrite(fd, data, size, offset);
+        if(retval < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            throwErrno();
+        }
+        data += retval;
+        size -= retval;
+        offset += retval;
+    }
+}
+}
+
+/** a region file : a fixed-size header followed by chunk payloads
+ *
+ * header :
+ * u32 magic
+ * u32 version
+ * chunksPerRegion entries of { u32 offset, u32 size, u32 allocatedSize }; a size of 0 means that the chunk isn't stored
+ *
+ * a stored chunk is never overwritten : a new copy is written to free space and
+ * its index entry is only written by commit, after the data is synced, so a
+ * crash leaves either the old or the new copy. space that no index entry uses
+ * is found again when the file is opened.
+ */
+class RegionFile final
+{
+    RegionFile(const RegionFile &) = delete;
+    const RegionFile &operator =(const RegionFile &) = delete;
+public:
+    static constexpr uint32_t magic = 0x56585246; // "VXRF"
+    static constexpr uint32_t version = 0;
+    static constexpr size_t entrySize = 3 * sizeof(uint32_t);
+    static constexpr size_t headerSize = 2 * sizeof(uint32_t) + ChunkStorage::chunksPerRegion * entrySize;
+    static constexpr size_t allocationGranularity = 256;
+private:
+    struct Entry
+    {
+        uint32_t offset = 0;
+        uint32_t size = 0;
+        uint32_t allocatedSize = 0;
+    };
+    struct Extent
+    {
+        uint32_t offset;
+        uint32_t size;
+    };
+    const int fd;
+    mutex theLock;
+    array<Entry, ChunkStorage::chunksPerRegion> entries;
+    vector<size_t> uncommittedEntries; // entries that changed since they were last written to the index
+    vector<Extent> freeExtents; // sorted by offset
+    vector<Extent> uncommittedExtents; // replaced in entries but still used by the index on disk
+    vector<Extent> releasedExtents; // not used by the index, but readers may still be reading them
+    vector<weak_ptr<const uint8_t>> oldMappings;
+    size_t fileSize;
+    shared_ptr<const uint8_t> mapping;
+    size_t mappedSize = 0;
+    bool hasReaders() // must hold theLock
+    {
+        oldMappings.erase(std::remove_if(oldMappings.begin(), oldMappings.end(), [](const weak_ptr<const uint8_t> &v)
+        {
+            return v.expired();
+        }), oldMappings.end());
+        return !oldMappings.empty() || mapping.use_count() > 1;
+    }
+    void addFreeExtents(const vector<Extent> &extents) // must hold theLock
+    {
+        freeExtents.insert(freeExtents.end(), extents.begin(), extents.end());
+        std::sort(freeExtents.begin(), freeExtents.end(), [](const Extent &a, const Extent &b)
+        {
+            return a.offset < b.offset;
+        });
+        vector<Extent> merged;
+        for(const Extent &extent : freeExtents)
+        {
+            if(!merged.empty() && merged.back().offset + merged.back().size == extent.offset)
+                merged.back().size += extent.size;
+            else
+                merged.push_back(extent);
+        }
+        freeExtents = std::move(merged);
+    }
+    Extent allocate(size_t size) // must hold theLock
+    {
+        size_t allocatedSize = (size + allocationGranularity - 1) / allocationGranularity * allocationGranularity;
+        if(!releasedExtents.empty() && !hasReaders())
+        {
+            addFreeExtents(releasedExtents);
+            releasedExtents.clear();
+        }
+        for(auto i = freeExtents.begin(); i != freeExtents.end(); i++)
+        {
+            if(i->size < allocatedSize)
+                continue;
+            Extent retval = Extent{i->offset, (uint32_t)allocatedSize};
+            if(i->size == allocatedSize)
+                freeExtents.erase(i);
+            else
+            {
+                i->offset += allocatedSize;
+                i->size -= allocatedSize;
+            }
+            return retval;
+        }
+        if(fileSize + allocatedSize > UINT32_MAX)
+            throw stream::IOException("IO Error : region file is too big");
+        Extent retval = Extent{(uint32_t)fileSize, (uint32_t)allocatedSize};
+        if(ftruncate(fd, fileSize + allocatedSize) != 0)
+            throwErrno();
+        fileSize += allocatedSize;
+        return retval;
+    }
+    void remap() // must hold theLock
+    {
+        if(fileSize == mappedSize)
+            return;
+        void *ptr = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+        if(ptr == MAP_FAILED)
+            throwErrno();
+        size_t size = fileSize;
+        if(mapping != nullptr)
+            oldMappings.push_back(mapping);
+        // readers that still use the old mapping keep it alive
+        mapping = shared_ptr<const uint8_t>((const uint8_t *)ptr, [size](const uint8_t *ptr)
+        {
+            munmap((void *)ptr, size);
+        });
+        mappedSize = fileSize;
+    }
+    void writeEntry(size_t index, const Entry &entry)
+    {
+        stream::MemoryWriter writer(entrySize);
+        stream::write<uint32_t>(writer, entry.offset);
+        stream::write<uint32_t>(writer, entry.size);
+        stream::write<uint32_t>(writer, entry.allocatedSize);
+        writeAll(fd, writer.getBuffer().data(), entrySize, 2 * sizeof(uint32_t) + index * entrySize);
+    }
+    void writeNewHeader() // must hold theLock
+    {
+        stream::MemoryWriter writer(headerSize);
+        stream::write<uint32_t>(writer, magic);
+        stream::write<uint32_t>(writer, version);
+        for(const Entry &entry : entries)
+        {
+            stream::write<uint32_t>(writer, entry.offset);
+            stream::write<uint32_t>(writer, entry.size);
+            stream::write<uint32_t>(writer, entry.allocatedSize);
+        }
+        writeAll(fd, writer.getBuffer().data(), headerSize, 0);
+        fileSize = headerSize;
+    }
+    void readHeader() // must hold theLock
+    {
+        remap();
+        stream::MemoryReader reader(mapping, mappedSize);
+        stream::read_checked<uint32_t>(reader, [](uint32_t v){return v == magic;});
+        stream::read_checked<uint32_t>(reader, [](uint32_t v){return v == version;});
+        vector<Extent> usedExtents;
+        for(Entry &entry : entries)
+        {
+            entry.offset = stream::read<uint32_t>(reader);
+            entry.size = stream::read<uint32_t>(reader);
+            entry.allocatedSize = stream::read<uint32_t>(reader);
+            if(entry.size > entry.allocatedSize || (entry.size > 0 && ((size_t)entry.offset < headerSize || (size_t)entry.offset + entry.allocatedSize > fileSize)))
+                throw stream::InvalidDataValueException("invalid region file entry");
+            if(entry.size > 0)
+                usedExtents.push_back(Extent{entry.offset, entry.allocatedSize});
+        }
+        std::sort(usedExtents.begin(), usedExtents.end(), [](const Extent &a, const Extent &b)
+        {
+            return a.offset < b.offset;
+        });
+        size_t freeOffset = headerSize;
+        vector<Extent> gaps;
+        for(const Extent &extent : usedExtents)
+        {
+            if(extent.offset < freeOffset)
+                throw stream::InvalidDataValueException("overlapping region file entries");
+            if(extent.offset > freeOffset)
+                gaps.push_back(Extent{(uint32_t)freeOffset, (uint32_t)(extent.offset - freeOffset)});
+            freeOffset = (size_t)extent.offset + extent.size;
+        }
+        if(fileSize > freeOffset)
+            gaps.push_back(Extent{(uint32_t)freeOffset, (uint32_t)(fileSize - freeOffset)});
+        addFreeExtents(gaps);
+    }
+public:
+    RegionFile(int fd)
+        : fd(fd)
+    {
+        struct stat st;
+        if(fstat(fd, &st) != 0)
+        {
+            int savedErrno = errno;
+            close(fd);
+            errno = savedErrno;
+            throwErrno();
+        }
+        fileSize = st.st_size;
+        try
+        {
+            lock_guard<mutex> lockIt(theLock);
+            if(fileSize == 0)
+                writeNewHeader();
+            else if(fileSize < headerSize)
+                throw stream::InvalidDataValueException("region file is too small");
+            else
+                readHeader();
+        }
+        catch(...)
+        {
+            close(fd);
+            throw;
+        }
+    }
+    ~RegionFile()
+    {
+        close(fd);
+    }
+    /// returns a reader for the chunk payload that reads directly from the mapped file, or nullptr if the chunk isn't stored
+    shared_ptr<stream::Reader> getReader(size_t index)
+    {
+        lock_guard<mutex> lockIt(theLock);
+        const Entry &entry = entries[index];
+        if(entry.size == 0)
+            return nullptr;
+        if((size_t)entry.offset + entry.size > mappedSize)
+            remap();
+        return make_shared<stream::MemoryReader>(shared_ptr<const uint8_t>(mapping, mapping.get() + entry.offset), entry.size);
+    }
+    /// writes a new copy of the chunk to free space; the index on disk still has the old copy until commit
+    void write(size_t index, const vector<uint8_t> &payload)
+    {
+        assert(!payload.empty());
+        lock_guard<mutex> lockIt(theLock);
+        Extent extent = allocate(payload.size());
+        try
+        {
+            writeAll(fd, payload.data(), payload.size(), extent.offset);
+        }
+        catch(...)
+        {
+            addFreeExtents(vector<Extent>{extent});
+            throw;
+        }
+        Entry &entry = entries[index];
+        if(entry.size > 0)
+            uncommittedExtents.push_back(Extent{entry.offset, entry.allocatedSize});
+        entry.offset = extent.offset;
+        entry.size = payload.size();
+        entry.allocatedSize = extent.size;
+        uncommittedEntries.push_back(index);
+    }
+    /// syncs the chunks written since the last commit and then points the index on disk at them
+    void commit()
+    {
+        vector<pair<size_t, Entry>> committedEntries;
+        vector<Extent> committedExtents;
+        {
+            lock_guard<mutex> lockIt(theLock);
+            if(uncommittedEntries.empty())
+                return;
+            for(size_t index : uncommittedEntries)
+                committedEntries.push_back(make_pair(index, entries[index]));
+            committedExtents = uncommittedExtents;
+        }
+        if(fdatasync(fd) != 0)
+            throwErrno();
+        for(const pair<size_t, Entry> &v : committedEntries)
+            writeEntry(std::get<0>(v), std::get<1>(v));
+        lock_guard<mutex> lockIt(theLock);
+        uncommittedEntries.erase(uncommittedEntries.begin(), uncommittedEntries.begin() + committedEntries.size());
+        uncommittedExtents.erase(uncommittedExtents.begin(), uncommittedExtents.begin() + committedExtents.size());
+        releasedExtents.insert(releasedExtents.end(), committedExtents.begin(), committedExtents.end());
+    }
+};
+
+PositionI ChunkStorage::getRegionPosition(PositionI chunkPosition)
+{
+    return PositionI((chunkPosition.x / StorageChunkType::chunkSizeX) >> regionSizeShiftAmount,
+                     (chunkPosition.y / StorageChunkType::chunkSizeY) >> regionSizeShiftAmount,
+                     (chunkPosition.z / StorageChunkType::chunkSizeZ) >> regionSizeShiftAmount,
+                     chunkPosition.d);
+}
+
+size_t ChunkStorage::getRegionIndex(PositionI chunkPosition)
+{
+    size_t x = (chunkPosition.x / StorageChunkType::chunkSizeX) & (regionSize - 1);
+    size_t y = (chunkPosition.y / StorageChunkType::chunkSizeY) & (regionSize - 1);
+    size_t z = (chunkPosition.z / StorageChunkType::chunkSizeZ) & (regionSize - 1);
+    return (x * regionSize + y) * regionSize + z;
+}
+
+shared_ptr<RegionFile> ChunkStorage::getRegionFile(PositionI regionPosition, bool create)
+{
+    lock_guard<mutex> lockIt(regionsLock);
+    auto iter = regions.find(regionPosition);
+    if(iter != regions.end())
+        return std::get<1>(*iter);
+    wstring fileName = directory + L"/r." + to_wstring(regionPosition.x) + L"." + to_wstring(regionPosition.y) + L"." + to_wstring(regionPosition.z) + L"." + to_wstring((int)regionPosition.d) + L".vxr";
+    int fd = open(string_cast<string>(fileName).c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0666);
+    if(fd < 0)
+    {
+        if(errno == ENOENT && !create)
+            return nullptr;
+        throwErrno();
+    }
+    shared_ptr<RegionFile> retval = make_shared<RegionFile>(fd);
+    if(regions.size() >= maxOpenRegionCount)
+    {
+        for(auto i = regions.begin(); i != regions.end();)
+        {
+            if(std::get<1>(*i).unique()) // not being used
+                i = regions.erase(i);
+            else
+                i++;
+        }
+    }
+    regions[regionPosition] = retval;
+    return retval;
+}
+
+void ChunkStorage::readBlockTypes()
+{
+    shared_ptr<stream::FileReader> preader;
+    try
+    {
+        preader = make_shared<stream::FileReader>(directory + L"/blocks.dat");
+    }
+    catch(stream::IOException &)
+    {
+        return; // new world
+    }
+    uint32_t count = stream::read_limited<uint32_t>(*preader, 1, 0x10000);
+    preader->readString(); // name of the null block
+    for(uint32_t i = 1; i < count; i++)
+    {
+        wstring name = stream::read<wstring>(*preader);
+        nameToStorageId[name] = blockTypeNames.size();
+        blockTypeNames.push_back(name);
+        storageIdToBlock.push_back(RenderObjectBlock());
+    }
+}
+
+void ChunkStorage::writeBlockTypes()
+{
+    wstring fileName = directory + L"/blocks.dat", tempFileName = fileName + L".tmp";
+    {
+        stream::FileWriter writer(tempFileName);
+        stream::write<uint32_t>(writer, blockTypeNames.size());
+        for(const wstring &name : blockTypeNames)
+            stream::write<wstring>(writer, name);
+        writer.flush();
+    }
+    if(rename(string_cast<string>(tempFileName).c_str(), string_cast<string>(fileName).c_str()) != 0)
+        throwErrno();
+}
+
+shared_ptr<ChunkStorage::StorageChunkType> ChunkStorage::toStorageChunk(const RenderObjectChunk::BlockChunkType &blockChunk)
+{
+    shared_ptr<StorageChunkType> retval = make_shared<StorageChunkType>(blockChunk.basePosition);
+    shared_ptr<const RenderObjectChunk::BlockChunkType::Snapshot> blocks = blockChunk.peekSnapshot(); // saving isn't using the chunk, so leave it compacted
+    lock_guard<mutex> lockIt(blockTypesLock);
+    retval->edit([&](StorageChunkType::Snapshot &storageBlocks)
+    {
+        for(int32_t x = 0; x < StorageChunkType::chunkSizeX; x++)
+        {
+            for(int32_t y = 0; y < StorageChunkType::chunkSizeY; y++)
+            {
+                for(int32_t z = 0; z < StorageChunkType::chunkSizeZ; z++)
+                {
+                    const RenderObjectBlock &block = blocks->get(x, y, z);
+                    if(!block)
+                        continue;
+                    auto iter = blockToStorageId.find(block.typeId);
+                    if(iter == blockToStorageId.end())
+                        throw stream::InvalidDataValueException("block type not registered with chunk storage");
+                    storageBlocks.set(x, y, z, std::get<1>(*iter));
+                }
+            }
+        }
+        return true;
+    });
+    return retval;
+}
+
+shared_ptr<RenderObjectChunk> ChunkStorage::fromStorageChunk(const StorageChunkType &storageChunk)
+{
+    RenderObjectChunk::BlockChunkType blockChunk(storageChunk.basePosition);
+    shared_ptr<const StorageChunkType::Snapshot> storageBlocks = storageChunk.getSnapshot();
+    lock_guard<mutex> lockIt(blockTypesLock);
+    blockChunk.edit([&](RenderObjectChunk::BlockChunkType::Snapshot &blocks)
+    {
+        for(int32_t x = 0; x < StorageChunkType::chunkSizeX; x++)
+        {
+            for(int32_t y = 0; y < StorageChunkType::chunkSizeY; y++)
+            {
+                for(int32_t z = 0; z < StorageChunkType::chunkSizeZ; z++)
+                {
+                    StorageBlockId storageId = storageBlocks->get(x, y, z);
+                    if(storageId >= storageIdToBlock.size())
+                        throw stream::InvalidDataValueException("stored block id out of range");
+                    blocks.set(x, y, z, storageIdToBlock[storageId]);
+                }
+            }
+        }
+        return true;
+    });
+    return RenderObjectChunk::make(blockChunk);
+}
+
+shared_ptr<RegionFile> ChunkStorage::writeChunk(shared_ptr<RenderObjectChunk> chunk)
+{
+    PositionI chunkPosition = chunk->blockChunk.basePosition;
+    stream::MemoryWriter writer;
+    VariableSet variableSet;
+    toStorageChunk(chunk->blockChunk)->write(writer, variableSet);
+    shared_ptr<RegionFile> regionFile = getRegionFile(getRegionPosition(chunkPosition), true);
+    regionFile->write(getRegionIndex(chunkPosition), writer.getBuffer());
+    return regionFile;
+}
+
+void ChunkStorage::writeDirtyChunks()
+{
+    lock_guard<mutex> lockIt(writeLock);
+    {
+        lock_guard<mutex> lockIt2(dirtyChunksLock);
+        writingChunks = std::move(dirtyChunks);
+        dirtyChunks.clear();
+    }
+    unordered_set<shared_ptr<RegionFile>> writtenRegionFiles;
+    for(;;)
+    {
+        shared_ptr<RenderObjectChunk> chunk;
+        {
+            lock_guard<mutex> lockIt2(dirtyChunksLock);
+            if(writingChunks.empty())
+                break;
+            chunk = std::get<1>(*writingChunks.begin());
+        }
+        try
+        {
+            writtenRegionFiles.insert(writeChunk(chunk));
+        }
+        catch(stream::IOException &e)
+        {
+            cerr << "error writing chunk : " << e.what() << endl;
+        }
+        lock_guard<mutex> lockIt2(dirtyChunksLock);
+        writingChunks.erase(chunk->blockChunk.basePosition);
+    }
+    for(shared_ptr<RegionFile> regionFile : writtenRegionFiles)
+    {
+        try
+        {
+            regionFile->commit();
+        }
+        catch(stream::IOException &e)
+        {
+            cerr << "error writing region file index : " << e.what() << endl;
+        }
+    }
+}
+
+void ChunkStorage::writer()
+{
+    unique_lock<mutex> lockIt(dirtyChunksLock);
+    while(!stopping)
+    {
+        dirtyChunksCond.wait_for(lockIt, writeInterval());
+        if(dirtyChunks.empty())
+            continue;
+        lockIt.unlock();
+        writeDirtyChunks();
+        lockIt.lock();
+    }
+}
+
+ChunkStorage::ChunkStorage(wstring directory)
+    : directory(directory)
+{
+    if(mkdir(string_cast<string>(directory).c_str(), 0777) != 0 && errno != EEXIST)
+        throwErrno();
+    blockTypeNames.push_back(L"");
+    storageIdToBlock.push_back(RenderObjectBlock());
+    readBlockTypes();
+    writerThread = thread(&ChunkStorage::writer, this);
+}
+
+ChunkStorage::~ChunkStorage()
+{
+    {
+        lock_guard<mutex> lockIt(dirtyChunksLock);
+        stopping = true;
+        dirtyChunksCond.notify_all();
+    }
+    writerThread.join();
+    writeDirtyChunks();
+}
+
+void ChunkStorage::registerBlockType(wstring name, RenderObjectBlock block)
+{
+    assert(!name.empty() && block);
+    lock_guard<mutex> lockIt(blockTypesLock);
+    auto iter = nameToStorageId.find(name);
+    StorageBlockId storageId;
+    if(iter == nameToStorageId.end())
+    {
+        if(blockTypeNames.size() >= 0x10000)
+            throw stream::IOException("IO Error : too many block types");
+        storageId = blockTypeNames.size();
+        nameToStorageId[name] = storageId;
+        blockTypeNames.push_back(name);
+        storageIdToBlock.push_back(block);
+        writeBlockTypes();
+    }
+    else
+    {
+        storageId = std::get<1>(*iter);
+        storageIdToBlock[storageId] = block;
+    }
+    blockToStorageId[block.typeId] = storageId;
+}
+
+shared_ptr<RenderObjectChunk> ChunkStorage::load(PositionI chunkPosition)
+{
+    {
+        lock_guard<mutex> lockIt(dirtyChunksLock);
+        auto iter = dirtyChunks.find(chunkPosition);
+        if(iter != dirtyChunks.end())
+            return std::get<1>(*iter);
+        iter = writingChunks.find(chunkPosition);
+        if(iter != writingChunks.end())
+            return std::get<1>(*iter);
+    }
+    shared_ptr<RegionFile> regionFile = getRegionFile(getRegionPosition(chunkPosition), false);
+    if(regionFile == nullptr)
+        return nullptr;
+    shared_ptr<stream::Reader> preader = regionFile->getReader(getRegionIndex(chunkPosition));
+    if(preader == nullptr)
+        return nullptr;
+    VariableSet variableSet;
+    shared_ptr<StorageChunkType> storageChunk = StorageChunkType::read(*preader, variableSet);
+    if(storageChunk->basePosition != chunkPosition)
+        throw stream::InvalidDataValueException("stored chunk is at the wrong position");
+    return fromStorageChunk(*storageChunk);
+}
+
+void ChunkStorage::markDirty(shared_ptr<RenderObjectChunk> chunk)
+{
+    lock_guard<mutex> lockIt(dirtyChunksLock);
+    dirtyChunks[chunk->blockChunk.basePosition] = chunk;
+}
+
+void ChunkStorage::flush()
+{
+    writeDirtyChunks();
+}
@@ -16,6 +16,7 @@
  *
  */
 #include "stream/network.h"
+#include "stream/network_buffer.h"
 #include "util/util.h"
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -25,6 +26,12 @@
 #include <signal.h>
 #include <netinet/tcp.h>
 #include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
 
 using namespace std;
 
@@ -38,11 +45,163 @@ initializer signalInit([]()
     signal(SIGPIPE, SIG_IGN);
 });
 
-class NetworkWriter final : public Writer
+atomic_uint_fast64_t flushCount(0), urgentFlushCount(0), coalescedFlushCount(0), sendCallCount(0), sentByteCount(0);
+
+class NetworkWriter;
+
+/** sends the held back flushes of all the NetworkWriters when their delay is up, on one thread.
+ * it only sends what the sockets take without waiting, so a peer that stops reading can't hold up the other writers.
+ */
+class NetworkWriterFlushTimer final
 {
+    NetworkWriterFlushTimer(const NetworkWriterFlushTimer &) = delete;
+    const NetworkWriterFlushTimer &operator =(const NetworkWriterFlushTimer &) = delete;
 private:
-    vector<uint8_t> buffer;
+    mutex lock;
+    condition_variable cond;
+    multimap<chrono::steady_clock::time_point, weak_ptr<NetworkWriter>> writers;
+    NetworkWriterFlushTimer()
+    {
+        thread(&NetworkWriterFlushTimer::run, this).detach();
+    }
+    void run();
+public:
+    static NetworkWriterFlushTimer &get()
+    {
+        static NetworkWriterFlushTimer *retval = new NetworkWriterFlushTimer;
+        return *retval;
+    }
+    /// calls writer->sendHeldBack() at deadline
+    void schedule(weak_ptr<NetworkWriter> writer, chrono::steady_clock::time_point deadline)
+    {
+        lock_guard<mutex> lockIt(lock);
+        bool isFirst = writers.empty() || deadline < std::get<0>(*writers.begin());
+        writers.insert(make_pair(deadline, writer));
+        if(isFirst)
+            cond.notify_all();
+    }
+};
+
+/** writes to a blocking socket, corking small flushes in the application.
+ *
+ * a flush with less than coalesceSize() bytes waiting is held back for up to
+ * coalesceDelay() so that the flushes that follow it are sent with the same
+ * system call; the held back bytes are sent by the next flush or by
+ * NetworkWriterFlushTimer when the delay is up. flushUrgent sends right away.
+ * TCP_NODELAY is set once, so the bytes leave as soon as they are sent.
+ * lock is never held while sending.
+ */
+class NetworkWriter final : public Writer, public enable_shared_from_this<NetworkWriter>
+{
+private:
+    NetworkOutputQueue queue; // bytes written since the last flush; only used by the writing thread
     int fd;
+    mutex lock;
+    condition_variable cond; // notified when sending is cleared
+    NetworkOutputQueue flushedQueue; // flushed bytes that aren't sent yet; locked by lock
+    size_t flushedCount = 0; // the number of flushes in flushedQueue
+    bool hasDeadline = false; // if the flush timer is going to send flushedQueue
+    bool sending = false; // if a thread is sending bytes it took from flushedQueue
+    string error; // the error from the last failed send on the flush timer
+    static size_t flushSize()
+    {
+        return 16384;
+    }
+    static size_t coalesceSize() // flushes are sent right away once this many bytes are waiting
+    {
+        return 4096;
+    }
+    static chrono::steady_clock::duration coalesceDelay() // the longest time a flush is held back
+    {
+        return chrono::microseconds(500);
+    }
+    /** sends flushedQueue with lock unlocked while sending.
+     * if wait is false, it only sends what the socket takes right away and leaves the rest for the next flush
+     * or the flush timer; it doesn't wait for another thread that is sending either.
+     * returns false if the socket failed.
+     */
+    bool sendFlushed(unique_lock<mutex> &lockIt, bool wait)
+    {
+        if(wait)
+            hasDeadline = false;
+        if(flushedCount > 1)
+            coalescedFlushCount += flushedCount - 1;
+        flushedCount = 0;
+        while(!flushedQueue.empty() && error.empty())
+        {
+            if(sending) // the sending thread sends the rest when it's done
+            {
+                if(!wait)
+                    return true;
+                cond.wait(lockIt);
+                continue;
+            }
+            NetworkOutputQueue sendQueue = std::move(flushedQueue);
+            flushedQueue.clear();
+            sending = true;
+            lockIt.unlock();
+            size_t size = sendQueue.size();
+            uint64_t sendCalls = 0;
+            bool succeeded = sendQueue.send(fd, &sendCalls, wait);
+            sendCallCount += sendCalls;
+            sentByteCount += size - sendQueue.size();
+            lockIt.lock();
+            sending = false;
+            cond.notify_all();
+            if(!succeeded)
+            {
+                error = string("io error : ") + strerror(errno);
+                flushedQueue.clear();
+                return false;
+            }
+            if(!sendQueue.empty()) // the socket is full, so put the bytes back in front of the ones flushed since
+            {
+                sendQueue.append(std::move(flushedQueue));
+                flushedQueue = std::move(sendQueue);
+                if(!wait)
+                {
+                    schedule();
+                    return true;
+                }
+            }
+        }
+        return error.empty();
+    }
+    /// must hold lock; has the flush timer send flushedQueue after coalesceDelay()
+    void schedule()
+    {
+        if(hasDeadline)
+            return;
+        hasDeadline = true;
+        NetworkWriterFlushTimer::get().schedule(shared_from_this(), chrono::steady_clock::now() + coalesceDelay());
+    }
+    void flush(bool urgent)
+    {
+        unique_lock<mutex> lockIt(lock);
+        if(!error.empty())
+        {
+            queue.clear();
+            throw IOException(error);
+        }
+        if(!queue.empty())
+        {
+            flushCount++;
+            flushedCount++;
+            if(urgent)
+                urgentFlushCount++;
+            flushedQueue.append(std::move(queue));
+            queue.clear();
+        }
+        if(flushedQueue.empty())
+            return;
+        if(urgent || flushedQueue.size() >= coalesceSize())
+        {
+            if(!sendFlushed(lockIt, true))
+                throw IOException(error);
+            return;
+        }
+        schedule();
+    }
 public:
     NetworkWriter(int fd)
         : fd(fd)
@@ -52,38 +211,212 @@ public:
     }
     virtual ~NetworkWriter()
     {
+        {
+            unique_lock<mutex> lockIt(lock);
+            if(error.empty())
+                sendFlushed(lockIt, true);
+        }
         close(fd);
     }
+    /// called by the flush timer when the held back bytes are due
+    void sendHeldBack()
+    {
+        unique_lock<mutex> lockIt(lock);
+        hasDeadline = false;
+        sendFlushed(lockIt, false); // a failure is thrown by the next flush
+    }
     virtual void writeByte(uint8_t v)
     {
-        buffer.push_back(v);
-        if(buffer.size() >= 16384)
+        queue.append(v);
+        if(queue.size() >= flushSize())
+            flush();
+    }
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        queue.append(array, count);
+        if(queue.size() >= flushSize())
+            flush();
+    }
+    virtual void writeSharedBytes(shared_ptr<const uint8_t> bytes, size_t count) override
+    {
+        queue.append(bytes, count);
+        if(queue.size() >= flushSize())
             flush();
     }
-    virtual void flush()
+    virtual void flush() override
+    {
+        flush(false);
+    }
+    virtual void flushUrgent() override
+    {
+        flush(true);
+    }
+};
+
+void NetworkWriterFlushTimer::run()
+{
+    unique_lock<mutex> lockIt(lock);
+    for(;;)
+    {
+        if(writers.empty())
+        {
+            cond.wait(lockIt);
+            continue;
+        }
+        auto deadline = std::get<0>(*writers.begin());
+        if(chrono::steady_clock::now() < deadline)
+        {
+            cond.wait_until(lockIt, deadline);
+            continue;
+        }
+        shared_ptr<NetworkWriter> writer = std::get<1>(*writers.begin()).lock();
+        writers.erase(writers.begin());
+        if(writer == nullptr)
+            continue;
+        lockIt.unlock();
+        writer->sendHeldBack();
+        writer = nullptr; // the last reference may close the socket, so it's dropped before locking again
+        lockIt.lock();
+    }
+}
+
+/** reads from a socket through a large receive buffer filled with recv.
+ *
+ * bulk reads are copied out of the buffer with memcpy and reads that are bigger
+ * than the buffer are received straight into the destination. viewBytes parses
+ * framed payloads in place; views bigger than the buffer aren't supported, so
+ * the buffer stays at bufferSize() whatever sizes the peer sends.
+ */
+class NetworkReader final : public Reader
+{
+private:
+    int fd;
+    vector<uint8_t> buffer;
+    size_t start = 0, end = 0; // the received bytes that aren't read yet
+    static size_t bufferSize()
+    {
+        return 65536;
+    }
+    /** returns the number of bytes received.
+     * if wait is false it returns 0 when nothing can be received right away, leaving
+     * the end of the stream or an error to be reported by the next read that waits.
+     */
+    size_t receive(uint8_t *bytes, size_t count, bool wait)
     {
-        const uint8_t * pbuffer = buffer.data();
-        ssize_t sizeLeft = buffer.size();
-        while(sizeLeft > 0)
+        for(;;)
         {
-            ssize_t retval = send(fd, (const void *)pbuffer, sizeLeft, 0);
-            if(retval == -1)
-            {
-                throw IOException(string("io error : ") + strerror(errno));
-            }
-            else
+            ssize_t retval = ::recv(fd, (void *)bytes, count, wait ? 0 : MSG_DONTWAIT);
+            if(retval > 0)
+                return retval;
+            if(retval == -1 && errno == EINTR)
+                continue;
+            if(!wait)
+                return 0;
+            if(retval == 0)
+                throw EOFException();
+            throw IOException(string("io error : ") + strerror(errno));
+        }
+    }
+    /// waits until at least count bytes are in the buffer; count can't be more than bufferSize()
+    void fill(size_t count)
+    {
+        assert(count <= bufferSize());
+        if(end - start >= count)
+            return;
+        if(buffer.size() - start < count) // move the bytes to the start to make room
+        {
+            memmove((void *)buffer.data(), (const void *)(buffer.data() + start), end - start);
+            end -= start;
+            start = 0;
+        }
+        while(end - start < count)
+            end += receive(buffer.data() + end, buffer.size() - end, true);
+    }
+public:
+    explicit NetworkReader(int fd)
+        : fd(fd), buffer(bufferSize())
+    {
+    }
+    virtual ~NetworkReader()
+    {
+        close(fd);
+    }
+    virtual uint8_t readByte() override
+    {
+        fill(1);
+        return buffer[start++];
+    }
+    virtual bool dataAvailable() override
+    {
+        if(start < end)
+            return true;
+        start = end = 0;
+        end = receive(buffer.data(), buffer.size(), false);
+        return end > 0;
+    }
+    virtual void readBytes(uint8_t * array, size_t count) override
+    {
+        size_t copySize = min(count, end - start);
+        memcpy((void *)array, (const void *)(buffer.data() + start), copySize);
+        start += copySize;
+        array += copySize;
+        count -= copySize;
+        if(count >= bufferSize()) // too big to be worth copying through the buffer
+        {
+            while(count > 0)
             {
-                sizeLeft -= retval;
-                pbuffer += retval;
+                size_t receivedSize = receive(array, count, true);
+                array += receivedSize;
+                count -= receivedSize;
             }
+            return;
+        }
+        if(count == 0)
+            return;
+        fill(count);
+        memcpy((void *)array, (const void *)(buffer.data() + start), count);
+        start += count;
+    }
+    virtual const uint8_t * viewBytes(size_t count) override
+    {
+        if(count > bufferSize()) // the buffer doesn't grow, so the caller reads them into its own buffer
+            return nullptr;
+        fill(count);
+        return buffer.data() + start;
+    }
+    virtual void skipBytes(size_t count) override
+    {
+        size_t skipSize = min(count, end - start);
+        start += skipSize;
+        count -= skipSize;
+        while(count > 0)
+        {
+            start = end = 0;
+            fill(1);
+            skipSize = min(count, end);
+            start = skipSize;
+            count -= skipSize;
         }
-        int flag = 1;
-        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&flag, sizeof(flag));
-        buffer.clear();
     }
 };
 }
 
+NetworkConnection::NetworkConnection(int readFd, int writeFd)
+    : readerInternal(new NetworkReader(readFd)), writerInternal(new NetworkWriter(writeFd))
+{
+}
+
+NetworkWriterStatistics getNetworkWriterStatistics()
+{
+    NetworkWriterStatistics retval;
+    retval.flushes = flushCount;
+    retval.urgentFlushes = urgentFlushCount;
+    retval.coalescedFlushes = coalescedFlushCount;
+    retval.sendCalls = sendCallCount;
+    retval.sentBytes = sentByteCount;
+    return retval;
+}
+
 NetworkConnection::NetworkConnection(wstring url, uint16_t port)
 {
     string url_utf8 = string_cast<string>(url), port_str = to_string((unsigned)port);
@@ -132,8 +465,8 @@ NetworkConnection::NetworkConnection(wstring url, uint16_t port)
     setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&flag, sizeof(flag));
 
     freeaddrinfo(addrList);
-    readerInternal = unique_ptr<Reader>(new FileReader(fdopen(dup(fd), "r")));
-    writerInternal = unique_ptr<Writer>(new NetworkWriter(fd));
+    readerInternal = unique_ptr<Reader>(new NetworkReader(dup(fd)));
+    writerInternal = shared_ptr<Writer>(new NetworkWriter(fd));
 }
 
 NetworkServer::NetworkServer(uint16_t port)
@@ -205,7 +538,7 @@ NetworkServer::~NetworkServer()
     close(fd);
 }
 
-shared_ptr<StreamRW> NetworkServer::accept()
+int NetworkServer::acceptSocket()
 {
     int fd2 = ::accept(fd, nullptr, nullptr);
 
@@ -218,8 +551,14 @@ shared_ptr<StreamRW> NetworkServer::accept()
 
     int flag = 1;
     setsockopt(fd2, IPPROTO_TCP, TCP_NODELAY, (const void *)&flag, sizeof(flag));
+    return fd2;
+}
+
+shared_ptr<StreamRW> NetworkServer::accept()
+{
+    int fd2 = acceptSocket();
 
-    shared_ptr<Reader> reader = shared_ptr<Reader>(new FileReader(fdopen(dup(fd2), "r")));
+    shared_ptr<Reader> reader = shared_ptr<Reader>(new NetworkReader(dup(fd2)));
     shared_ptr<Writer> writer = shared_ptr<Writer>(new NetworkWriter(fd2));
     return shared_ptr<StreamRW>(new StreamRWWrapper(reader, writer));
 }
@@ -0,0 +1,89 @@
+/*
+ * Voxels is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Voxels is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Voxels; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#include "stream/network_buffer.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <cstring>
+
+using namespace std;
+
+namespace stream
+{
+
+namespace
+{
+constexpr size_t maxSegmentsPerSend = 64;
+}
+
+bool NetworkOutputQueue::send(int fd, uint64_t *sendCallCount, bool wait)
+{
+    sealTail();
+    while(!segments.empty())
+    {
+        iovec iov[maxSegmentsPerSend];
+        size_t iovCount = 0;
+        for(auto i = segments.begin(); i != segments.end() && iovCount < maxSegmentsPerSend; i++)
+        {
+            const uint8_t *bytes = i->bytes.get();
+            size_t size = i->size;
+            if(iovCount == 0)
+            {
+                bytes += firstSegmentOffset;
+                size -= firstSegmentOffset;
+            }
+            iov[iovCount].iov_base = (void *)bytes;
+            iov[iovCount].iov_len = size;
+            iovCount++;
+        }
+        msghdr message;
+        memset((void *)&message, 0, sizeof(message));
+        message.msg_iov = &iov[0];
+        message.msg_iovlen = iovCount;
+        ssize_t retval = ::sendmsg(fd, &message, MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT));
+        if(sendCallCount != nullptr)
+            ++*sendCallCount;
+        if(retval == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            return false;
+        }
+        size_t sentSize = retval;
+        byteCount -= sentSize;
+        while(sentSize > 0)
+        {
+            size_t sizeLeft = segments.front().size - firstSegmentOffset;
+            if(sentSize < sizeLeft)
+            {
+                firstSegmentOffset += sentSize;
+                break;
+            }
+            sentSize -= sizeLeft;
+            segments.pop_front();
+            firstSegmentOffset = 0;
+        }
+    }
+    firstSegmentOffset = 0;
+    return true;
+}
+
+}
@@ -0,0 +1,380 @@
+/*
+ * Voxels is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Voxels is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Voxels; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#include "stream/network_event_loop.h"
+#include "stream/network.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+namespace stream
+{
+
+namespace
+{
+/// queues written bytes and passes them to NetworkEventLoopConnection::write when flushed
+class NetworkEventLoopWriter final : public Writer
+{
+private:
+    NetworkEventLoopConnection &connection;
+    NetworkOutputQueue queue;
+public:
+    explicit NetworkEventLoopWriter(NetworkEventLoopConnection &connection)
+        : connection(connection)
+    {
+    }
+    virtual void writeByte(uint8_t v) override
+    {
+        queue.append(v);
+    }
+    virtual void writeBytes(const uint8_t *array, size_t count) override
+    {
+        queue.append(array, count);
+    }
+    virtual void writeSharedBytes(shared_ptr<const uint8_t> bytes, size_t count) override
+    {
+        queue.append(bytes, count);
+    }
+    virtual void flush() override
+    {
+        if(connection.isClosed())
+            throw IOException("io error : connection closed");
+        connection.write(std::move(queue));
+        queue.clear();
+    }
+};
+}
+
+NetworkEventLoopConnection::NetworkEventLoopConnection(NetworkEventLoop &eventLoop, int fd, EventHandler eventHandler, NotifyHandler drainedHandler, NotifyHandler closedHandler)
+    : eventLoop(eventLoop), fd(fd), eventHandler(eventHandler), drainedHandler(drainedHandler), closedHandler(closedHandler), writerInternal(new NetworkEventLoopWriter(*this))
+{
+}
+
+NetworkEventLoopConnection::~NetworkEventLoopConnection()
+{
+    ::close(fd);
+}
+
+void NetworkEventLoopConnection::rearm()
+{
+    epoll_event event;
+    memset((void *)&event, 0, sizeof(event));
+    event.events = EPOLLRDHUP | EPOLLONESHOT;
+    if(!readingPaused)
+        event.events |= EPOLLIN;
+    if(!outputQueue.empty())
+        event.events |= EPOLLOUT;
+    event.data.fd = fd;
+    epoll_ctl(eventLoop.epollFd, EPOLL_CTL_MOD, fd, &event);
+}
+
+bool NetworkEventLoopConnection::sendBuffered()
+{
+    return outputQueue.send(fd);
+}
+
+void NetworkEventLoopConnection::write(const uint8_t *bytes, size_t count)
+{
+    if(count == 0)
+        return;
+    NetworkOutputQueue queue;
+    queue.append(bytes, count);
+    write(std::move(queue));
+}
+
+void NetworkEventLoopConnection::write(NetworkOutputQueue &&queue)
+{
+    if(queue.empty())
+        return;
+    lock_guard<mutex> lockIt(lock);
+    if(closed)
+        return;
+    bool wasEmpty = outputQueue.empty();
+    outputQueue.append(std::move(queue));
+    if(!wasEmpty)
+        return; // the socket is already waiting to be writable
+    if(!sendBuffered())
+    {
+        closed = true;
+        shutdown(fd, SHUT_RDWR); // an I/O thread finishes closing it
+        return;
+    }
+    if(!outputQueue.empty() && !handling)
+        rearm();
+}
+
+void NetworkEventLoopConnection::pauseReading()
+{
+    lock_guard<mutex> lockIt(lock);
+    if(readingPaused)
+        return;
+    readingPaused = true;
+    if(!handling && !closed)
+        rearm();
+}
+
+void NetworkEventLoopConnection::resumeReading()
+{
+    lock_guard<mutex> lockIt(lock);
+    if(!readingPaused)
+        return;
+    readingPaused = false;
+    if(!handling && !closed)
+        rearm();
+}
+
+void NetworkEventLoopConnection::close()
+{
+    lock_guard<mutex> lockIt(lock);
+    if(closed)
+        return;
+    closed = true;
+    shutdown(fd, SHUT_RDWR); // an I/O thread finishes closing it
+}
+
+NetworkEventLoop::NetworkEventLoop(size_t ioThreadCount)
+    : stopping(false)
+{
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd == -1)
+        throw NetworkException(string("epoll_create1: ") + strerror(errno));
+    stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(stopFd == -1)
+    {
+        int temp = errno;
+        ::close(epollFd);
+        throw NetworkException(string("eventfd: ") + strerror(temp));
+    }
+    epoll_event event;
+    memset((void *)&event, 0, sizeof(event));
+    event.events = EPOLLIN; // level triggered so every I/O thread sees it
+    event.data.fd = stopFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, stopFd, &event);
+    for(size_t i = 0; i < ioThreadCount; i++)
+        ioThreads.push_back(thread(&NetworkEventLoop::ioThread, this));
+}
+
+NetworkEventLoop::~NetworkEventLoop()
+{
+    stopping = true;
+    uint64_t value = 1;
+    ssize_t retval = ::write(stopFd, (const void *)&value, sizeof(value));
+    (void)retval;
+    for(thread &t : ioThreads)
+        t.join();
+    unordered_map<int, shared_ptr<NetworkEventLoopConnection>> remainingConnections;
+    {
+        lock_guard<mutex> lockIt(connectionsLock);
+        remainingConnections.swap(connections);
+    }
+    for(auto &v : remainingConnections)
+        finishClose(std::get<1>(v));
+    ::close(stopFd);
+    ::close(epollFd);
+}
+
+shared_ptr<NetworkEventLoopConnection> NetworkEventLoop::add(int fd, NetworkEventLoopConnection::EventHandler eventHandler, NetworkEventLoopConnection::NotifyHandler drainedHandler, NetworkEventLoopConnection::NotifyHandler closedHandler)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        int temp = errno;
+        ::close(fd);
+        throw NetworkException(string("fcntl: ") + strerror(temp));
+    }
+    shared_ptr<NetworkEventLoopConnection> retval = shared_ptr<NetworkEventLoopConnection>(new NetworkEventLoopConnection(*this, fd, eventHandler, drainedHandler, closedHandler));
+    {
+        lock_guard<mutex> lockIt(connectionsLock);
+        connections[fd] = retval;
+    }
+    epoll_event event;
+    memset((void *)&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.fd = fd;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        int temp = errno;
+        {
+            lock_guard<mutex> lockIt(connectionsLock);
+            connections.erase(fd);
+        }
+        throw NetworkException(string("epoll_ctl: ") + strerror(temp));
+    }
+    return retval;
+}
+
+void NetworkEventLoop::finishClose(shared_ptr<NetworkEventLoopConnection> connection)
+{
+    NetworkEventLoopConnection::NotifyHandler closedHandler;
+    {
+        lock_guard<mutex> lockIt(connection->lock);
+        connection->closed = true;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, nullptr);
+        closedHandler = connection->closedHandler;
+        // release the handlers so they can't keep the connection alive
+        connection->eventHandler = nullptr;
+        connection->drainedHandler = nullptr;
+        connection->closedHandler = nullptr;
+    }
+    if(closedHandler)
+        closedHandler();
+}
+
+void NetworkEventLoop::handle(shared_ptr<NetworkEventLoopConnection> connection, uint32_t events)
+{
+    bool failed = false, drained = false;
+    NetworkEventLoopConnection::EventHandler eventHandler;
+    {
+        lock_guard<mutex> lockIt(connection->lock);
+        connection->handling = true;
+        eventHandler = connection->eventHandler;
+        if(connection->closed)
+            failed = true;
+        if(!failed && (events & EPOLLOUT) != 0)
+        {
+            if(!connection->sendBuffered())
+                failed = true;
+            else if(connection->outputQueue.empty())
+                drained = true;
+        }
+    }
+    if(!failed && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0)
+    {
+        // only this thread touches inputBuffer because the socket is one-shot
+        shared_ptr<vector<uint8_t>> inputBuffer = std::move(connection->inputBuffer);
+        if(inputBuffer == nullptr)
+            inputBuffer = NetworkBufferPool::get().make(recvSize());
+        size_t readSize = 0;
+        while(readSize < readSizePerWakeup())
+        {
+            size_t usedSize = inputBuffer->size();
+            inputBuffer->resize(usedSize + recvSize());
+            ssize_t retval = ::recv(connection->fd, (void *)(inputBuffer->data() + usedSize), recvSize(), 0);
+            inputBuffer->resize(usedSize + (retval > 0 ? (size_t)retval : 0));
+            if(retval == -1)
+            {
+                if(errno == EINTR)
+                    continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK)
+                    failed = true;
+                break;
+            }
+            if(retval == 0)
+            {
+                failed = true; // end of stream
+                break;
+            }
+            readSize += retval;
+        }
+        size_t offset = 0;
+        try
+        {
+            // the events point into inputBuffer so it's not changed after this
+            shared_ptr<const uint8_t> bytes(inputBuffer, inputBuffer->data());
+            NetworkEvent event;
+            for(;;)
+            {
+                size_t eventSize = NetworkEvent::parse(shared_ptr<const uint8_t>(bytes, bytes.get() + offset), inputBuffer->size() - offset, event);
+                if(eventSize == 0)
+                    break;
+                offset += eventSize;
+                if(eventHandler)
+                    eventHandler(std::move(event));
+            }
+        }
+        catch(IOException &e) // a bad event, like one bigger than NetworkEvent::maxEventSize(), closes the connection
+        {
+            cerr << "IO Error : " << e.what() << endl;
+            failed = true;
+        }
+        if(offset == 0 || (offset < inputBuffer->size() && inputBuffer.use_count() == 1))
+        {
+            // no events point into it any more, so keep using it
+            inputBuffer->erase(inputBuffer->begin(), inputBuffer->begin() + offset);
+            connection->inputBuffer = std::move(inputBuffer);
+        }
+        else if(offset < inputBuffer->size())
+        {
+            // events still point into inputBuffer, so move the partial event to a new buffer
+            shared_ptr<vector<uint8_t>> newInputBuffer = NetworkBufferPool::get().make(max(recvSize(), inputBuffer->size() - offset));
+            newInputBuffer->assign(inputBuffer->begin() + offset, inputBuffer->end());
+            connection->inputBuffer = std::move(newInputBuffer);
+        }
+    }
+    NetworkEventLoopConnection::NotifyHandler drainedHandler;
+    {
+        lock_guard<mutex> lockIt(connection->lock);
+        connection->handling = false;
+        if(!failed && !connection->closed)
+        {
+            connection->rearm();
+            if(drained)
+                drainedHandler = connection->drainedHandler;
+        }
+    }
+    if(failed || connection->isClosed())
+    {
+        {
+            lock_guard<mutex> lockIt(connectionsLock);
+            connections.erase(connection->fd);
+        }
+        finishClose(connection);
+        return;
+    }
+    if(drainedHandler)
+        drainedHandler();
+}
+
+void NetworkEventLoop::ioThread()
+{
+    epoll_event events[64];
+    while(!stopping)
+    {
+        int count = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), -1);
+        if(count == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            cerr << "epoll_wait : " << strerror(errno) << endl;
+            break;
+        }
+        for(int i = 0; i < count && !stopping; i++)
+        {
+            if(events[i].data.fd == stopFd)
+                continue;
+            shared_ptr<NetworkEventLoopConnection> connection;
+            {
+                lock_guard<mutex> lockIt(connectionsLock);
+                auto iter = connections.find(events[i].data.fd);
+                if(iter != connections.end())
+                    connection = std::get<1>(*iter);
+            }
+            if(connection != nullptr)
+                handle(connection, events[i].events);
+        }
+    }
+}
+
+}
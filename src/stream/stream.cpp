@@ -20,8 +20,17 @@
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
+#include <climits>
 #include "util/util.h"
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 using namespace std;
 
@@ -30,9 +39,295 @@ namespace stream
 
 namespace
 {
-const size_t bufferSize = 1 << 15;
+constexpr size_t pipeBufferSize = (size_t)1 << 16; // a power of 2
+constexpr size_t pipePublishInterval = pipeBufferSize / 4; // the reader frees space for the writer after reading this much
 
-struct Pipe
+/// a word that threads can wait on until it changes, like a futex
+struct WaitWord final
+{
+    atomic<uint32_t> value;
+#ifdef __linux__
+    static_assert(sizeof(atomic<uint32_t>) == sizeof(uint32_t), "atomic<uint32_t> can't be used as a futex");
+#else
+    mutex lock;
+    condition_variable cond;
+#endif
+    WaitWord()
+        : value(0)
+    {
+    }
+    /// waits until value isn't expected; can return early
+    void wait(uint32_t expected)
+    {
+#ifdef __linux__
+        syscall(SYS_futex, (uint32_t *)&value, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+        unique_lock<mutex> lockIt(lock);
+        while(value.load() == expected)
+            cond.wait(lockIt);
+#endif
+    }
+    /// changes value and wakes the threads waiting on it
+    void wake()
+    {
+#ifdef __linux__
+        value++;
+        syscall(SYS_futex, (uint32_t *)&value, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+        {
+            lock_guard<mutex> lockIt(lock);
+            value++;
+        }
+        cond.notify_all();
+#endif
+    }
+};
+
+/** single-producer single-consumer ring buffer shared by a PipeReader and a PipeWriter.
+ *
+ * the positions only increase and each is only changed by one side, so reading and writing
+ * don't lock. a side only blocks when the ring is empty or full, waiting on a WaitWord after
+ * setting its waiting flag; the other side only makes the system call to wake it if the flag is set.
+ */
+struct Pipe final
+{
+    atomic_size_t readPosition, writePosition;
+    atomic_bool readerWaiting, writerWaiting, closed;
+    WaitWord dataAdded, spaceAdded;
+    uint8_t buffer[pipeBufferSize];
+    Pipe()
+        : readPosition(0), writePosition(0), readerWaiting(false), writerWaiting(false), closed(false)
+    {
+    }
+    void close()
+    {
+        closed = true;
+        dataAdded.wake();
+        spaceAdded.wake();
+    }
+};
+
+class PipeReader final : public Reader
+{
+private:
+    shared_ptr<Pipe> pipe;
+    size_t readPosition = 0, publishedPosition = 0; // the bytes up to publishedPosition are given back to the writer
+    size_t availableEnd = 0; // the write position last seen
+    void publish()
+    {
+        publishedPosition = readPosition;
+        pipe->readPosition.store(readPosition);
+        if(pipe->writerWaiting.load())
+            pipe->spaceAdded.wake();
+    }
+    void consumed(size_t count)
+    {
+        readPosition += count;
+        if(readPosition - publishedPosition >= pipePublishInterval)
+            publish();
+    }
+    void waitForData()
+    {
+        availableEnd = pipe->writePosition.load(memory_order_acquire);
+        if(readPosition != availableEnd)
+            return;
+        publish();
+        for(;;)
+        {
+            uint32_t wakeCount = pipe->dataAdded.value.load();
+            pipe->readerWaiting.store(true);
+            availableEnd = pipe->writePosition.load();
+            if(readPosition != availableEnd)
+                break;
+            if(pipe->closed.load())
+            {
+                availableEnd = pipe->writePosition.load(); // the writer may have flushed just before closing
+                if(readPosition != availableEnd)
+                    break;
+                pipe->readerWaiting.store(false);
+                throw EOFException();
+            }
+            pipe->dataAdded.wait(wakeCount);
+        }
+        pipe->readerWaiting.store(false);
+    }
+public:
+    PipeReader(shared_ptr<Pipe> pipe)
+        : pipe(pipe)
+    {
+    }
+    virtual ~PipeReader()
+    {
+        pipe->close();
+    }
+    virtual uint8_t readByte() override
+    {
+        if(readPosition == availableEnd)
+            waitForData();
+        uint8_t retval = pipe->buffer[readPosition % pipeBufferSize];
+        consumed(1);
+        return retval;
+    }
+    virtual void readBytes(uint8_t * array, size_t count) override
+    {
+        while(count > 0)
+        {
+            if(readPosition == availableEnd)
+                waitForData();
+            size_t offset = readPosition % pipeBufferSize;
+            size_t size = min(min(count, availableEnd - readPosition), pipeBufferSize - offset);
+            memcpy((void *)array, (const void *)&pipe->buffer[offset], size);
+            array += size;
+            count -= size;
+            consumed(size);
+        }
+    }
+    virtual bool dataAvailable() override
+    {
+        if(readPosition != availableEnd)
+            return true;
+        availableEnd = pipe->writePosition.load(memory_order_acquire);
+        return readPosition != availableEnd;
+    }
+};
+
+class PipeWriter final : public Writer
+{
+private:
+    shared_ptr<Pipe> pipe;
+    size_t writePosition = 0, flushedPosition = 0; // the bytes up to flushedPosition can be read
+    size_t spaceEnd = pipeBufferSize; // the read position last seen plus the ring size
+    void waitForSpace()
+    {
+        spaceEnd = pipe->readPosition.load(memory_order_acquire) + pipeBufferSize;
+        if(writePosition != spaceEnd)
+            return;
+        flush(); // so the reader can empty the ring
+        for(;;)
+        {
+            uint32_t wakeCount = pipe->spaceAdded.value.load();
+            pipe->writerWaiting.store(true);
+            spaceEnd = pipe->readPosition.load() + pipeBufferSize;
+            if(writePosition != spaceEnd)
+                break;
+            if(pipe->closed.load())
+            {
+                pipe->writerWaiting.store(false);
+                throw IOException("can't write to closed pipe");
+            }
+            pipe->spaceAdded.wait(wakeCount);
+        }
+        pipe->writerWaiting.store(false);
+    }
+public:
+    PipeWriter(shared_ptr<Pipe> pipe)
+        : pipe(pipe)
+    {
+    }
+    virtual ~PipeWriter()
+    {
+        pipe->close();
+    }
+    virtual void writeByte(uint8_t v) override
+    {
+        if(writePosition == spaceEnd)
+            waitForSpace();
+        pipe->buffer[writePosition++ % pipeBufferSize] = v;
+    }
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        while(count > 0)
+        {
+            if(writePosition == spaceEnd)
+                waitForSpace();
+            size_t offset = writePosition % pipeBufferSize;
+            size_t size = min(min(count, spaceEnd - writePosition), pipeBufferSize - offset);
+            memcpy((void *)&pipe->buffer[offset], (const void *)array, size);
+            array += size;
+            count -= size;
+            writePosition += size;
+        }
+    }
+    virtual void flush() override
+    {
+        if(writePosition == flushedPosition)
+            return;
+        if(pipe->closed.load())
+            throw IOException("can't write to closed pipe");
+        flushedPosition = writePosition;
+        pipe->writePosition.store(writePosition);
+        if(pipe->readerWaiting.load())
+            pipe->dataAdded.wake();
+    }
+    virtual bool writeWaits() override
+    {
+        if(writePosition != spaceEnd)
+            return true;
+        spaceEnd = pipe->readPosition.load(memory_order_acquire) + pipeBufferSize;
+        return writePosition != spaceEnd;
+    }
+};
+}
+
+StreamPipe::StreamPipe()
+{
+    shared_ptr<Pipe> pipe = make_shared<Pipe>();
+    readerInternal = shared_ptr<Reader>(new PipeReader(pipe));
+    writerInternal = shared_ptr<Writer>(new PipeWriter(pipe));
+}
+
+uint8_t DumpingReader::readByte()
+{
+    uint8_t retval = reader.readByte();
+    cerr << "Read Byte : " << (unsigned)retval << "\n";
+    return retval;
+}
+
+#if 0
+namespace
+{
+void readIt(shared_ptr<Reader> preader)
+{
+    try
+    {
+        while(true)
+        {
+            cout << hex << (int)preader->readByte() << endl;
+        }
+    }
+    catch(IOException & e)
+    {
+        cout << "Error : " << e.what() << endl;
+    }
+}
+
+initializer init1([]()
+{
+    shared_ptr<Writer> pwriter;
+    thread readerThread;
+    {
+        StreamPipe pipe;
+        readerThread = thread(readIt, pipe.preader());
+        pwriter = pipe.pwriter();
+    }
+    for(int i = 0; i < 0x100; i++)
+    {
+        pwriter->writeByte(i);
+    }
+    pwriter->flush();
+    readerThread.join();
+    exit(0);
+});
+}
+#endif // 1
+
+#ifdef STREAM_PIPE_BENCHMARK
+// build with -DSTREAM_PIPE_BENCHMARK to compare StreamPipe with the mutex-based double-buffered pipe it replaced
+namespace
+{
+const size_t lockedPipeBufferSize = 1 << 15;
+
+struct LockedPipe
 {
     mutex lock;
     condition_variable_any cond;
@@ -46,23 +341,23 @@ struct Pipe
     bool canWrite = true;
     size_t readerPosition = 0;
     size_t bufferSizes[2];
-    uint8_t buffers[2][bufferSize];
-    Pipe()
+    uint8_t buffers[2][lockedPipeBufferSize];
+    LockedPipe()
         : bufferSizes{0, 0}
     {
     }
 };
 
-class PipeReader final : public Reader
+class LockedPipeReader final : public Reader
 {
 private:
-    shared_ptr<Pipe> pipe;
+    shared_ptr<LockedPipe> pipe;
 public:
-    PipeReader(shared_ptr<Pipe> pipe)
+    LockedPipeReader(shared_ptr<LockedPipe> pipe)
         : pipe(pipe)
     {
     }
-    virtual ~PipeReader()
+    virtual ~LockedPipeReader()
     {
         pipe->lock.lock();
         pipe->closed = true;
@@ -105,17 +400,17 @@ public:
     }
 };
 
-class PipeWriter final : public Writer
+class LockedPipeWriter final : public Writer
 {
 private:
-    shared_ptr<Pipe> pipe;
+    shared_ptr<LockedPipe> pipe;
 public:
-    PipeWriter(shared_ptr<Pipe> pipe)
+    LockedPipeWriter(shared_ptr<LockedPipe> pipe)
         : pipe(pipe)
     {
     }
 
-    virtual ~PipeWriter()
+    virtual ~LockedPipeWriter()
     {
         pipe->lock.lock();
         pipe->closed = true;
@@ -125,7 +420,7 @@ public:
 
     virtual void writeByte(uint8_t v) override
     {
-        while(!pipe->canWrite || pipe->bufferSizes[pipe->writerBufferIndex()] >= bufferSize)
+        while(!pipe->canWrite || pipe->bufferSizes[pipe->writerBufferIndex()] >= lockedPipeBufferSize)
         {
             if(!pipe->canWrite)
             {
@@ -168,61 +463,61 @@ public:
 
     virtual bool writeWaits() override
     {
-        return pipe->bufferSizes[pipe->writerBufferIndex()] < bufferSize && pipe->canWrite;
+        return pipe->bufferSizes[pipe->writerBufferIndex()] < lockedPipeBufferSize && pipe->canWrite;
     }
 };
-}
 
-StreamPipe::StreamPipe()
+/// pipe throughput benchmark : sends totalSize bytes from this thread to another in writes of spanSize bytes
+double benchmarkPipe(shared_ptr<Reader> preader, shared_ptr<Writer> pwriter, size_t totalSize, size_t spanSize)
 {
-    shared_ptr<Pipe> pipe = make_shared<Pipe>();
-    readerInternal = shared_ptr<Reader>(new PipeReader(pipe));
-    writerInternal = shared_ptr<Writer>(new PipeWriter(pipe));
+    auto startTime = chrono::steady_clock::now();
+    thread readerThread([preader, totalSize, spanSize]()
+    {
+        vector<uint8_t> buffer(spanSize);
+        for(size_t i = 0; i < totalSize; i += spanSize)
+        {
+            if(spanSize == 1)
+                preader->readByte();
+            else
+                preader->readBytes(buffer.data(), spanSize);
+        }
+    });
+    vector<uint8_t> buffer(spanSize, 0x5A);
+    for(size_t i = 0; i < totalSize; i += spanSize)
+    {
+        if(spanSize == 1)
+            pwriter->writeByte(buffer[0]);
+        else
+            pwriter->writeBytes(buffer.data(), spanSize);
+        if(i % 4096 == 0)
+            pwriter->flush();
+    }
+    pwriter->flush();
+    readerThread.join();
+    return (double)totalSize / chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now() - startTime).count();
 }
 
-uint8_t DumpingReader::readByte()
+double benchmarkStreamPipe(size_t totalSize, size_t spanSize)
 {
-    uint8_t retval = reader.readByte();
-    cerr << "Read Byte : " << (unsigned)retval << "\n";
-    return retval;
+    StreamPipe pipe;
+    return benchmarkPipe(pipe.preader(), pipe.pwriter(), totalSize, spanSize);
 }
 
-#if 0
-namespace
+double benchmarkLockedPipe(size_t totalSize, size_t spanSize)
 {
-void readIt(shared_ptr<Reader> preader)
-{
-    try
-    {
-        while(true)
-        {
-            cout << hex << (int)preader->readByte() << endl;
-        }
-    }
-    catch(IOException & e)
-    {
-        cout << "Error : " << e.what() << endl;
-    }
+    shared_ptr<LockedPipe> pipe = make_shared<LockedPipe>();
+    return benchmarkPipe(make_shared<LockedPipeReader>(pipe), make_shared<LockedPipeWriter>(pipe), totalSize, spanSize);
 }
 
-initializer init1([]()
+initializer init2([]()
 {
-    shared_ptr<Writer> pwriter;
-    thread readerThread;
-    {
-        StreamPipe pipe;
-        readerThread = thread(readIt, pipe.preader());
-        pwriter = pipe.pwriter();
-    }
-    for(int i = 0; i < 0x100; i++)
-    {
-        pwriter->writeByte(i);
-    }
-    pwriter->flush();
-    readerThread.join();
+    cout << "locked pipe bytes : " << benchmarkLockedPipe((size_t)64 << 20, 1) / 1e6 << " MB/s" << endl;
+    cout << "locked pipe 4 KiB spans : " << benchmarkLockedPipe((size_t)1 << 30, 4096) / 1e6 << " MB/s" << endl;
+    cout << "StreamPipe bytes : " << benchmarkStreamPipe((size_t)64 << 20, 1) / 1e6 << " MB/s" << endl;
+    cout << "StreamPipe 4 KiB spans : " << benchmarkStreamPipe((size_t)1 << 30, 4096) / 1e6 << " MB/s" << endl;
     exit(0);
 });
 }
-#endif // 1
+#endif // STREAM_PIPE_BENCHMARK
 
 }